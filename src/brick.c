@@ -1,15 +1,146 @@
 #include <math.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <jibal_units.h>
 #include <gsl/gsl_sf_erf.h>
 #include <gsl/gsl_math.h>
 #include "brick.h"
 
-extern inline double erf_Q_fast(double x) { /* Approximative gaussian CDF */
+double erf_Q_fast(double x) { /* Approximative gaussian CDF */
     return x < 0.0 ? 1.0-0.5*exp(0.77428768622*x-0.37825569191*x*x) : 0.5*exp(-0.77428768622*x-0.37825569191*x*x);
     /* Based on: Tsay, WJ., Huang, C.J., Fu, TT. et al. J Prod Anal 39, 259–269 (2013). https://doi.org/10.1007/s11123-012-0283-1 */
 }
 
+static inline double exp_nonpositive(double y) { /* exp(y) for -708 < y <= 0 without branches or calls, so that loops calling this can be vectorized */
+    const double shift = 6755399441055744.0; /* 1.5 * 2^52, after adding this the lowest bits of the mantissa are round(y / ln 2) */
+    double n = y * 1.4426950408889634 + shift;
+    double k = n - shift;
+    double r = y - k * 6.93147180369123816490e-01 - k * 1.90821492927058770002e-10; /* |r| <= ln(2)/2 */
+    uint64_t bits;
+    memcpy(&bits, &n, sizeof(bits));
+    bits = (bits + 1023) << 52; /* 2^k */
+    double scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    double p = 1.0 + r * (1.0 + r * (1.0 / 2.0 + r * (1.0 / 6.0 + r * (1.0 / 24.0 + r * (1.0 / 120.0 + r * (1.0 / 720.0 + r * (1.0 / 5040.0 + r * (1.0 / 40320.0))))))));
+    return p * scale;
+}
+
+static inline double erf_Q_poly_inline(double x) {
+    double z = fabs(x) * M_SQRT1_2;
+    z = 0.5 * (z + 26.0 - fabs(z - 26.0)); /* min(z, 26.0), result would underflow anyway. Ternary operator would prevent vectorization. */
+    double t = 1.0 / (1.0 + 0.5 * z);
+    double q = 0.5 * t * exp_nonpositive(-z * z - 1.26551223 + t * (1.00002368 + t * (0.37409196 + t * (0.09678418 + t * (-0.18628806 + t * (0.27886807 + t * (-1.13520398 + t * (1.48851587 + t * (-0.82215223 + t * 0.17087277)))))))));
+    /* Chebyshev fit of erfc, see W. H. Press et al., Numerical Recipes in C, 2nd ed., section 6.2. Relative error less than 1.2e-7. */
+    double sign = copysign(1.0, x);
+    return 0.5 * (1.0 - sign) + sign * q; /* q or 1 - q, depending on sign of x */
+}
+
+double erf_Q_poly(double x) {
+    return erf_Q_poly_inline(x);
+}
+
+void erf_Q_poly_array(double * restrict out, const double * restrict x, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        out[i] = erf_Q_poly_inline(x[i]);
+    }
+}
+
+static double erf_Q_table_coeffs[ERF_Q_TABLE_N][4]; /* Cubic polynomial for each interval, last one is constant zero */
+static int erf_Q_table_ready = FALSE;
+
+void erf_Q_table_init(void) {
+    int ready = erf_Q_table_ready;
+#pragma omp flush
+    if(ready) { /* Flag is set (and flushed) only after the table is complete. Flush above keeps the table from being read before the flag. */
+        return;
+    }
+#pragma omp critical(erf_Q_table)
+    {
+        if(!erf_Q_table_ready) {
+            const double h = 1.0 / ERF_Q_TABLE_STEPS;
+            const double pdf_norm = 0.5 * M_2_SQRTPI * M_SQRT1_2; /* 1/sqrt(2 pi) */
+            double Q_0 = gsl_sf_erf_Q(-ERF_Q_TABLE_X_MAX);
+            double D_0 = -h * pdf_norm * exp(-0.5 * ERF_Q_TABLE_X_MAX * ERF_Q_TABLE_X_MAX); /* Derivative of Q (minus gaussian PDF) in units of table step */
+            for(int i = 0; i < ERF_Q_TABLE_N - 1; i++) {
+                double x_1 = -ERF_Q_TABLE_X_MAX + (i + 1) * h;
+                double Q_1 = gsl_sf_erf_Q(x_1);
+                double D_1 = -h * pdf_norm * exp(-0.5 * x_1 * x_1);
+                double *coeff = erf_Q_table_coeffs[i];
+                coeff[0] = Q_0;
+                coeff[1] = D_0;
+                coeff[2] = 3.0 * (Q_1 - Q_0) - 2.0 * D_0 - D_1;
+                coeff[3] = 2.0 * (Q_0 - Q_1) + D_0 + D_1;
+                Q_0 = Q_1;
+                D_0 = D_1;
+            }
+            memset(erf_Q_table_coeffs[ERF_Q_TABLE_N - 1], 0, sizeof(erf_Q_table_coeffs[ERF_Q_TABLE_N - 1])); /* Q(x) = 0 for x >= ERF_Q_TABLE_X_MAX */
+#pragma omp flush
+            erf_Q_table_ready = TRUE;
+        }
+    }
+}
+
+static inline double erf_Q_table_inline(double x) { /* erf_Q_table_init() must be called first */
+    double u = (x + ERF_Q_TABLE_X_MAX) * ERF_Q_TABLE_STEPS;
+    u = fmin(fmax(u, 0.0), ERF_Q_TABLE_N - 1); /* Q(x) = 1 for x <= -ERF_Q_TABLE_X_MAX, last interval is zero. Infinities and NaN are clamped too, so the index is always valid. */
+    int i = (int) u;
+    double t = u - i;
+    const double *coeff = erf_Q_table_coeffs[i];
+    double q = coeff[0] + t * (coeff[1] + t * (coeff[2] + t * coeff[3]));
+    return isnan(x) ? x : q; /* Like gsl_sf_erf_Q() */
+}
+
+double erf_Q_table(double x) {
+    erf_Q_table_init();
+    return erf_Q_table_inline(x);
+}
+
+bricks_soa *bricks_soa_alloc(size_t n_alloc) {
+    if(n_alloc == 0) {
+        return NULL;
+    }
+    bricks_soa *bs = malloc(sizeof(bricks_soa));
+    if(!bs) {
+        return NULL;
+    }
+    bs->n = 0;
+    bs->n_alloc = n_alloc;
+    bs->E = malloc(n_alloc * sizeof(double));
+    bs->S_sum_inv = malloc(n_alloc * sizeof(double));
+    bs->Q = malloc(n_alloc * sizeof(double));
+    if(!bs->E || !bs->S_sum_inv || !bs->Q) {
+        bricks_soa_free(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+int bricks_soa_set(bricks_soa *bs, const brick *bricks, size_t last_brick) {
+    if(!bs || last_brick >= bs->n_alloc) {
+        return EXIT_FAILURE;
+    }
+    bs->n = last_brick + 1;
+    for(size_t i = 0; i < bs->n; i++) {
+        const brick *b = &bricks[i];
+        bs->E[i] = b->E;
+        bs->S_sum_inv[i] = 1.0 / b->S_sum;
+        bs->Q[i] = b->valid ? b->Q : 0.0;
+    }
+    return EXIT_SUCCESS;
+}
+
+void bricks_soa_free(bricks_soa *bs) {
+    if(!bs) {
+        return;
+    }
+    free(bs->E);
+    free(bs->S_sum_inv);
+    free(bs->Q);
+    free(bs);
+}
+
 void bricks_calculate_sigma(const detector *det, const jibal_isotope *isotope, brick *bricks, size_t last_brick) {
     for(size_t i = 0; i <= last_brick; i++) {
         //double old = bricks[i].S_sum;
@@ -18,13 +149,25 @@ void bricks_calculate_sigma(const detector *det, const jibal_isotope *isotope, b
     }
 }
 
-void bricks_convolute(jabs_histogram *h, const calibration *c, const brick *bricks, size_t last_brick, const double scale, const double sigmas_cutoff, double emin, int accurate) {
-    double (*erf_Q)(double);
-    if(accurate) {
-        erf_Q = gsl_sf_erf_Q;
+void bricks_convolute(jabs_histogram *h, const calibration *c, const brick *bricks, size_t last_brick, const double scale, const double sigmas_cutoff, double emin, bricks_convolution method, bricks_soa *bs) {
+    if(method == BRICKS_CONVOLUTION_EXACT) {
+        bricks_convolute_scalar(h, c, bricks, last_brick, scale, sigmas_cutoff, emin, gsl_sf_erf_Q);
+        return;
+    }
+    bricks_soa *bs_tmp = NULL;
+    if(!bs || last_brick >= bs->n_alloc) { /* No buffer given, make one for this call */
+        bs_tmp = bricks_soa_alloc(last_brick + 1);
+        bs = bs_tmp;
+    }
+    if(bricks_soa_set(bs, bricks, last_brick)) { /* Scalar fallback, same results */
+        bricks_convolute_scalar(h, c, bricks, last_brick, scale, sigmas_cutoff, emin, method == BRICKS_CONVOLUTION_TABLE ? erf_Q_table : erf_Q_poly);
     } else {
-        erf_Q = erf_Q_fast;
+        bricks_convolute_soa(h, c, bs, scale, sigmas_cutoff, emin, method);
     }
+    bricks_soa_free(bs_tmp);
+}
+
+void bricks_convolute_scalar(jabs_histogram *h, const calibration *c, const brick *bricks, size_t last_brick, const double scale, const double sigmas_cutoff, double emin, double (*erf_Q)(double)) {
 
     for(size_t i = 1; i <= last_brick; i++) {
         const brick *b_low = &bricks[i]; /* Low refers to lower index number (i), not that b_low->E < b_high->E! (incident ion has lower energy as function of i, but not necessarily the detected energy of the reaction product) */
@@ -70,3 +213,56 @@ void bricks_convolute(jabs_histogram *h, const calibration *c, const brick *bric
 #endif
     }
 }
+
+static void bricks_convolute_soa_kernel(double * restrict bin, const double * restrict range, size_t j_start, size_t j_stop,
+                                        double E_low, double S_low_inv, double E_high, double S_high_inv, double scale) { /* Channels j_start, ..., j_stop - 1. No branches, loop can be vectorized. */
+    for(size_t j = j_start; j < j_stop; j++) {
+        const double E = (range[j] + range[j + 1]) / 2.0;
+        const double w = range[j + 1] - range[j];
+        const double y = erf_Q_poly_inline((E_low - E) * S_low_inv) - erf_Q_poly_inline((E_high - E) * S_high_inv);
+        bin[j] += scale * y * w;
+    }
+}
+
+static void bricks_convolute_soa_kernel_table(double * restrict bin, const double * restrict range, size_t j_start, size_t j_stop,
+                                              double E_low, double S_low_inv, double E_high, double S_high_inv, double scale) { /* Same as above, but with erf_Q_table() */
+    for(size_t j = j_start; j < j_stop; j++) {
+        const double E = (range[j] + range[j + 1]) / 2.0;
+        const double w = range[j + 1] - range[j];
+        const double y = erf_Q_table_inline((E_low - E) * S_low_inv) - erf_Q_table_inline((E_high - E) * S_high_inv);
+        bin[j] += scale * y * w;
+    }
+}
+
+void bricks_convolute_soa(jabs_histogram *h, const calibration *c, const bricks_soa *bs, const double scale, const double sigmas_cutoff, double emin, bricks_convolution method) { /* Same as bricks_convolute_scalar(), but bricks are read from bs and the loop over channels is done by a vectorizable kernel */
+    void (*kernel)(double *, const double *, size_t, size_t, double, double, double, double, double) = bricks_convolute_soa_kernel;
+    if(method == BRICKS_CONVOLUTION_TABLE) {
+        erf_Q_table_init();
+        kernel = bricks_convolute_soa_kernel_table;
+    }
+    for(size_t i = 1; i < bs->n; i++) {
+        if(bs->Q[i] == 0.0) {
+            continue;
+        }
+        const double E_low = bs->E[i], E_high = bs->E[i - 1];
+        const double sigma_low = sigmas_cutoff / bs->S_sum_inv[i], sigma_high = sigmas_cutoff / bs->S_sum_inv[i - 1];
+        double E_cutoff_low, E_cutoff_high;
+        if(E_low < E_high) {
+            E_cutoff_low = E_low - sigma_low;
+            E_cutoff_high = E_high + sigma_high;
+        } else {
+            E_cutoff_low = E_high - sigma_high;
+            E_cutoff_high = E_low + sigma_low;
+        }
+        if(E_cutoff_high < emin) {
+            continue;
+        }
+        E_cutoff_low = GSL_MAX_DBL(E_cutoff_low, emin);
+        size_t j_start = calibration_inverse(c, E_cutoff_low, h->n);
+        size_t j_stop = j_start;
+        while(j_stop < h->n - 1 && h->range[j_stop] <= E_cutoff_high) {
+            j_stop++;
+        }
+        kernel(h->bin, h->range, j_start, j_stop, E_low, bs->S_sum_inv[i], E_high, bs->S_sum_inv[i - 1], scale * bs->Q[i] / (E_high - E_low));
+    }
+}
@@ -21,6 +21,24 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+
+#define ERF_Q_TABLE_X_MAX 9 /* Integer. erf_Q(x) is tabulated for |x| < ERF_Q_TABLE_X_MAX, outside this range it is 0 or 1 (error less than 1.2e-19) */
+#define ERF_Q_TABLE_STEPS 64 /* Table points per unit of x (per sigma) */
+#define ERF_Q_TABLE_N (2 * ERF_Q_TABLE_X_MAX * ERF_Q_TABLE_STEPS + 1)
+
+typedef enum bricks_convolution {
+    BRICKS_CONVOLUTION_FAST = 0, /* Vectorized kernel, erf_Q_poly() */
+    BRICKS_CONVOLUTION_EXACT = 1, /* gsl_sf_erf_Q() */
+    BRICKS_CONVOLUTION_TABLE = 2 /* Tabulated erf_Q with cubic interpolation, erf_Q_table() */
+} bricks_convolution;
+
+static const jibal_option bricks_convolution_option[] = {
+        {"fast", BRICKS_CONVOLUTION_FAST},
+        {"exact", BRICKS_CONVOLUTION_EXACT},
+        {"table", BRICKS_CONVOLUTION_TABLE},
+        {NULL, 0}
+};
+
 typedef struct {
     int valid;
     depth d; /* Depth from sample surface */
@@ -43,8 +61,26 @@ typedef struct {
     double effective_stopping;
 } brick;
 
+typedef struct bricks_soa { /* Structure-of-arrays copy of the brick fields that are needed in convolution */
+    size_t n;
+    size_t n_alloc; /* Arrays have space for this many bricks */
+    double *E;
+    double *S_sum_inv; /* 1/S_sum */
+    double *Q; /* Zero for invalid bricks */
+} bricks_soa;
+
+double erf_Q_fast(double x); /* Approximative gaussian CDF, absolute error about 1e-3 */
+double erf_Q_poly(double x); /* Approximative gaussian CDF, relative error about 1e-7. Same as the kernel used by fast convolution. */
+void erf_Q_poly_array(double *out, const double *x, size_t n); /* Vectorizable loop of erf_Q_poly() */
+double erf_Q_table(double x); /* Approximative gaussian CDF, absolute error about 1e-10. Piecewise cubic (Hermite) interpolation of a table computed with gsl_sf_erf_Q() on first use. */
+void erf_Q_table_init(void); /* Computes the table of erf_Q_table() unless that has been done already. Thread safe. Called by sim_workspace_init(), so that threads do not have to wait for the table later. */
+bricks_soa *bricks_soa_alloc(size_t n_alloc); /* Buffer for up to n_alloc bricks, set with bricks_soa_set() */
+int bricks_soa_set(bricks_soa *bs, const brick *bricks, size_t last_brick); /* Copies bricks 0, 1, ..., last_brick. Returns EXIT_FAILURE if they don't fit. */
+void bricks_soa_free(bricks_soa *bs);
 void bricks_calculate_sigma(const detector *det, const jibal_isotope *isotope, brick *bricks, size_t last_brick); /* Sums up all the contributions to sigma (including detector resolution) */
-void bricks_convolute(jabs_histogram *h, const calibration *c, const brick *bricks, size_t last_brick, double scale, double sigmas_cutoff, double emin, int accurate);
+void bricks_convolute(jabs_histogram *h, const calibration *c, const brick *bricks, size_t last_brick, double scale, double sigmas_cutoff, double emin, bricks_convolution method, bricks_soa *bs); /* Exact method uses bricks_convolute_scalar(), others a bricks_soa copy of bricks made in bs. If bs is NULL (or too small), a temporary one is allocated. */
+void bricks_convolute_scalar(jabs_histogram *h, const calibration *c, const brick *bricks, size_t last_brick, double scale, double sigmas_cutoff, double emin, double (*erf_Q)(double)); /* Reference implementation, one channel at a time */
+void bricks_convolute_soa(jabs_histogram *h, const calibration *c, const bricks_soa *bs, double scale, double sigmas_cutoff, double emin, bricks_convolution method); /* Method can be fast or table */
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <gsl/gsl_sf_erf.h>
+#include <gsl/gsl_math.h>
+#include <jibal_units.h>
+#include "brick.h"
+#include "calibration.h"
+#include "generic.h"
+
+#define BRICK_TEST_N_CHANNELS_MIN 2048
+#define BRICK_TEST_N_CHANNELS_MAX 131072
+#define BRICK_TEST_N_MODES 4
+#define BRICK_TEST_N_BRICKS 2000
+#define BRICK_TEST_REPEATS 100
+#define BRICK_TEST_N_POINTS 100000 /* Points for erf_Q evaluation benchmark */
+#define BRICK_TEST_X_MAX 10.0
+#define BRICK_TEST_REL_ERROR_Q_MIN 1.0e-15 /* Relative error is not computed in the far tail, erf_Q_table() gives zero there */
+
+static double erf_Q_max_error(double (*erf_Q)(double), double *rel_error_max) { /* Returns maximum absolute error compared to gsl_sf_erf_Q() on [-BRICK_TEST_X_MAX, BRICK_TEST_X_MAX], sets maximum relative error */
+    double abs_error_max = 0.0;
+    *rel_error_max = 0.0;
+    for(int i = 0; i <= BRICK_TEST_N_POINTS; i++) {
+        double x = -BRICK_TEST_X_MAX + 2.0 * BRICK_TEST_X_MAX * i / BRICK_TEST_N_POINTS;
+        double ref = gsl_sf_erf_Q(x);
+        double error = fabs(erf_Q(x) - ref);
+        abs_error_max = GSL_MAX_DBL(abs_error_max, error);
+        if(ref > BRICK_TEST_REL_ERROR_Q_MIN) {
+            *rel_error_max = GSL_MAX_DBL(*rel_error_max, error / ref);
+        }
+    }
+    return abs_error_max;
+}
+
+static double erf_Q_time(double (*erf_Q)(double), const double *x, double *out) { /* Time per evaluation, in seconds */
+    double start = jabs_clock();
+    for(int i_repeat = 0; i_repeat < BRICK_TEST_REPEATS; i_repeat++) {
+        for(int i = 0; i < BRICK_TEST_N_POINTS; i++) {
+            out[i] = erf_Q(x[i]);
+        }
+    }
+    return (jabs_clock() - start) / (1.0 * BRICK_TEST_REPEATS * BRICK_TEST_N_POINTS);
+}
+
+static double convolute_max_error(const jabs_histogram *h, const jabs_histogram *h_ref) { /* Relative to maximum of h_ref */
+    double ref_max = 0.0, error_max = 0.0;
+    for(size_t i = 0; i < h_ref->n; i++) {
+        ref_max = GSL_MAX_DBL(ref_max, fabs(h_ref->bin[i]));
+        error_max = GSL_MAX_DBL(error_max, fabs(h->bin[i] - h_ref->bin[i]));
+    }
+    return ref_max > 0.0 ? error_max / ref_max : 0.0;
+}
+
+int main(int argc, char **argv) {
+    (void) argc;
+    (void) argv;
+    double *x = malloc(BRICK_TEST_N_POINTS * sizeof(double));
+    double *out = malloc(BRICK_TEST_N_POINTS * sizeof(double));
+    for(int i = 0; i < BRICK_TEST_N_POINTS; i++) {
+        x[i] = -BRICK_TEST_X_MAX + 2.0 * BRICK_TEST_X_MAX * i / BRICK_TEST_N_POINTS;
+    }
+    double rel_fast, rel_poly, rel_table;
+    double abs_fast = erf_Q_max_error(erf_Q_fast, &rel_fast);
+    double abs_poly = erf_Q_max_error(erf_Q_poly, &rel_poly);
+    double abs_table = erf_Q_max_error(erf_Q_table, &rel_table);
+    double t_gsl = erf_Q_time(gsl_sf_erf_Q, x, out);
+    double t_fast = erf_Q_time(erf_Q_fast, x, out);
+    double t_poly = erf_Q_time(erf_Q_poly, x, out);
+    double t_table = erf_Q_time(erf_Q_table, x, out);
+    double start = jabs_clock();
+    for(int i_repeat = 0; i_repeat < BRICK_TEST_REPEATS; i_repeat++) {
+        erf_Q_poly_array(out, x, BRICK_TEST_N_POINTS);
+    }
+    double t_poly_array = (jabs_clock() - start) / (1.0 * BRICK_TEST_REPEATS * BRICK_TEST_N_POINTS);
+    fprintf(stderr, "erf_Q evaluation, %i points in [%g, %g]:\n", BRICK_TEST_N_POINTS, -BRICK_TEST_X_MAX, BRICK_TEST_X_MAX);
+    fprintf(stderr, "%-20s %8.3lf ns (reference)\n", "gsl_sf_erf_Q", t_gsl * 1.0e9);
+    fprintf(stderr, "%-20s %8.3lf ns, max abs error %9.3e, max rel error %9.3e\n", "erf_Q_fast", t_fast * 1.0e9, abs_fast, rel_fast);
+    fprintf(stderr, "%-20s %8.3lf ns, max abs error %9.3e, max rel error %9.3e\n", "erf_Q_poly", t_poly * 1.0e9, abs_poly, rel_poly);
+    fprintf(stderr, "%-20s %8.3lf ns (same results as erf_Q_poly)\n", "erf_Q_poly_array", t_poly_array * 1.0e9);
+    fprintf(stderr, "%-20s %8.3lf ns, max abs error %9.3e, max rel error %9.3e\n", "erf_Q_table", t_table * 1.0e9, abs_table, rel_table);
+
+    brick *bricks = calloc(BRICK_TEST_N_BRICKS, sizeof(brick));
+    for(size_t i = 0; i < BRICK_TEST_N_BRICKS; i++) { /* Decreasing energy, increasing straggling, with some wiggles */
+        brick *b = &bricks[i];
+        b->valid = TRUE;
+        b->E = (4000.0 - 1.9 * i + 3.0 * sin(0.1 * i)) * C_KEV;
+        b->S_sum = (3.0 + 0.01 * i) * C_KEV;
+        b->Q = 1.0 + 0.5 * sin(1.0 * i);
+    }
+    const size_t last_brick = BRICK_TEST_N_BRICKS - 1;
+    bricks_soa *bs = bricks_soa_alloc(BRICK_TEST_N_BRICKS); /* Buffer is allocated once, like in sim_reaction */
+    const double sigmas_cutoff = 5.0;
+    const char *mode_names[BRICK_TEST_N_MODES] = {"exact", "scalar, erf_Q_fast", "fast", "table"};
+    for(size_t n_channels = BRICK_TEST_N_CHANNELS_MIN; n_channels <= BRICK_TEST_N_CHANNELS_MAX; n_channels *= 4) {
+        calibration *c = calibration_init_linear();
+        calibration_set_param(c, CALIBRATION_PARAM_OFFSET, 10.0 * C_KEV);
+        calibration_set_param(c, CALIBRATION_PARAM_SLOPE, 4096.0 * C_KEV / n_channels); /* Same energy range regardless of number of channels */
+        jabs_histogram *h[BRICK_TEST_N_MODES];
+        double t_conv[BRICK_TEST_N_MODES];
+        int n_repeats = (int) GSL_MAX_INT(1, BRICK_TEST_REPEATS * BRICK_TEST_N_CHANNELS_MIN / n_channels);
+        for(int mode = 0; mode < BRICK_TEST_N_MODES; mode++) {
+            h[mode] = jabs_histogram_alloc(n_channels);
+            calibration_apply_to_histogram(c, h[mode]);
+            start = jabs_clock();
+            for(int i_repeat = 0; i_repeat < n_repeats; i_repeat++) {
+                jabs_histogram_reset(h[mode]);
+                switch(mode) {
+                    case 0:
+                        bricks_convolute(h[mode], c, bricks, last_brick, 1.0, sigmas_cutoff, 0.0, BRICKS_CONVOLUTION_EXACT, bs);
+                        break;
+                    case 1:
+                        bricks_convolute_scalar(h[mode], c, bricks, last_brick, 1.0, sigmas_cutoff, 0.0, erf_Q_fast);
+                        break;
+                    case 2:
+                        bricks_convolute(h[mode], c, bricks, last_brick, 1.0, sigmas_cutoff, 0.0, BRICKS_CONVOLUTION_FAST, bs);
+                        break;
+                    default:
+                        bricks_convolute(h[mode], c, bricks, last_brick, 1.0, sigmas_cutoff, 0.0, BRICKS_CONVOLUTION_TABLE, bs);
+                        break;
+                }
+            }
+            t_conv[mode] = (jabs_clock() - start) / n_repeats;
+        }
+        fprintf(stderr, "\nConvolution of %i bricks to %zu channels:\n", BRICK_TEST_N_BRICKS, n_channels);
+        for(int mode = 0; mode < BRICK_TEST_N_MODES; mode++) {
+            fprintf(stderr, "%-20s %9.3lf ms, max error %9.3e\n", mode_names[mode], t_conv[mode] * 1000.0, convolute_max_error(h[mode], h[0]));
+        }
+        for(int mode = 0; mode < BRICK_TEST_N_MODES; mode++) {
+            jabs_histogram_free(h[mode]);
+        }
+        calibration_free(c);
+    }
+    bricks_soa_free(bs);
+    free(bricks);
+    free(x);
+    free(out);
+    return EXIT_SUCCESS;
+}
@@ -42,6 +42,28 @@ calibration *calibration_clone(const calibration *c_orig) {
     return c;
 }
 
+int calibration_equal(const calibration *a, const calibration *b) {
+    if(!a || !b) {
+        return a == b;
+    }
+    if(a->type != b->type || a->resolution_variance != b->resolution_variance) {
+        return FALSE;
+    }
+    if(!a->params || !b->params) {
+        return a->params == b->params && a->resolution == b->resolution;
+    }
+    size_t n = calibration_get_number_of_params(a);
+    if(n != calibration_get_number_of_params(b)) {
+        return FALSE;
+    }
+    for(int i = CALIBRATION_PARAM_RESOLUTION; i < (int)n; i++) { /* Includes resolution */
+        if(calibration_get_param(a, i) != calibration_get_param(b, i)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
 void calibration_free(calibration *c) {
     if(!c)
         return;
@@ -64,6 +64,7 @@ typedef struct calibration_params_poly {
 calibration *calibration_init(void);
 void calibration_free(calibration *c);
 calibration *calibration_clone(const calibration *c_orig);
+int calibration_equal(const calibration *a, const calibration *b); /* TRUE if a and b are of the same type and have identical parameters (including resolution) */
 calibration *calibration_init_linear(void);
 calibration *calibration_init_poly(size_t n); /* n is the degree of the polynomial */
 double calibration_linear(const void *params, size_t x);
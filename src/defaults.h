@@ -59,8 +59,27 @@ extern "C" {
 #define STOP_STEP_DEPTH_FALLBACK (100.0 * C_TFU) /* If stop step can't be determined using stopping reliable, do a maximum of this */
 #define STOP_STEP_MINIMUM_STOPPING (0.1 * C_EV_TFU) /* Stopping below this is suspicious */
 #define STOP_STEP_ABSOLUTE_MINIMUM_STEP (1.0 * C_TFU) /* In some cases smaller steps are taken, such as when approaching layer boundaries, but otherwise this should be smallest sanity check step. */
+#define STOP_TABLE_TOLERANCE_DEFAULT (1.0e-4) /* Relative accuracy of interpolated stopping tables */
+#define STOP_TABLE_E_MIN (1.0 * C_KEV) /* Lowest energy in stopping tables, below this stopping is calculated directly */
+#define STOP_TABLE_E_MAX_MARGIN (1.1) /* Stopping tables extend this much above the highest energy an ion is expected to have */
+#define STOP_TABLE_POINTS_PER_DECADE (100) /* Initial density of stopping table energy grid, doubled until tolerance is reached */
+#define STOP_TABLE_POINTS_MAX (20000)
+#define STOP_ADAPTIVE_TOLERANCE_DEFAULT (1.0e-5) /* Local error of an adaptive stopping step, relative to the energy of the ion */
+#define STOP_ADAPTIVE_RETRIES_MAX (10) /* Rejected adaptive steps are shrunk and retried at most this many times */
+#define STOP_ADAPTIVE_SHRINK_MIN (0.2) /* Rejected adaptive step is shrunk by no more than this factor at a time */
+#define STOP_ADAPTIVE_GROWTH_MAX (5.0) /* Suggested next step is at most this many times the previous one */
+#define STOP_BATCH_CHUNK (16) /* Batched stopping calculations process this many energies at a time */
+#define EXIT_TABLE_POINTS_PER_DECADE (200) /* Energy grid density of exit tables */
+#define EXIT_TABLE_NODES_PER_RANGE_MAX (200) /* Thick ranges are split into at most this many slabs in exit tables */
+#define EXIT_TABLE_NODES_MAX (2000) /* Exit tables are not used if more nodes would be needed */
+#define DES_CACHE_SIZE_MAX (64 * 1024 * 1024) /* Memory (bytes) used by cached DES tables, least recently used tables are evicted above this */
+#define SCREENING_CACHE_SIZE_MAX (4 * 1024 * 1024) /* Memory (bytes) used by cached screening tables, least recently used tables are evicted above this */
+#define STOP_TABLE_CACHE_SIZE_MAX (64 * 1024 * 1024) /* Memory (bytes) used by cached stopping tables, least recently used tables are evicted above this */
+#define SCREENING_STORE_SIZE_MAX (16 * 1024 * 1024) /* Default maximum size (bytes) of screening table store file */
+#define SCREENING_STORE_VERSION (2) /* Increment when file format or screening table computation changes, old files are then ignored */
 #define BRICKS_DEFAULT (1000)
 #define BRICKS_MAX (10000)
+#define BRICKS_SPARSE_BROADENING_MARGIN (1.5) /* Bricks deeper than the simulated ones are assumed to have at most this many times the largest broadening, when finding channels affected by a change in sample */
 #define SIMULATE_WARNING_LIMIT 10 /* Allowed number of non-critical warnings for each run of simulate() */
 /* Other constants */
 #define E_MIN (10.0 * C_KEV) /* Absolute minimum for everything */
@@ -81,6 +100,12 @@ extern "C" {
 #define FIT_FAST_XTOL_MULTIPLIER (1.0)
 #define FIT_CHISQ_TOL (1e-7) /* Relative change in chi squared to stop fitting */
 #define FIT_FAST_CHISQ_TOL (1e-4)  /* Relative change in chi squared to stop fitting (fast fitting phase). This can be quite large, as turning on better physics changes the chisq. */
+#define FIT_ACCEL FALSE /* Geodesic acceleration (normal phase) */
+#define FIT_FAST_ACCEL FALSE /* Geodesic acceleration (fast phase) */
+#define FIT_EVAL_CACHE_SIZE 4 /* Number of fit function evaluations (residuals and spectra) kept in memory */
+#define FIT_JACOBIAN_REFRESH 0 /* Maximum number of Broyden updates of Jacobian between finite difference evaluations, zero disables updates */
+#define FIT_JACOBIAN_SPARSE TRUE /* Skip parts of Jacobian that are structurally zero (depth profile fits) */
+#define FIT_JACOBIAN_STALL_TOL (1e-3) /* Jacobian is evaluated with finite differences if relative decrease of sum of squared residuals since last Jacobian is smaller than this */
 #define SIGMAS_CUTOFF (5.0)
 #define SIGMAS_FAST_CUTOFF (3.5)
 #define CS_CONC_MAX_INTEGRATION_INTERVALS 100
@@ -19,11 +19,14 @@
 #include "des.h"
 #include "stop.h"
 
-extern inline const des *des_table_min_energy_bin(const des_table *dt);
+extern inline des des_table_min_energy_bin(const des_table *dt);
 
 des_table *des_table_init(size_t n) {
     des_table *dt = malloc(sizeof(des_table));
-    dt->t = NULL;
+    dt->x = NULL;
+    dt->i_range = NULL;
+    dt->E = NULL;
+    dt->S = NULL;
     dt->depth_interval_index = NULL;
     dt->n = 0;
     dt->n_ranges = 0;
@@ -37,26 +40,49 @@ des_table *des_table_init(size_t n) {
 int des_table_realloc(des_table *dt, size_t n) {
     if(n > DES_TABLE_MAX_SIZE) {
         DEBUGMSG("DES table requested size %zu larger than allowed %i", n, DES_TABLE_MAX_SIZE);
-        free(dt->t);
-        dt->t = NULL;
     } else {
         DEBUGMSG("DES table %p realloc to %zu elements", (void *) dt, n);
-        dt->t = realloc(dt->t, n * sizeof(des));
-    }
-    if(dt->t) {
-        dt->n = n;
-        return 0;
-    } else {
-        dt->n = 0;
-        return -1;
+        double *x = realloc(dt->x, n * sizeof(double));
+        if(x) {
+            dt->x = x;
+        }
+        size_t *i_range = realloc(dt->i_range, n * sizeof(size_t));
+        if(i_range) {
+            dt->i_range = i_range;
+        }
+        double *E = realloc(dt->E, n * sizeof(double));
+        if(E) {
+            dt->E = E;
+        }
+        double *S = realloc(dt->S, n * sizeof(double));
+        if(S) {
+            dt->S = S;
+        }
+        if(x && i_range && E && S) {
+            dt->n = n;
+            return 0;
+        }
     }
+    free(dt->x);
+    free(dt->i_range);
+    free(dt->E);
+    free(dt->S);
+    dt->x = NULL;
+    dt->i_range = NULL;
+    dt->E = NULL;
+    dt->S = NULL;
+    dt->n = 0;
+    return -1;
 }
 
 void des_table_free(des_table *dt) {
     if(!dt) {
         return;
     }
-    free(dt->t);
+    free(dt->x);
+    free(dt->i_range);
+    free(dt->E);
+    free(dt->S);
     free(dt->depth_interval_index);
     free(dt);
 }
@@ -68,14 +94,14 @@ size_t des_table_size(const des_table *dt) {
     return dt->n;
 }
 
-des *des_table_element(const des_table *dt, size_t i) {
-    if(!dt) {
-        return NULL;
-    }
-    if(i > dt->n) {
-        return NULL;
-    }
-    return &(dt->t[i]);
+des des_table_element(const des_table *dt, size_t i) {
+    assert(dt && i < dt->n);
+    des des;
+    des.d.x = dt->x[i];
+    des.d.i = dt->i_range[i];
+    des.E = dt->E[i];
+    des.S = dt->S[i];
+    return des;
 }
 
 void des_table_rebuild_index(des_table *dt) {
@@ -86,27 +112,25 @@ void des_table_rebuild_index(des_table *dt) {
     }
     dt->depth_interval_index = calloc(dt->n_ranges + 1, sizeof(size_t));
 
-    size_t i_range_old = dt->t[0].d.i;
+    size_t i_range_old = dt->i_range[0];
     dt->depth_interval_index[i_range_old] = 0;
     if(dt->depth_increases) {
         for(size_t i = 1; i < dt->n; i++) {
-            const des *des = &(dt->t[i]);
-            if(des->d.i > i_range_old) { /* index increases (des table has increasing depth) */
-                for(size_t i_range = i_range_old + 1; i_range <= des->d.i && i_range < dt->n_ranges; i_range++) { /* Handles indices step skips over (no thickness between them) */
+            if(dt->i_range[i] > i_range_old) { /* index increases (des table has increasing depth) */
+                for(size_t i_range = i_range_old + 1; i_range <= dt->i_range[i] && i_range < dt->n_ranges; i_range++) { /* Handles indices step skips over (no thickness between them) */
                     dt->depth_interval_index[i_range] = i - 1;
                 }
-                i_range_old = des->d.i;
+                i_range_old = dt->i_range[i];
             }
         }
         dt->depth_interval_index[dt->n_ranges] = dt->n - 1; /* Last point, last index */
     } else {
         for(size_t i = 1; i < dt->n; i++) {
-            const des *des = &(dt->t[i]);
-            if(des->d.i < i_range_old) {
-                for(size_t i_range = des->d.i; i_range < i_range_old; i_range++) {
+            if(dt->i_range[i] < i_range_old) {
+                for(size_t i_range = dt->i_range[i]; i_range < i_range_old; i_range++) {
                     dt->depth_interval_index[i_range + 1] = i;
                 }
-                i_range_old = des->d.i;
+                i_range_old = dt->i_range[i];
             }
         }
         dt->depth_interval_index[i_range_old] = dt->n - 1;
@@ -119,8 +143,7 @@ void des_table_print(FILE *f, const des_table *dt) {
     }
     fprintf(f, "DES    i d.i        d.x        d.E      d.S\n");
     for(size_t i = 0; i < dt->n; i++) {
-        const des *des = &(dt->t[i]);
-        fprintf(f, "DES %4zu %3zu %10.3lf %10.3lf %8.3lf\n", i, des->d.i, des->d.x / C_TFU, des->E / C_KEV, sqrt(des->S) / C_KEV);
+        fprintf(f, "DES %4zu %3zu %10.3lf %10.3lf %8.3lf\n", i, dt->i_range[i], dt->x[i] / C_TFU, dt->E[i] / C_KEV, sqrt(dt->S[i]) / C_KEV);
     }
     fprintf(f, "DES DEPTH INCREASES: %s\n", dt->depth_increases?"TRUE":"FALSE");
     if(dt->depth_interval_index) {
@@ -132,67 +155,98 @@ void des_table_print(FILE *f, const des_table *dt) {
     }
 }
 
-depth des_table_find_depth(const des_table *dt, size_t *i_des, depth depth_prev, ion *incident) {
-    size_t i;
+static size_t des_table_range_last(const des_table *dt, size_t i_range) { /* Index of the last point in range i_range, i.e. the next range boundary (or the end of table). Binary search, range indices are monotonic. */
+    size_t lo = 0;
+    size_t hi = dt->n;
+    while(lo < hi) { /* Find first point past range i_range */
+        size_t mid = lo + (hi - lo) / 2;
+        if(dt->depth_increases ? dt->i_range[mid] > i_range : dt->i_range[mid] < i_range) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo ? lo - 1 : 0;
+}
+
+static size_t des_table_energy_below(const des_table *dt, size_t lo, size_t hi, double E) { /* First index i in [lo, hi) with energy below E, hi if there is none. Binary search, energies are decreasing. */
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(dt->E[mid] < E) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+depth des_table_find_depth(const des_table *dt, depth depth_prev, ion *incident) {
     assert(dt);
     assert(dt->n > 0);
     double E = incident->E;
-    DEBUGVERBOSEMSG("Where is E = %g keV in DES table? Start index %zu. Previous depth %g tfu (range %zu)",
-            E / C_KEV, *i_des, depth_prev.x / C_TFU, depth_prev.i);
-    for(i = *i_des; i < dt->n - 1; i++) {
-        if(dt->t[i].d.i != dt->t[i + 1].d.i) { /* This means last point of this layer */
-            E = dt->t[i].E;
-            *i_des = i + 1; /* The +1 prevents stopping at this same layer boundary on the next call */
-            DEBUGVERBOSEMSG("Layer boundary at %g tfu. Setting E = %g keV and i_des = %zu. index = %zu", dt->t[i].d.x / C_TFU, E / C_KEV, *i_des, dt->depth_interval_index[dt->t[i + 1].d.i]);
-            break;
-        }
-        if(dt->t[i].E < E) {/* i is the index of the first element in dt->t that has energy below E. So i-1 should have energy above E. */
-            DEBUGVERBOSEMSG("Breaking, i_des = i = %zu, because first element %.12e J (%g keV) <  E = %.12e J (%g keV)", i, dt->t[i].E, dt->t[i].E / C_KEV,  E, E / C_KEV);
-            *i_des = i;
-            break;
-        }
+    DEBUGVERBOSEMSG("Where is E = %g keV in DES table? Previous depth %g tfu (range %zu)",
+            E / C_KEV, depth_prev.x / C_TFU, depth_prev.i);
+    size_t i_start = 0;
+    size_t i_boundary = des_table_range_last(dt, depth_prev.i);
+    if(i_boundary > 0 && i_boundary < dt->n - 1 && (dt->depth_increases ? depth_prev.x >= dt->x[i_boundary] : depth_prev.x <= dt->x[i_boundary])) { /* Previous call stopped at this boundary, continue from the next range. If the table starts at a boundary, the first call returns it (with the index of the next range). */
+        i_start = i_boundary + 1;
+        i_boundary = des_table_range_last(dt, dt->i_range[i_start]);
+    }
+    size_t i = des_table_energy_below(dt, i_start, i_boundary, E); /* i is the index of the first element that has energy below E (or the boundary). So i-1 should have energy above E. */
+    int boundary = FALSE;
+    if(i == i_boundary && i < dt->n - 1) { /* Layer boundary comes first */
+        E = dt->E[i];
+        boundary = (i > 0);
+        DEBUGVERBOSEMSG("Layer boundary at %g tfu. Setting E = %g keV. index = %zu", dt->x[i] / C_TFU, E / C_KEV, i);
     }
     if(i == dt->n - 1) {
-        if(E < dt->t[i].E) {
-            DEBUGVERBOSEMSG("Energy %g keV is below last point in table (%g keV). Changing energy.", E / C_KEV, dt->t[i].E / C_KEV);
-            E = dt->t[i].E;
+        if(E < dt->E[i]) {
+            DEBUGVERBOSEMSG("Energy %g keV is below last point in table (%g keV). Changing energy.", E / C_KEV, dt->E[i] / C_KEV);
+            E = dt->E[i];
         }
     } else if(i == 0) {
-        if(E > dt->t[i].E) {
-            DEBUGVERBOSEMSG("Energy %g keV is above first point in table (%g keV). Changing energy.", E / C_KEV, dt->t[i].E / C_KEV);
-            E = dt->t[i].E;
+        if(E > dt->E[i]) {
+            DEBUGVERBOSEMSG("Energy %g keV is above first point in table (%g keV). Changing energy.", E / C_KEV, dt->E[i] / C_KEV);
+            E = dt->E[i];
         }
         i = 1;
     }
     assert(i > 0);
-    const des *des_low = &dt->t[i - 1]; /* Closer to surface, higher energy */
-    const des *des_high = &dt->t[i]; /* Deeper, lower energy */
-    DEBUGVERBOSEMSG("dt->t[%zu] = %g tfu (i = %zu), dt->t[%zu] = %g tfu (i = %zu), depth_prev = %g tfu (i = %zu)",
-            i - 1,  des_low->d.x / C_TFU, des_low->d.i, i, des_high->d.x / C_TFU, des_high->d.i, depth_prev.x / C_TFU, depth_prev.i);
-    double E_diff = E - des_low->E;
-    double E_interval = des_high->E - des_low->E;
-    double S_interval = des_high->S - des_low->S;
-    double d_interval = depth_diff(des_low->d, des_high->d);
+    const size_t i_low = i - 1; /* Closer to surface, higher energy */
+    const size_t i_high = i; /* Deeper, lower energy */
+    DEBUGVERBOSEMSG("dt->x[%zu] = %g tfu (i = %zu), dt->x[%zu] = %g tfu (i = %zu), depth_prev = %g tfu (i = %zu)",
+            i_low, dt->x[i_low] / C_TFU, dt->i_range[i_low], i_high, dt->x[i_high] / C_TFU, dt->i_range[i_high], depth_prev.x / C_TFU, depth_prev.i);
+    double E_diff = E - dt->E[i_low];
+    double E_interval = dt->E[i_high] - dt->E[i_low];
+    double S_interval = dt->S[i_high] - dt->S[i_low];
+    double d_interval = dt->x[i_high] - dt->x[i_low];
     double frac;
-    if(fabs(E_interval) < 0.1 * C_EV) { /* Prevent div by zero */
+    if(boundary) { /* Exactly at the boundary, next call recognizes it from the depth */
+        frac = 1.0;
+    } else if(fabs(E_interval) < 0.1 * C_EV) { /* Prevent div by zero */
         frac = 0.0;
     } else {
         frac = (E_diff / E_interval); /* zero if close to low bin */
     }
     assert(frac >= 0.0 && frac <= 1.0);
     depth d_out;
-    if(depth_prev.i != des_high->d.i) { /* First point after crossing layer */
-        d_out.i = des_high->d.i;
+    if(depth_prev.i != dt->i_range[i_high]) { /* First point after crossing layer */
+        d_out.i = dt->i_range[i_high];
     } else {
         d_out.i = depth_prev.i;
     }
-    d_out.x = des_low->d.x + frac * (d_interval); /* Linear interpolation */
+    if(boundary) {
+        d_out.x = dt->x[i_high];
+    } else {
+        d_out.x = dt->x[i_low] + frac * (d_interval); /* Linear interpolation */
+    }
 #if 0
-    incident->E = des_low->E + frac * E_interval;
+    incident->E = dt->E[i_low] + frac * E_interval;
 #else
     incident->E = E;
 #endif
-    incident->S = des_low->S + frac * S_interval;
+    incident->S = dt->S[i_low] + frac * S_interval;
     DEBUGVERBOSEMSG("d_out = %g tfu (i = %zu), E = %g keV, S = %g keV", d_out.x / C_TFU, d_out.i, incident->E / C_KEV, sqrt(incident->S) * C_FWHM / C_KEV);
     return d_out;
 }
@@ -206,6 +260,7 @@ des_table *des_table_compute(const jabs_stop *stop, const jabs_stop *stragg, con
     size_t i = 0;
     depth d_before;
     depth d_after = depth_start;
+    stop_step_state state = {.step_next = 0.0, .k_next = 0.0};
     dt->depth_increases = (ion.inverse_cosine_theta > 0.0);
     assert(ion.inverse_cosine_theta <= -1.0 || ion.inverse_cosine_theta >= 1.0);
     DEBUGMSG("Computing DES table, incident ion is %s. start_depth = %g tfu, E = %g keV, angle in sample %g deg (1/cos = %.6lf).", incident->isotope->name, depth_start.x / C_TFU, ion.E / C_KEV,
@@ -222,22 +277,27 @@ des_table *des_table_compute(const jabs_stop *stop, const jabs_stop *stragg, con
             }
         }
         d_before = d_after;
-        des *des = &dt->t[i];
-        des->E = ion.E;
-        des->S = ion.S;
-        des->d = d_before;
+        dt->x[i] = d_before.x;
+        dt->i_range[i] = d_before.i;
+        dt->E[i] = ion.E;
+        dt->S[i] = ion.S;
         if((ion.inverse_cosine_theta > 0.0 && d_before.x >= sample->thickness - DEPTH_TOLERANCE) || (ion.inverse_cosine_theta < 0.0 && d_before.x < DEPTH_TOLERANCE)) {
             DEBUGMSG("DES table calculation stops at %g tfu (i = %zu).", d_before.x / C_TFU, i);
             i++;
             break;
         }
-        d_after = stop_step(stop, stragg, &ion, sample, d_before, stop_step_calc(&scp->incident_stop_params, &ion));
+        double E_step = stop_step_calc(&scp->incident_stop_params, &ion);
+        if(stop->adaptive) { /* Error control decides the step, E_step is the largest step allowed in the table */
+            d_after = stop_step_adaptive(stop, stragg, &ion, sample, d_before, E_step, &state);
+        } else {
+            d_after = stop_step(stop, stragg, &ion, sample, d_before, E_step);
+        }
         i++;
     } while(ion.E > emin);
     if(dt->n) {
         des_table_realloc(dt, i); /* Shrinks to size */
         if(i > 0 ) {
-            dt->n_ranges = GSL_MAX(depth_start.i, dt->t[i - 1].d.i) + 1;
+            dt->n_ranges = GSL_MAX(depth_start.i, dt->i_range[i - 1]) + 1;
         } else {
             dt->n_ranges = 0;
         }
@@ -269,8 +329,8 @@ depth des_next_range(const des_table *dt, ion *incident, depth d) {
     }
     size_t i_des_skip = dt->depth_interval_index[i_range_next];
     assert(i_des_skip < dt->n);
-    des *des_skip = &(dt->t[i_des_skip]);
-    incident->E = des_skip->E; /* TODO: long skips may make E_deriv calculation inaccurate */
-    incident->S = des_skip->S;
-    return des_skip->d;
+    incident->E = dt->E[i_des_skip]; /* TODO: long skips may make E_deriv calculation inaccurate */
+    incident->S = dt->S[i_des_skip];
+    depth d_skip = {.x = dt->x[i_des_skip], .i = dt->i_range[i_des_skip]};
+    return d_skip;
 }
@@ -29,7 +29,10 @@ typedef struct {
 } des; /* DES = Depth, Energy, Straggling */
 
 typedef struct {
-    des *t; /* array, n elements. E decreasing, d either increases (ion going deeper) or decreases. S can do whatever S does. */
+    double *x; /* Depth (x), array n elements. Either increases (ion going deeper) or decreases. */
+    size_t *i_range; /* Depth range index of each depth, array n elements. Point at a range boundary still has the index of the range before the boundary. */
+    double *E; /* Energy, array n elements. Decreasing. */
+    double *S; /* Straggling, array n elements. S can do whatever S does. */
     int depth_increases; /* TRUE if d increases (going deeper) */
     size_t n;
     size_t n_ranges;
@@ -40,11 +43,11 @@ int des_table_realloc(des_table *dt, size_t n);
 void des_table_free(des_table *dt);
 des_table *des_table_compute(const jabs_stop *stop, const jabs_stop *stragg, const sim_calc_params *scp, const sample *sample, const ion *incident, depth depth_start, double emin);
 size_t des_table_size(const des_table *dt);
-des *des_table_element(const des_table *dt, size_t i);
+des des_table_element(const des_table *dt, size_t i); /* Copy of element i, i < dt->n */
 void des_table_rebuild_index(des_table *dt); /* called by des_table_compute() after setting values to table and before any other function can be used */
 void des_table_print(FILE *f, const des_table *dt);
-depth des_table_find_depth(const des_table *dt, size_t *i_des, depth depth_prev, ion *incident); /* Returns depth at given incident->E, or the next layer boundary, starting search from i_des in DES table. Updates i_des, incident->E and ->S. */
-inline const des *des_table_min_energy_bin(const des_table *dt) {return &(dt->t[dt->n - 1]);}
+depth des_table_find_depth(const des_table *dt, depth depth_prev, ion *incident); /* Returns depth at given incident->E, or the next layer boundary if it comes first. depth_prev is the depth returned by the previous call (or the start depth), a boundary is only returned once. Updates incident->E and ->S. Does not modify dt, safe to call from multiple threads. */
+inline des des_table_min_energy_bin(const des_table *dt) {return des_table_element(dt, dt->n - 1);}
 void des_set_ion(const des *des, ion *ion);
 depth des_next_range(const des_table *dt, ion *incident, depth d); /* Returns the next depth of next range (w.r.t. ion direction of travel, deeper or closer to surface) and sets ion energy and straggling */
 #ifdef __cplusplus
@@ -0,0 +1,266 @@
+/*
+
+    Jaakko's Backscattering Simulator (JaBS)
+    Copyright (C) 2021 - 2024 Jaakko Julin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    See LICENSE.txt for the full license.
+
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "jabs_debug.h"
+#include "message.h"
+#include "des_cache.h"
+
+#define DES_CACHE_KEY_ADD(key, size, value) do { if(key) {memcpy((key) + (size), &(value), sizeof(value));} (size) += sizeof(value); } while(0)
+
+static size_t des_cache_key_stop(unsigned char *key, size_t size, const jabs_stop *stop) {
+    const int tables = (stop->tables != NULL); /* Tables are specific to workspace, but they all give the same results */
+    DES_CACHE_KEY_ADD(key, size, stop->gsto);
+    DES_CACHE_KEY_ADD(key, size, stop->type);
+    DES_CACHE_KEY_ADD(key, size, stop->nuclear_stopping_accurate);
+    DES_CACHE_KEY_ADD(key, size, stop->rk4);
+    DES_CACHE_KEY_ADD(key, size, stop->adaptive);
+    DES_CACHE_KEY_ADD(key, size, stop->adaptive_tolerance);
+    DES_CACHE_KEY_ADD(key, size, stop->emin);
+    DES_CACHE_KEY_ADD(key, size, tables);
+    return size;
+}
+
+static size_t des_cache_key(unsigned char *key, const jabs_stop *stop, const jabs_stop *stragg, const sim_calc_params *scp, const sample *sample, const ion *incident, depth depth_start, double emin) { /* Writes key to key (if not NULL), returns size of key */
+    size_t size = 0;
+    size = des_cache_key_stop(key, size, stop);
+    size = des_cache_key_stop(key, size, stragg);
+    DES_CACHE_KEY_ADD(key, size, scp->incident_stop_params);
+    DES_CACHE_KEY_ADD(key, size, incident->isotope);
+    DES_CACHE_KEY_ADD(key, size, incident->ion_gsto);
+    DES_CACHE_KEY_ADD(key, size, incident->nucl_stop);
+    DES_CACHE_KEY_ADD(key, size, incident->E);
+    DES_CACHE_KEY_ADD(key, size, incident->S);
+    DES_CACHE_KEY_ADD(key, size, incident->inverse_cosine_theta);
+    DES_CACHE_KEY_ADD(key, size, depth_start.x);
+    DES_CACHE_KEY_ADD(key, size, depth_start.i);
+    DES_CACHE_KEY_ADD(key, size, emin);
+    DES_CACHE_KEY_ADD(key, size, sample->n_isotopes);
+    DES_CACHE_KEY_ADD(key, size, sample->n_ranges);
+    DES_CACHE_KEY_ADD(key, size, sample->thickness);
+    for(size_t i = 0; i < sample->n_isotopes; i++) {
+        DES_CACHE_KEY_ADD(key, size, sample->isotopes[i]);
+    }
+    for(size_t i = 0; i < sample->n_ranges; i++) {
+        const sample_range *r = &sample->ranges[i];
+        DES_CACHE_KEY_ADD(key, size, r->x);
+        DES_CACHE_KEY_ADD(key, size, r->bragg);
+        DES_CACHE_KEY_ADD(key, size, r->stragg);
+    }
+    for(size_t i = 0; i < sample->n_isotopes * sample->n_ranges; i++) {
+        DES_CACHE_KEY_ADD(key, size, sample->cbins[i]);
+    }
+    return size;
+}
+
+static uint64_t des_cache_hash(const unsigned char *key, size_t key_size) { /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < key_size; i++) {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static des_cache_entry *des_cache_find(des_cache *dc, uint64_t hash, const unsigned char *key, size_t key_size) {
+    for(size_t i = 0; i < dc->n; i++) {
+        des_cache_entry *e = &dc->entries[i];
+        if(e->hash == hash && e->key_size == key_size && memcmp(e->key, key, key_size) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void des_cache_remove(des_cache *dc, size_t i) {
+    des_cache_entry *e = &dc->entries[i];
+    dc->size -= e->size;
+    des_table_free(e->dt);
+    free(e->key);
+    dc->n--;
+    if(i != dc->n) {
+        *e = dc->entries[dc->n];
+    }
+}
+
+static void des_cache_evict(des_cache *dc) { /* Removes least recently used tables (that are not in use) until memory use is below the limit */
+    while(dc->size > dc->size_max) {
+        size_t i_lru = dc->n;
+        for(size_t i = 0; i < dc->n; i++) {
+            const des_cache_entry *e = &dc->entries[i];
+            if(e->refcount == 0 && (i_lru == dc->n || e->last_used < dc->entries[i_lru].last_used)) {
+                i_lru = i;
+            }
+        }
+        if(i_lru == dc->n) { /* Everything is in use */
+            break;
+        }
+        DEBUGMSG("DES cache evicts table %p (%zu bytes), cache size %zu bytes.", (void *) dc->entries[i_lru].dt, dc->entries[i_lru].size, dc->size);
+        des_cache_remove(dc, i_lru);
+    }
+}
+
+static int des_cache_insert(des_cache *dc, uint64_t hash, unsigned char *key, size_t key_size, des_table *dt) { /* Cache takes ownership of key and dt on success */
+    if(dc->n == dc->n_alloc) {
+        size_t n_alloc = dc->n_alloc ? dc->n_alloc * 2 : 8;
+        des_cache_entry *entries = realloc(dc->entries, n_alloc * sizeof(des_cache_entry));
+        if(!entries) {
+            return EXIT_FAILURE;
+        }
+        dc->entries = entries;
+        dc->n_alloc = n_alloc;
+    }
+    des_cache_entry *e = &dc->entries[dc->n];
+    e->hash = hash;
+    e->key = key;
+    e->key_size = key_size;
+    e->dt = dt;
+    e->size = sizeof(des_cache_entry) + sizeof(des_table) + key_size + dt->n * (3 * sizeof(double) + sizeof(size_t)) + dt->n_ranges * sizeof(size_t);
+    e->refcount = 1;
+    e->last_used = ++dc->clock;
+    dc->size += e->size;
+    dc->n++;
+    return EXIT_SUCCESS;
+}
+
+des_cache *des_cache_new(size_t size_max) {
+    des_cache *dc = calloc(1, sizeof(des_cache));
+    if(!dc) {
+        return NULL;
+    }
+    dc->size_max = size_max;
+    return dc;
+}
+
+void des_cache_free(des_cache *dc) {
+    if(!dc) {
+        return;
+    }
+    for(size_t i = 0; i < dc->n; i++) {
+        des_table_free(dc->entries[i].dt);
+        free(dc->entries[i].key);
+    }
+    free(dc->entries);
+    free(dc);
+}
+
+void des_cache_flush(des_cache *dc) {
+    if(!dc) {
+        return;
+    }
+#pragma omp critical(des_cache)
+    {
+        size_t i = 0;
+        while(i < dc->n) {
+            if(dc->entries[i].refcount == 0) {
+                des_cache_remove(dc, i); /* Last entry is moved to i */
+            } else {
+                i++;
+            }
+        }
+        dc->hits = 0;
+        dc->misses = 0;
+    }
+}
+
+const des_table *des_cache_get(des_cache *dc, const jabs_stop *stop, const jabs_stop *stragg, const sim_calc_params *scp, const sample *sample, const ion *incident, depth depth_start, double emin) {
+    if(!dc) {
+        return des_table_compute(stop, stragg, scp, sample, incident, depth_start, emin);
+    }
+    size_t key_size = des_cache_key(NULL, stop, stragg, scp, sample, incident, depth_start, emin);
+    unsigned char *key = malloc(key_size);
+    if(!key) {
+        return des_table_compute(stop, stragg, scp, sample, incident, depth_start, emin);
+    }
+    des_cache_key(key, stop, stragg, scp, sample, incident, depth_start, emin);
+    uint64_t hash = des_cache_hash(key, key_size);
+    const des_table *dt = NULL;
+#pragma omp critical(des_cache)
+    {
+        des_cache_entry *e = des_cache_find(dc, hash, key, key_size);
+        if(e) {
+            e->refcount++;
+            e->last_used = ++dc->clock;
+            dc->hits++;
+            dt = e->dt;
+        } else {
+            dc->misses++;
+        }
+    }
+    if(dt) {
+        free(key);
+        return dt;
+    }
+    des_table *dt_new = des_table_compute(stop, stragg, scp, sample, incident, depth_start, emin); /* Not in critical section, other threads can use the cache meanwhile */
+    if(!dt_new) {
+        free(key);
+        return NULL;
+    }
+    int inserted = FALSE;
+#pragma omp critical(des_cache)
+    {
+        des_cache_entry *e = des_cache_find(dc, hash, key, key_size); /* Another thread may have computed the same table */
+        if(e) {
+            e->refcount++;
+            e->last_used = ++dc->clock;
+            dt = e->dt;
+        } else if(des_cache_insert(dc, hash, key, key_size, dt_new) == EXIT_SUCCESS) {
+            inserted = TRUE;
+            dt = dt_new;
+            des_cache_evict(dc);
+        }
+    }
+    if(!inserted) {
+        free(key);
+        if(dt) {
+            des_table_free(dt_new);
+        } else { /* Could not be cached, des_cache_release() will free this */
+            dt = dt_new;
+        }
+    }
+    return dt;
+}
+
+void des_cache_release(des_cache *dc, const des_table *dt) {
+    if(!dt) {
+        return;
+    }
+    int found = FALSE;
+    if(dc) {
+#pragma omp critical(des_cache)
+        {
+            for(size_t i = 0; i < dc->n; i++) {
+                des_cache_entry *e = &dc->entries[i];
+                if(e->dt == dt) {
+                    e->refcount--;
+                    found = TRUE;
+                    break;
+                }
+            }
+            if(found) {
+                des_cache_evict(dc);
+            }
+        }
+    }
+    if(!found) { /* Table was not cached */
+        des_table_free((des_table *) dt);
+    }
+}
+
+void des_cache_print_stats(const des_cache *dc, jabs_msg_level msg_level) {
+    if(!dc || dc->hits + dc->misses == 0) {
+        return;
+    }
+    jabs_message(msg_level, "DES cache: %zu hits, %zu misses, %zu tables (%.1lf kB).\n", dc->hits, dc->misses, dc->n, dc->size / 1024.0);
+}
@@ -0,0 +1,53 @@
+/*
+
+    Jaakko's Backscattering Simulator (JaBS)
+    Copyright (C) 2021 - 2024 Jaakko Julin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    See LICENSE.txt for the full license.
+
+ */
+#ifndef JABS_DES_CACHE_H
+#define JABS_DES_CACHE_H
+#include <stdint.h>
+#include "des.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct des_cache_entry {
+    uint64_t hash;
+    unsigned char *key; /* Everything the DES table depends on, see des_cache_key() */
+    size_t key_size;
+    des_table *dt;
+    size_t size; /* Memory used by this entry (bytes), approximately */
+    int refcount; /* Number of users, entry is not evicted while this is non-zero */
+    size_t last_used; /* Value of des_cache->clock when this entry was last used */
+} des_cache_entry;
+
+typedef struct des_cache { /* DES tables of incident ions, shared by detectors and fit evaluations. Least recently used tables are evicted when memory use exceeds size_max. */
+    des_cache_entry *entries; /* Array, n elements */
+    size_t n;
+    size_t n_alloc;
+    size_t size; /* Total memory used by entries (bytes) */
+    size_t size_max;
+    size_t clock;
+    size_t hits;
+    size_t misses;
+} des_cache;
+
+des_cache *des_cache_new(size_t size_max);
+void des_cache_free(des_cache *dc);
+void des_cache_flush(des_cache *dc); /* Frees all tables that are not in use */
+const des_table *des_cache_get(des_cache *dc, const jabs_stop *stop, const jabs_stop *stragg, const sim_calc_params *scp, const sample *sample, const ion *incident, depth depth_start, double emin); /* Same as des_table_compute(), but returns a cached table if one was computed earlier with same parameters. The table must be returned with des_cache_release(). dc can be NULL, then the table is always computed. */
+void des_cache_release(des_cache *dc, const des_table *dt);
+void des_cache_print_stats(const des_cache *dc, jabs_msg_level msg_level);
+#ifdef __cplusplus
+}
+#endif
+#endif // JABS_DES_CACHE_H
@@ -1,6 +1,10 @@
 #include <jibal.h>
 #include "ion.h"
 #include "jabs.h"
+#include "generic.h"
+
+#define DES_TEST_LOOKUP_SWEEPS 1000
+#define DES_TEST_LOOKUP_STEPS 1000
 
 int main(int argc, char **argv) {
     jibal *jibal = jibal_init(NULL);
@@ -30,6 +34,22 @@ int main(int argc, char **argv) {
     jibal_gsto_load_all(jibal->gsto);
     des_table *dt = des_table_compute(&ws->stop, &ws->stragg, ws->params, sample, &testion, depth_start, ws->emin);
     des_table_print(stderr, dt);
+    double E_first = des_table_element(dt, 0).E;
+    double E_last = des_table_min_energy_bin(dt).E;
+    double start = jabs_clock();
+    double checksum = 0.0;
+    for(size_t i_sweep = 0; i_sweep < DES_TEST_LOOKUP_SWEEPS; i_sweep++) { /* Lookup throughput, sweeps through the table like simulate_reaction() does */
+        ion ion_lookup = testion;
+        depth d = depth_start;
+        for(size_t i = 1; i <= DES_TEST_LOOKUP_STEPS; i++) {
+            ion_lookup.E = E_first - (E_first - E_last) * i / DES_TEST_LOOKUP_STEPS;
+            d = des_table_find_depth(dt, d, &ion_lookup);
+            checksum += d.x;
+        }
+    }
+    double time = jabs_clock() - start;
+    fprintf(stderr, "%i lookups in %.3lf ms, %.3lf ns per lookup, table size %zu. Checksum %g\n",
+            DES_TEST_LOOKUP_SWEEPS * DES_TEST_LOOKUP_STEPS, time * 1000.0, time * 1.0e9 / (DES_TEST_LOOKUP_SWEEPS * DES_TEST_LOOKUP_STEPS), des_table_size(dt), checksum);
     reaction *r = reaction_make(testion.isotope, jibal_isotope_find(jibal->isotopes, "28Si", 0, 0), REACTION_RBS, JABS_CS_ANDERSEN);
     sim_reaction *sim_r = sim_reaction_init(sample, ws->det, r, ws->n_channels, ws->n_bricks);
     geostragg_vars g = geostragg_vars_calculate(&testion, 0.0, 0.0, ws->det, NULL, FALSE, FALSE);
@@ -239,6 +239,7 @@ int detector_update_foil(detector *det) {
     if(!det || !det->foil_sm) {
         return 0;
     }
+    sample_free(det->foil);
     det->foil = sample_from_sample_model(det->foil_sm);
     return 0;
 }
@@ -394,6 +395,7 @@ detector *detector_clone(const detector *det_orig) {
     }
     det->aperture = aperture_clone(det_orig->aperture);
     det->foil_sm = sample_model_clone(det->foil_sm);
+    det->foil = NULL;
     detector_update_foil(det);
     //detector_update(det);
     return det;
@@ -0,0 +1,466 @@
+/*
+
+    Jaakko's Backscattering Simulator (JaBS)
+    Copyright (C) 2021 - 2024 Jaakko Julin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    See LICENSE.txt for the full license.
+
+ */
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include <gsl/gsl_math.h>
+#include "jabs_debug.h"
+#include "defaults.h"
+#include "message.h"
+#include "exit_table.h"
+
+typedef struct exit_table_calc { /* Stopping calculation and the ion (template) used to compute table entries */
+    const jabs_stop *stop;
+    const jabs_stop *stragg;
+    const jabs_stop_step_params *params_exiting;
+    const ion *p;
+    const sample *sample;
+} exit_table_calc;
+
+static double exit_table_distance(const ion *p, const sample *sample, double x) { /* Distance (perpendicular) from the surface the ion exits through */
+    return p->inverse_cosine_theta < 0.0 ? x : sample->thickness - x;
+}
+
+static int exit_table_step_to(const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting, ion *p, depth *d, double x_target, const sample *sample) { /* Steps ion p from depth d to depth x_target, towards the exit. Returns EXIT_FAILURE if energy would go below emin. Slabs between nodes are thin, so steps are limited only by the maximum exiting stop step. */
+    const double emin = GSL_MAX_DBL(stop->emin, p->ion_gsto->emin);
+    const double direction = p->inverse_cosine_theta < 0.0 ? -1.0 : 1.0;
+    while(1) {
+        double remaining = (x_target - d->x) * direction;
+        if(remaining <= DEPTH_TOLERANCE) {
+            return EXIT_SUCCESS;
+        }
+        depth d_next = stop_next_crossing(p, sample, d);
+        depth d_k = {.x = d->x, .i = d_next.i}; /* stop_step() calculates k1 at this depth */
+        double k = stop_sample(stop, p, sample, d_k, p->E);
+        if(k < STOP_STEP_MINIMUM_STOPPING) { /* No energy loss, no need to step. */
+            if((d_next.x - x_target) * direction < 0.0) {
+                *d = d_next;
+            } else {
+                d->x = x_target;
+                d->i = d_next.i;
+            }
+            continue;
+        }
+        double E_step = params_exiting->step > 0.0 ? params_exiting->step : params_exiting->max;
+        E_step = GSL_MIN_DBL(E_step, k * remaining * fabs(p->inverse_cosine_theta)); /* Second one lands exactly on x_target */
+        if(p->E - E_step <= emin) {
+            return EXIT_FAILURE;
+        }
+        *d = stop_step(stop, stragg, p, sample, *d, E_step);
+    }
+}
+
+static double exit_table_slope(double a, double b) { /* Harmonic mean of neighbouring secants (Fritsch-Butland), preserves monotonicity */
+    if(a * b <= 0.0) {
+        return 0.0;
+    }
+    return 2.0 * a * b / (a + b);
+}
+
+static double exit_table_hermite(const double *y, const double *valid, size_t n, size_t i, double s) { /* Cubic Hermite interpolation between y[i] and y[i+1] (s is from 0 to 1), on a uniform grid. Neighbours y[i-1] and y[i+2] are used for slopes if they are valid (valid[] > 0.0). */
+    const double d = y[i + 1] - y[i];
+    const double d_prev = (i > 0 && valid[i - 1] > 0.0) ? y[i] - y[i - 1] : d;
+    const double d_next = (i + 2 < n && valid[i + 2] > 0.0) ? y[i + 2] - y[i + 1] : d;
+    const double m0 = exit_table_slope(d_prev, d);
+    const double m1 = exit_table_slope(d, d_next);
+    const double s2 = s * s;
+    const double s3 = s2 * s;
+    return (2.0 * s3 - 3.0 * s2 + 1.0) * y[i] + (s3 - 2.0 * s2 + s) * m0 + (-2.0 * s3 + 3.0 * s2) * y[i + 1] + (s3 - s2) * m1;
+}
+
+static int exit_table_index(const exit_table *t, double E, size_t *i, double *s) { /* Finds i and s so that E is between energy points i and i + 1 */
+    if(E < t->E_min || E >= t->E_max) {
+        return EXIT_FAILURE;
+    }
+    double u = (log(E) - t->log_E_min) * t->log_step_inv;
+    *i = (size_t) u;
+    if(*i + 1 >= t->n) {
+        return EXIT_FAILURE;
+    }
+    *s = u - (double) *i;
+    return EXIT_SUCCESS;
+}
+
+static int exit_table_ready(const exit_table *t, size_t i_node, size_t i_first, size_t i_last) { /* Entries i_first...i_last of node i_node have been computed. Values of ready entries can be read without locking. */
+    const char *ready = t->ready + i_node * t->n;
+    for(size_t i = i_first; i <= i_last; i++) {
+        if(!ready[i]) {
+            return FALSE;
+        }
+    }
+#pragma omp flush
+    return TRUE;
+}
+
+static int exit_table_lookup(const exit_table *t, size_t i_node, double E, double *E_out, double *gain, double *added) { /* Interpolates computed entries. Fails if the ion stops or entries are not computed (see exit_table_fill()). */
+    size_t i;
+    double s;
+    if(exit_table_index(t, E, &i, &s)) {
+        return EXIT_FAILURE;
+    }
+    const size_t i_first = (i > 0 ? i - 1 : 0);
+    const size_t i_last = GSL_MIN(i + 2, t->n - 1);
+    if(!exit_table_ready(t, i_node, i_first, i_last)) {
+        return EXIT_FAILURE;
+    }
+    const size_t n = i_last - i_first + 1;
+    const size_t offset = i_node * t->n + i_first;
+    const double *y = t->E_out + offset;
+    i -= i_first;
+    if(y[i] <= 0.0 || y[i + 1] <= 0.0) { /* Ion stops or table was incomplete, can't interpolate */
+        return EXIT_FAILURE;
+    }
+    *E_out = exit_table_hermite(y, y, n, i, s);
+    *gain = exit_table_hermite(t->gain + offset, y, n, i, s);
+    *added = exit_table_hermite(t->added + offset, y, n, i, s);
+    return EXIT_SUCCESS;
+}
+
+static void exit_table_free(exit_table *t) {
+    if(!t) {
+        return;
+    }
+    free(t->nodes);
+    free(t->E_out);
+    free(t->gain);
+    free(t->added);
+    free(t->ready);
+    free(t);
+}
+
+static int exit_table_make_nodes(exit_table *t, const jabs_stop *stop, const jabs_stop_step_params *params_exiting, const ion *p, const sample *sample) { /* Nodes are placed on range boundaries and within ranges so that energy loss between nodes is at most one (maximum) exiting stop step */
+    ion ion_E = *p;
+    const double E_slab = params_exiting->step > 0.0 ? params_exiting->step : params_exiting->max;
+    size_t *n_sub = calloc(sample->n_ranges, sizeof(size_t));
+    if(!n_sub) {
+        return EXIT_FAILURE;
+    }
+    t->n_nodes = 1;
+    for(size_t i_range = 0; i_range + 1 < sample->n_ranges; i_range++) {
+        const double width = sample->ranges[i_range + 1].x - sample->ranges[i_range].x;
+        if(width <= 0.0) {
+            continue;
+        }
+        depth d = {.x = sample->ranges[i_range].x, .i = i_range};
+        double k_max = 0.0;
+        for(size_t i = 0; i < t->n; i++) {
+            ion_E.E = exp(t->log_E_min + i * t->log_step);
+            k_max = GSL_MAX_DBL(k_max, stop_sample(stop, &ion_E, sample, d, ion_E.E));
+        }
+        double n = ceil(width * fabs(p->inverse_cosine_theta) * k_max / E_slab);
+        n_sub[i_range] = GSL_MIN(GSL_MAX(n, 1.0), EXIT_TABLE_NODES_PER_RANGE_MAX);
+        t->n_nodes += n_sub[i_range];
+    }
+    t->nodes = malloc(t->n_nodes * sizeof(depth));
+    if(!t->nodes) {
+        free(n_sub);
+        return EXIT_FAILURE;
+    }
+    double *x = malloc(t->n_nodes * sizeof(double)); /* Ascending depth */
+    if(!x) {
+        free(n_sub);
+        return EXIT_FAILURE;
+    }
+    size_t i_node = 0;
+    x[i_node++] = 0.0;
+    for(size_t i_range = 0; i_range + 1 < sample->n_ranges; i_range++) {
+        const double width = sample->ranges[i_range + 1].x - sample->ranges[i_range].x;
+        for(size_t i = 1; i < n_sub[i_range]; i++) {
+            x[i_node++] = sample->ranges[i_range].x + width * (1.0 * i) / (1.0 * n_sub[i_range]);
+        }
+        if(n_sub[i_range]) {
+            x[i_node++] = sample->ranges[i_range + 1].x; /* Exactly on the boundary */
+        }
+    }
+    assert(i_node == t->n_nodes);
+    if(t->n_nodes > EXIT_TABLE_NODES_MAX) {
+        DEBUGMSG("Exit table would need %zu nodes, more than the maximum %zu.", t->n_nodes, EXIT_TABLE_NODES_MAX);
+        free(x);
+        free(n_sub);
+        return EXIT_FAILURE;
+    }
+    for(i_node = 0; i_node < t->n_nodes; i_node++) {
+        depth *d = &t->nodes[i_node];
+        *d = depth_seek(sample, p->inverse_cosine_theta < 0.0 ? x[i_node] : x[t->n_nodes - 1 - i_node]);
+        if(d->i + 1 >= sample->n_ranges) { /* Back of the sample, concentrations are interpolated from range i and i + 1 */
+            d->i = sample->n_ranges - 2;
+        }
+    }
+    free(x);
+    free(n_sub);
+    return EXIT_SUCCESS;
+}
+
+static void exit_table_entry_set(exit_table *t, size_t j, double E_out, double gain, double added) { /* Stores an entry, unless another thread already did. The entry is published by setting the ready flag last. */
+#pragma omp critical(exit_table)
+    {
+        if(!t->ready[j]) {
+            t->E_out[j] = E_out;
+            t->gain[j] = gain;
+            t->added[j] = added;
+#pragma omp flush
+            t->ready[j] = TRUE;
+            t->n_computed++;
+        }
+    }
+}
+
+static int exit_table_step_node(const exit_table *t, const exit_table_calc *calc, size_t i_node, size_t i, ion *ion_E, depth *d) { /* Steps ion with energy of point i from node i_node to the previous node */
+    *ion_E = *calc->p;
+    ion_E->E = exp(t->log_E_min + i * t->log_step);
+    ion_E->S = 0.0; /* Straggling picked up in the slab */
+    *d = t->nodes[i_node];
+    return exit_table_step_to(calc->stop, calc->stragg, calc->params_exiting, ion_E, d, t->nodes[i_node - 1].x, calc->sample);
+}
+
+static void exit_table_entry(exit_table *t, const exit_table_calc *calc, size_t i_node, size_t i) { /* Computes the table entry. Ion is stepped from this node to the previous one and the rest is looked up from the previous node, which must be computed first (see exit_table_fill()). */
+    assert(i_node > 0); /* Node 0 is always computed */
+    const size_t j = i_node * t->n + i;
+    ion ion_E = *calc->p;
+    ion_E.E = exp(t->log_E_min + i * t->log_step);
+    depth d = t->nodes[i_node];
+    depth d_start = {.x = d.x, .i = stop_next_crossing(&ion_E, calc->sample, &d).i};
+    double k_start = stop_sample(calc->stop, &ion_E, calc->sample, d_start, ion_E.E);
+    double E_out, gain, added;
+    if(exit_table_step_node(t, calc, i_node, i, &ion_E, &d) ||
+       exit_table_lookup(t, i_node - 1, ion_E.E, &E_out, &gain, &added)) {
+        exit_table_entry_set(t, j, 0.0, 0.0, 0.0);
+        return;
+    }
+    double a = 1.0; /* Gain of straggling in the slab, see stop_step() */
+#ifndef NO_STATISTICAL_STRAGGLING
+    if(k_start >= STOP_STEP_MINIMUM_STOPPING) {
+        a = pow2(stop_sample(calc->stop, &ion_E, calc->sample, d, ion_E.E) / k_start);
+    }
+#endif
+    exit_table_entry_set(t, j, E_out, gain * a, gain * ion_E.S + added);
+}
+
+static void exit_table_fill(exit_table *t, const exit_table_calc *calc, size_t i_node, size_t i_first, size_t i_last) { /* Computes entries i_first...i_last of node i_node and what they need from the nodes before it. Going towards the exit, the window of entries needed from each node is found by stepping ions of the first and last entry. Then the windows are computed starting from the node closest to the exit. Stack use does not depend on the number of nodes. */
+    if(exit_table_ready(t, i_node, i_first, i_last)) {
+        return;
+    }
+    size_t *window = malloc(2 * (i_node + 1) * sizeof(size_t));
+    if(!window) {
+        return; /* Lookups fail, ions are calculated the hard way */
+    }
+    size_t k = i_node;
+    window[2 * k] = i_first;
+    window[2 * k + 1] = i_last;
+    while(k > 1) {
+        ion ion_E;
+        depth d;
+        size_t i_hi, i_lo;
+        double s;
+        if(exit_table_step_node(t, calc, k, window[2 * k + 1], &ion_E, &d) || exit_table_index(t, ion_E.E, &i_hi, &s)) {
+            break; /* All ions of the window stop before the previous node or go below E_min, no entries needed from it */
+        }
+        if(exit_table_step_node(t, calc, k, window[2 * k], &ion_E, &d) || exit_table_index(t, ion_E.E, &i_lo, &s)) {
+            i_lo = 0;
+        }
+        k--;
+        window[2 * k] = (i_lo > 0 ? i_lo - 1 : 0); /* Neighbours are needed for interpolation, see exit_table_lookup() */
+        window[2 * k + 1] = GSL_MIN(i_hi + 2, t->n - 1);
+        if(exit_table_ready(t, k, window[2 * k], window[2 * k + 1])) {
+            k++;
+            break;
+        }
+    }
+    for(; k <= i_node; k++) {
+        for(size_t i = window[2 * k]; i <= window[2 * k + 1]; i++) {
+            if(!exit_table_ready(t, k, i, i)) {
+                exit_table_entry(t, calc, k, i);
+            }
+        }
+    }
+    free(window);
+}
+
+static exit_table *exit_table_init(const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting, const ion *p, const sample *sample, double E_max) {
+    if(sample->n_ranges < 2) {
+        return NULL;
+    }
+    exit_table *t = calloc(1, sizeof(exit_table));
+    if(!t) {
+        return NULL;
+    }
+    t->isotope = p->isotope;
+    t->n_computed = 0;
+    t->stop = *stop;
+    t->stragg = *stragg;
+    t->params_exiting = *params_exiting;
+    t->inverse_cosine_theta = p->inverse_cosine_theta;
+    t->E_min = GSL_MAX_DBL(GSL_MAX_DBL(stop->emin, p->ion_gsto->emin), STOP_TABLE_E_MIN);
+    t->E_max = E_max;
+    if(t->E_max <= t->E_min) {
+        exit_table_free(t);
+        return NULL;
+    }
+    t->n = (size_t) ceil(log10(t->E_max / t->E_min) * EXIT_TABLE_POINTS_PER_DECADE) + 1;
+    t->n = GSL_MAX(t->n, 4);
+    t->log_E_min = log(t->E_min);
+    t->log_step = (log(t->E_max) - t->log_E_min) / (1.0 * (t->n - 1));
+    t->log_step_inv = 1.0 / t->log_step;
+    if(exit_table_make_nodes(t, stop, params_exiting, p, sample)) {
+        exit_table_free(t);
+        return NULL;
+    }
+    t->E_out = malloc(t->n_nodes * t->n * sizeof(double));
+    t->gain = malloc(t->n_nodes * t->n * sizeof(double));
+    t->added = malloc(t->n_nodes * t->n * sizeof(double));
+    t->ready = calloc(t->n_nodes * t->n, sizeof(char));
+    if(!t->E_out || !t->gain || !t->added || !t->ready) {
+        exit_table_free(t);
+        return NULL;
+    }
+    for(size_t i = 0; i < t->n; i++) { /* Node 0 is the exit */
+        t->E_out[i] = exp(t->log_E_min + i * t->log_step);
+        t->gain[i] = 1.0;
+        t->added[i] = 0.0;
+        t->ready[i] = TRUE;
+    }
+    DEBUGMSG("Exit table for %s (inverse cosine %g) initialized. %zu nodes, %zu energies from %g keV to %g keV.", t->isotope->name, t->inverse_cosine_theta, t->n_nodes, t->n, t->E_min / C_KEV, t->E_max / C_KEV);
+    return t;
+}
+
+exit_tables *exit_tables_new(const sample *sample, double E_max) {
+    exit_tables *et = malloc(sizeof(exit_tables));
+    if(!et) {
+        return NULL;
+    }
+    et->sample = sample;
+    et->E_max = E_max;
+    et->n_tables = 0;
+    et->t = NULL;
+    return et;
+}
+
+void exit_tables_free(exit_tables *et) {
+    if(!et) {
+        return;
+    }
+    exit_tables_flush(et);
+    free(et);
+}
+
+void exit_tables_flush(exit_tables *et) {
+    if(!et) {
+        return;
+    }
+    for(size_t i = 0; i < et->n_tables; i++) {
+        exit_table_free(et->t[i]);
+    }
+    free(et->t);
+    et->t = NULL;
+    et->n_tables = 0;
+}
+
+void exit_tables_prepare(exit_tables *et, double E_max) {
+    if(!et) {
+        return;
+    }
+#pragma omp critical(exit_tables)
+    {
+        if(E_max > et->E_max) {
+            DEBUGMSG("Exit tables E_max was %g keV, now %g keV. New tables will be made.", et->E_max / C_KEV, E_max / C_KEV);
+            et->E_max = E_max * STOP_TABLE_E_MAX_MARGIN; /* Small increases in energy (e.g. fit Jacobian) should not require new tables every time */
+        }
+    }
+}
+
+static int exit_table_stop_equal(const jabs_stop *a, const jabs_stop *b) {
+    return a->gsto == b->gsto && a->type == b->type && a->nuclear_stopping_accurate == b->nuclear_stopping_accurate &&
+           a->rk4 == b->rk4 && a->adaptive == b->adaptive && a->adaptive_tolerance == b->adaptive_tolerance && a->emin == b->emin;
+}
+
+static int exit_table_settings_equal(const exit_table *t, const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting) { /* Straggling is part of the key, since gain and added straggling are tabulated */
+    const jabs_stop_step_params *p = &t->params_exiting;
+    return exit_table_stop_equal(&t->stop, stop) && exit_table_stop_equal(&t->stragg, stragg) &&
+           p->step == params_exiting->step && p->min == params_exiting->min && p->max == params_exiting->max && p->sigmas == params_exiting->sigmas;
+}
+
+static exit_table *exit_tables_get_unlocked(exit_tables *et, const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting, const ion *p) {
+    for(size_t i = 0; i < et->n_tables; i++) { /* Tables that don't match are kept, other threads (e.g. with different settings) may be using them */
+        const exit_table *t = et->t[i];
+        if(t->isotope == p->isotope && t->inverse_cosine_theta == p->inverse_cosine_theta && t->E_max >= et->E_max && exit_table_settings_equal(t, stop, stragg, params_exiting)) {
+            return et->t[i];
+        }
+    }
+    exit_table *t = exit_table_init(stop, stragg, params_exiting, p, et->sample, et->E_max);
+    if(!t) {
+        return NULL;
+    }
+    exit_table **t_new = realloc(et->t, (et->n_tables + 1) * sizeof(exit_table *));
+    if(!t_new) {
+        exit_table_free(t);
+        return NULL;
+    }
+    et->t = t_new;
+    et->t[et->n_tables] = t;
+    et->n_tables++;
+    return t;
+}
+
+exit_table *exit_tables_get(exit_tables *et, const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting, const ion *p) {
+    if(!et) {
+        return NULL;
+    }
+    exit_table *t;
+#pragma omp critical(exit_tables)
+    t = exit_tables_get_unlocked(et, stop, stragg, params_exiting, p);
+    return t;
+}
+
+int exit_table_exit(exit_table *t, const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting, ion *p, depth depth_start, const sample *sample) {
+    if(!t || p->isotope != t->isotope || p->inverse_cosine_theta != t->inverse_cosine_theta) {
+        return stop_sample_exit(stop, stragg, params_exiting, p, depth_start, sample);
+    }
+    depth d = depth_start;
+    const double distance = exit_table_distance(p, sample, d.x) + DEPTH_TOLERANCE;
+    size_t lo = 0, hi = t->n_nodes; /* Find the last node that is closer to the exit than d, ion steps to it */
+    while(hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if(exit_table_distance(p, sample, t->nodes[mid].x) <= distance) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    const exit_table_calc calc = {.stop = stop, .stragg = stragg, .params_exiting = params_exiting, .p = p, .sample = sample};
+    if(exit_table_step_to(stop, stragg, params_exiting, p, &d, t->nodes[lo].x, sample) == EXIT_SUCCESS) {
+        double E_out, gain, added;
+        size_t i;
+        double s;
+        if(exit_table_index(t, p->E, &i, &s) == EXIT_SUCCESS) { /* Entries are computed when they are needed */
+            exit_table_fill(t, &calc, lo, i > 0 ? i - 1 : 0, GSL_MIN(i + 2, t->n - 1));
+        }
+        if(exit_table_lookup(t, lo, p->E, &E_out, &gain, &added) == EXIT_SUCCESS) {
+            p->E = E_out;
+            p->S = gain * p->S + added;
+            return 0;
+        }
+    }
+    return stop_sample_exit(stop, stragg, params_exiting, p, d, sample); /* The hard way, from wherever we got */
+}
+
+size_t exit_tables_size(const exit_tables *et) {
+    size_t sum = 0;
+    if(!et) {
+        return 0;
+    }
+    for(size_t i = 0; i < et->n_tables; i++) {
+        sum += et->t[i]->n_computed;
+    }
+    return sum;
+}
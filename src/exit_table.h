@@ -0,0 +1,62 @@
+/*
+
+    Jaakko's Backscattering Simulator (JaBS)
+    Copyright (C) 2021 - 2024 Jaakko Julin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    See LICENSE.txt for the full license.
+
+ */
+#ifndef JABS_EXIT_TABLE_H
+#define JABS_EXIT_TABLE_H
+#include "ion.h"
+#include "sample.h"
+#include "stop.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct exit_table { /* Energy and straggling of an ion exiting the sample, as a function of energy at depth nodes. Entries are computed when they are needed, tables can be shared by threads. */
+    const jibal_isotope *isotope;
+    double inverse_cosine_theta; /* Direction of the ion, tables are valid only for this */
+    size_t n_nodes;
+    depth *nodes; /* Array, n_nodes elements. Node 0 is where the ion exits the sample (surface or back), the rest are ordered by distance from it. */
+    size_t n; /* Number of energy points per node */
+    double E_min;
+    double E_max;
+    double log_E_min;
+    double log_step;
+    double log_step_inv;
+    double *E_out; /* 2D-table, size n_nodes * n. Energy after exiting the sample. Zero if the ion stops or the value could not be tabulated. */
+    double *gain; /* Same as above. Straggling after exiting is gain * S + added, where S is the straggling at the node */
+    double *added;
+    char *ready; /* Same as above. TRUE when the entry has been computed, entries are published by setting this last (see exit_table_entry_set()). */
+    size_t n_computed;
+    jabs_stop stop; /* Copy of stopping settings the table is computed with */
+    jabs_stop stragg; /* Same for straggling */
+    jabs_stop_step_params params_exiting;
+} exit_table;
+
+typedef struct exit_tables { /* Tables are found by isotope, direction, stopping settings and energy range. Tables are never freed while they can be in use, only by exit_tables_flush(). */
+    const sample *sample; /* Tables are valid for this sample only */
+    double E_max; /* Maximum energy of exiting ions, tables made from now on are valid up to this energy */
+    size_t n_tables;
+    exit_table **t; /* Array of pointers, n_tables elements */
+} exit_tables;
+
+exit_tables *exit_tables_new(const sample *sample, double E_max);
+void exit_tables_free(exit_tables *et);
+void exit_tables_flush(exit_tables *et); /* Frees all tables. Not thread safe, tables must not be in use. */
+void exit_tables_prepare(exit_tables *et, double E_max); /* Tables made after this extend (a bit further) than E_max. Existing tables are kept, since other threads may be using them. Use this when et is kept for a long time. */
+exit_table *exit_tables_get(exit_tables *et, const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting, const ion *p); /* Finds a table for the isotope and direction of ion p, with the same stopping and straggling settings and valid up to E_max of et, or computes one. Returns NULL on failure. */
+int exit_table_exit(exit_table *t, const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting, ion *p, depth depth_start, const sample *sample); /* Same as stop_sample_exit(), but uses table t if possible. t can be NULL. */
+size_t exit_tables_size(const exit_tables *et); /* Total number of computed entries */
+#ifdef __cplusplus
+}
+#endif
+#endif // JABS_EXIT_TABLE_H
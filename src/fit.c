@@ -43,20 +43,21 @@
 #endif
 
 
-int fit_detector(const jibal *jibal, const fit_data_det *fdd, const simulation *sim, result_spectra *spectra, gsl_vector *f) {
+int fit_detector(const jibal *jibal, sim_workspace_pool *pool, const fit_data_det *fdd, const simulation *sim, result_spectra *spectra, sim_workspace_bricks **bricks, gsl_vector *f) {
     detector *det = sim_det(sim, fdd->i_det);
     if(!det) {
         jabs_message(MSG_ERROR, "No detector set.\n");
         return EXIT_FAILURE;
     }
     detector_update(det); /* non-const pointer inside const... not great */
-    sim_workspace *ws = sim_workspace_init(jibal, sim, det);
+    sim_workspace *ws = sim_workspace_pool_get(pool, fdd->i_det, jibal, sim, det);
     if(!ws) {
         jabs_message(MSG_ERROR, "Could not initialize workspace of detector %s.\n", det->name);
         return EXIT_FAILURE;
     }
     if(simulate_with_ds(ws)) {
         jabs_message(MSG_ERROR, "Simulation of detector %s spectrum failed!\n", det->name);
+        sim_workspace_pool_release(pool, ws);
         return EXIT_FAILURE;
     }
     fit_data_det_residual_vector_set(fdd, ws->histo_sum, f);
@@ -69,10 +70,53 @@ int fit_detector(const jibal *jibal, const fit_data_det *fdd, const simulation *
         result_spectra_free(spectra);
         fit_data_spectra_copy_to_spectra_from_ws(spectra, det, fdd->exp, ws);
     }
-    sim_workspace_free(ws);
+    if(bricks) {
+        sim_workspace_bricks_free(*bricks);
+        *bricks = sim_workspace_bricks_copy(ws);
+    }
+    sim_workspace_pool_release(pool, ws);
+    return EXIT_SUCCESS;
+}
+
+static int fit_sample_update(fit_data *fit) { /* Updates sample of simulation from the sample model. This is done in place, unless structure of the model has changed. */
+    if(sample_model_map_valid(fit->sm_map, fit->sm, fit->sim->sample)) {
+        return sample_update_from_sample_model(fit->sim->sample, fit->sm, fit->sm_map);
+    }
+    sample_free(fit->sim->sample);
+    sample_model_map_free(fit->sm_map);
+    fit->sm_map = NULL;
+    fit->sim->sample = sample_from_sample_model(fit->sm);
+    if(!fit->sim->sample) {
+        return EXIT_FAILURE;
+    }
+    fit->sm_map = sample_model_map_new(fit->sm, fit->sim->sample);
     return EXIT_SUCCESS;
 }
 
+static sample *fit_sample_perturbed(fit_data *fit, jacobian_space *spc) { /* Sample with value of (perturbed) variable of spc, other values are from sim->sample. Only ranges affected by the variable are computed. */
+    const fit_variable *var = spc->var;
+    size_t i_range = sample_model_range_of_value(fit->sm, var->value);
+    if(i_range == SIZE_MAX || !sample_model_map_valid(fit->sm_map, fit->sm, fit->sim->sample)) { /* Full rebuild */
+        sample_free(spc->sample);
+        spc->sample = sample_from_sample_model(fit->sm);
+        return spc->sample;
+    }
+    if(spc->sample && spc->sample->n_ranges == fit->sim->sample->n_ranges && spc->sample->n_isotopes == fit->sim->sample->n_isotopes) {
+        sample_copy_values(spc->sample, fit->sim->sample);
+    } else {
+        sample_free(spc->sample);
+        spc->sample = sample_copy(fit->sim->sample);
+        if(!spc->sample) {
+            return NULL;
+        }
+    }
+    sample_update_range(spc->sample, fit->sm, fit->sm_map, i_range);
+    if(var->value == &fit->sm->ranges[i_range].x) { /* Depths of deeper ranges change too */
+        sample_update_depths(spc->sample, fit->sm, fit->sm_map, i_range);
+    }
+    return spc->sample;
+}
+
 void fit_deriv_prepare_jspaces(const gsl_vector *x, fit_data *fit) {
     jacobian_space *space = fit->jspace;
     for(size_t j = 0; j < fit->fit_params->n_active; j++) { /* Make copies of sim (shallow) with deep copies of detector and sample. This way we can parallelize. */
@@ -80,6 +124,11 @@ void fit_deriv_prepare_jspaces(const gsl_vector *x, fit_data *fit) {
         spc->n_spectra_calculated = 0;
         fit_variable *var = spc->var;
         double xj = gsl_vector_get(x, j);
+        spc->x = xj;
+        spc->analytic = (var->linear && xj != 0.0);
+        if(spc->analytic) {
+            continue;
+        }
         double delta = fit->h_df * fabs(xj);
         if(delta == 0.0) {
             delta = fit->h_df; /* TODO: this is what GSL does, but it doesn't always work */
@@ -89,7 +138,7 @@ void fit_deriv_prepare_jspaces(const gsl_vector *x, fit_data *fit) {
         spc->sim = *fit->sim; /* Shallow copy! */
         switch(var->type) { /* Deepen the copy based on the variable */
             case FIT_VARIABLE_SAMPLE:
-                spc->sim.sample = sample_from_sample_model(fit->sm);
+                spc->sim.sample = fit_sample_perturbed(fit, spc);
                 break;
             case FIT_VARIABLE_DETECTOR:
                 spc->sim.det = spc->det;
@@ -108,10 +157,10 @@ void fit_deriv_cleanup_jspaces(fit_data *fit) {
         struct jacobian_space *spc = &space[j];
         fit_variable *var = spc->var;
         fit->stats.n_spectra_iter += spc->n_spectra_calculated;
+        if(spc->analytic) {
+            continue;
+        }
         switch(var->type) {
-            case FIT_VARIABLE_SAMPLE:
-                sample_free(spc->sim.sample);
-                break;
             case FIT_VARIABLE_DETECTOR:
                 detector_free(spc->sim.det[var->i_det]);
                 break;
@@ -121,60 +170,483 @@ void fit_deriv_cleanup_jspaces(fit_data *fit) {
     }
 }
 
+static void fit_deriv_linear(const fit_data_det *fdd, const gsl_vector *f_iter, double x, gsl_matrix *J, size_t j) { /* Simulated spectrum is proportional to x, derivative of residual (exp - sim) is -sim/x = (f - exp)/x */
+    size_t i_vec = 0;
+    for(size_t i_range = 0; i_range < fdd->n_ranges; i_range++) {
+        const roi *range = &fdd->ranges[i_range];
+        for(size_t i = range->low; i <= range->high; i++) {
+            double fi = jabs_gsl_vector_get(f_iter, fdd->f_offset + i_vec);
+            jabs_gsl_matrix_set(J, i_vec + fdd->f_offset, j, (fi - fdd->exp->bin[i]) / x);
+            i_vec++;
+        }
+    }
+}
+
+fit_jacobian_broyden *fit_jacobian_broyden_new(size_t n, size_t p) {
+    fit_jacobian_broyden *b = calloc(1, sizeof(fit_jacobian_broyden));
+    if(!b) {
+        return NULL;
+    }
+    b->J = gsl_matrix_alloc(n, p);
+    b->x = gsl_vector_alloc(p);
+    b->f = gsl_vector_alloc(n);
+    b->valid = FALSE;
+    return b;
+}
+
+void fit_jacobian_broyden_free(fit_jacobian_broyden *b) {
+    if(!b) {
+        return;
+    }
+    gsl_matrix_free(b->J);
+    gsl_vector_free(b->x);
+    gsl_vector_free(b->f);
+    free(b);
+}
+
+static void fit_jacobian_broyden_store(fit_jacobian_broyden *b, const gsl_vector *x, const gsl_vector *f, const gsl_matrix *J) { /* Store Jacobian evaluated using finite differences */
+    gsl_matrix_memcpy(b->J, J);
+    gsl_vector_memcpy(b->x, x);
+    gsl_vector_memcpy(b->f, f);
+    b->n_updates = 0;
+    b->valid = TRUE;
+}
+
+static int fit_jacobian_broyden_update(fit_data *fit, const gsl_vector *x, gsl_matrix *J) { /* Rank-one update J = J_prev + (df - J_prev dx) dx^T / (dx^T dx). Returns EXIT_FAILURE if Jacobian should be evaluated using finite differences instead. */
+    fit_jacobian_broyden *b = fit->broyden;
+    if(!b || !b->valid || b->n_updates >= fit->jacobian_refresh) {
+        return EXIT_FAILURE;
+    }
+    double f_norm2, f_prev_norm2;
+    gsl_blas_ddot(fit->f_iter, fit->f_iter, &f_norm2);
+    gsl_blas_ddot(b->f, b->f, &f_prev_norm2);
+    if(f_norm2 > (1.0 - FIT_JACOBIAN_STALL_TOL) * f_prev_norm2) { /* Convergence stalls, approximation is probably not good enough (anymore) */
+        DEBUGMSG("Broyden update skipped, sum of squared residuals %g, previously %g.", f_norm2, f_prev_norm2);
+        return EXIT_FAILURE;
+    }
+    gsl_vector *dx = b->x;
+    gsl_vector_sub(dx, x);
+    gsl_vector_scale(dx, -1.0); /* dx = x - x_prev */
+    double dx_norm2;
+    gsl_blas_ddot(dx, dx, &dx_norm2);
+    if(dx_norm2 == 0.0) {
+        return EXIT_FAILURE;
+    }
+    gsl_vector *df = b->f;
+    gsl_vector_sub(df, fit->f_iter);
+    gsl_vector_scale(df, -1.0); /* df = f - f_prev */
+    gsl_blas_dgemv(CblasNoTrans, -1.0, b->J, dx, 1.0, df); /* df - J_prev dx */
+    gsl_blas_dger(1.0 / dx_norm2, df, dx, b->J);
+    for(size_t j = 0; j < fit->fit_params->n_active; j++) { /* Linear variables can be computed exactly, overwrite the approximation */
+        const fit_variable *var = fit_params_find_active(fit->fit_params, j);
+        double xj = gsl_vector_get(x, j);
+        if(!var->linear || xj == 0.0) {
+            continue;
+        }
+        gsl_vector_view col = gsl_matrix_column(b->J, j);
+        gsl_vector_set_zero(&col.vector);
+        for(size_t i_det = 0; i_det < fit->sim->n_det; i_det++) {
+            const fit_data_det *fdd = &fit->fdd[i_det];
+            if(fdd->n_ranges == 0 || (var->type == FIT_VARIABLE_DETECTOR && var->i_det != i_det)) {
+                continue;
+            }
+            fit_deriv_linear(fdd, fit->f_iter, xj, b->J, j);
+        }
+    }
+    gsl_vector_memcpy(b->x, x);
+    gsl_vector_memcpy(b->f, fit->f_iter);
+    b->n_updates++;
+    gsl_matrix_memcpy(J, b->J);
+    return EXIT_SUCCESS;
+}
+
+typedef struct fit_deriv_task { /* Simulation (or convolution) of one detector, either for a Jacobian column or for the base point */
+    jacobian_space *spc; /* NULL for base point */
+    size_t i_det;
+    double cost; /* Estimate, used for ordering */
+    size_t n_spectra; /* Number of spectra simulated, set when done */
+} fit_deriv_task;
+
+static int fit_deriv_task_compare(const void *a, const void *b) { /* Base point first, then most expensive first */
+    const fit_deriv_task *ta = (const fit_deriv_task *) a;
+    const fit_deriv_task *tb = (const fit_deriv_task *) b;
+    if(!ta->spc != !tb->spc) {
+        return ta->spc ? 1 : -1;
+    }
+    return (ta->cost < tb->cost) - (ta->cost > tb->cost);
+}
+
+static int fit_deriv_task_run(fit_data *fit, fit_deriv_task *t) {
+    fit_data_det *fdd = &fit->fdd[t->i_det];
+    if(!t->spc) { /* Same as fit_function_det() on first call of iteration */
+        gsl_vector_view f = gsl_vector_subvector(fit->f_iter, fdd->f_offset, fdd->n_ch);
+        double start = jabs_clock();
+        if(fit_detector(fit->jibal, fit->ws_pool, fdd, fit->sim, &fit->spectra[fdd->i_det], &fdd->bricks, &f.vector)) {
+            return EXIT_FAILURE;
+        }
+        fdd->cost = jabs_clock() - start;
+        t->n_spectra = 1;
+        return EXIT_SUCCESS;
+    }
+    jacobian_space *spc = t->spc;
+    gsl_vector_view v = gsl_vector_subvector(spc->f_param, fdd->f_offset, fdd->n_ch); /* The ROIs of this detector are a subvector of f_param (all channels in fit) */
+    DEBUGMSG("Variable %s (i_v = %zu) Jacobian, detector %zu, offset: %zu, len: %zu", spc->var->name, spc->var->i_v, t->i_det, fdd->f_offset, fdd->n_ch);
+    if(spc->var->convolution_only && fdd->bricks) { /* Bricks don't change, convolute them again using the perturbed detector */
+        detector *det = sim_det(&spc->sim, t->i_det);
+        detector_update(det);
+        jabs_histogram *h = sim_workspace_bricks_convolute(fdd->bricks, det);
+        if(!h) {
+            return EXIT_FAILURE;
+        }
+        fit_data_det_residual_vector_set(fdd, h, &v.vector);
+        jabs_histogram_free(h);
+        return EXIT_SUCCESS;
+    }
+    if(fit_detector(fit->jibal, fit->ws_pool, fdd, &spc->sim, NULL, NULL, &v.vector)) {
+        return EXIT_FAILURE;
+    }
+    t->n_spectra = 1;
+    return EXIT_SUCCESS;
+}
+
+static void fit_deriv_detectors(const fit_data *fit, const fit_variable *var, size_t *i_start, size_t *i_stop) { /* Range of detectors affected by var, inclusive */
+    if(var->type == FIT_VARIABLE_DETECTOR) {
+        *i_start = var->i_det;
+        *i_stop = var->i_det;
+    } else { /* All detectors */
+        *i_start = 0;
+        *i_stop = fit->sim->n_det - 1;
+    }
+}
+
+static size_t fit_deriv_channels_affected(const fit_data *fit, const fit_variable *var, const fit_data_det *fdd) { /* Channels [0, n) of detector can change when var is perturbed, n is returned. Jacobian is structurally zero in higher channels. SIZE_MAX if not known. */
+    if(!fit->jacobian_sparse || var->type != FIT_VARIABLE_SAMPLE || !fdd->bricks || !sample_model_map_valid(fit->sm_map, fit->sm, fit->sim->sample)) {
+        return SIZE_MAX;
+    }
+    size_t i_range = sample_model_range_of_value(fit->sm, var->value);
+    if(i_range == SIZE_MAX || var->value == &fit->sm->ranges[i_range].rough.x) { /* Roughness affects spectra from all depths */
+        return SIZE_MAX;
+    }
+    double depth = sample_model_range_depth_start(fit->sim->sample, fit->sm_map, i_range);
+    return sim_workspace_bricks_channels_affected(fdd->bricks, sim_det(fit->sim, fdd->i_det), depth);
+}
+
+static int fit_deriv_base_valid(const fit_data *fit, const gsl_vector *x) { /* TRUE if f_iter was computed at x */
+    for(size_t i = 0; i < x->size; i++) {
+        if(gsl_vector_get(x, i) != gsl_vector_get(fit->x_iter, i)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
 int fit_deriv_function(const gsl_vector *x, void *params, gsl_matrix *J) {
     struct fit_data *fit = (struct fit_data *) params;
     assert(fit->stats.iter_call >= 1); /* This function relies on data that was computed when iter_call == 1 */
     assert(fit->fdf->p == fit->fit_params->n_active);
+    const int base = !fit_deriv_base_valid(fit, x); /* Residuals were stored on first call of iteration, but GSL may have rejected that step. Then residuals at x are computed together with the Jacobian. */
+
+    if(!base && fit_jacobian_broyden_update(fit, x, J) == EXIT_SUCCESS) {
+        DEBUGMSG("Jacobian updated (Broyden), %zu consecutive updates.", fit->broyden->n_updates);
+        fit->stats.n_jacobian_updates++;
+        if(fit->J_iter) {
+            gsl_matrix_memcpy(fit->J_iter, J);
+        }
+        return GSL_SUCCESS;
+    }
+    if(base) {
+        DEBUGMSG("Residuals of fit iteration %zu were not computed at x, computing them again.", fit->stats.iter);
+        if(fit_parameters_set_from_vector(fit, x)) {
+            return GSL_FAILURE;
+        }
+        if(fit_sample_update(fit)) {
+            fit->stats.error = FIT_ERROR_SANITY;
+            return GSL_FAILURE;
+        }
+    }
 
     gsl_matrix_set_zero(J); /* We might only set parts of the Jacobian, the rest of the elements of the matrix should be zero. */
 
     fit_deriv_prepare_jspaces(x, fit);
 
     double start = jabs_clock();
-    volatile int error = FALSE;
-    const int n = (int) fit->fit_params->n_active;
-    int j;
-#pragma omp parallel default(none) shared(fit, J, error, n)
-#pragma omp for schedule(dynamic)
-    for(j = 0; j < n; j++) {
-        //fprintf(stderr, "Thread id %i got %zu.\n", omp_get_thread_num(), j);
-        struct jacobian_space *spc = &fit->jspace[j];
-        fit_variable *var = spc->var;
-        size_t i_start, i_stop;
-        if(var->type == FIT_VARIABLE_DETECTOR) {
-            i_start = var->i_det;
-            i_stop = var->i_det;
-        } else { /* All detectors */
-            i_start = 0;
-            i_stop = fit->sim->n_det - 1;
-        }
-        DEBUGMSG("Variable %s (i_v = %zu, j = %i) Jacobian. i_det = [%zu, %zu]", var->name, var->i_v, j, i_start, i_stop);
-        for(size_t i_det = i_start; i_det <= i_stop; i_det++) {
-            fit_data_det *fdd = &fit->fdd[i_det];
-            gsl_vector_view v = gsl_vector_subvector(spc->f_param, fdd->f_offset, fdd->n_ch); /* The ROIs of this detector are a subvector of f_param (all channels in fit) */
-            DEBUGMSG("Detector %zu (FDD %p), %zu ranges, offset: %zu, len: %zu", i_det, (void *) fdd, fdd->n_ranges, fdd->f_offset, fdd->n_ch);
-            if(fdd->n_ranges == 0) {
+    const size_t n_det = fit->sim->n_det;
+    fit_deriv_task *tasks = malloc((fit->fit_params->n_active + 1) * n_det * sizeof(fit_deriv_task)); /* All (column, detector) pairs and base point */
+    size_t *n_ch_affected = malloc(fit->fit_params->n_active * n_det * sizeof(size_t)); /* Number of channels of detector i_det that can change when variable j is perturbed, element j * n_det + i_det */
+    if(!tasks || !n_ch_affected) {
+        free(tasks);
+        free(n_ch_affected);
+        fit_deriv_cleanup_jspaces(fit);
+        return GSL_FAILURE;
+    }
+    for(size_t j = 0; j < fit->fit_params->n_active; j++) {
+        for(size_t i_det = 0; i_det < n_det; i_det++) {
+            n_ch_affected[j * n_det + i_det] = base ? SIZE_MAX : fit_deriv_channels_affected(fit, fit->jspace[j].var, &fit->fdd[i_det]); /* Bricks are from x only if base point was not changed */
+        }
+    }
+    size_t n_sim = 0; /* Number of tasks */
+    size_t n_expensive = 0; /* Tasks that need a simulation are in the beginning of the array, [0, n_expensive) */
+    for(size_t i_det = 0; base && i_det < fit->sim->n_det; i_det++) {
+        if(fit->fdd[i_det].n_ranges == 0) {
+            continue;
+        }
+        fit_deriv_task t = {.spc = NULL, .i_det = i_det, .cost = fit->fdd[i_det].cost, .n_spectra = 0};
+        tasks[n_sim++] = t;
+    }
+    for(int cheap = FALSE; cheap <= TRUE; cheap++) { /* Cheap tasks (re-convolution of stored bricks) are put last, since these need bricks of the base point */
+        for(size_t j = 0; j < fit->fit_params->n_active; j++) {
+            jacobian_space *spc = &fit->jspace[j];
+            if(spc->analytic) {
                 continue;
             }
-            if(fit_detector(fit->jibal, fdd, &spc->sim, NULL, &v.vector)) {
+            size_t i_start, i_stop;
+            fit_deriv_detectors(fit, spc->var, &i_start, &i_stop);
+            for(size_t i_det = i_start; i_det <= i_stop; i_det++) {
+                const fit_data_det *fdd = &fit->fdd[i_det];
+                if(fdd->n_ranges == 0 || cheap != (spc->var->convolution_only && fdd->bricks)) {
+                    continue;
+                }
+                if(n_ch_affected[j * n_det + i_det] <= fdd->ranges[0].low) { /* Only channels below fit ranges change, block of Jacobian is zero */
+                    fit->stats.n_jacobian_blocks_skipped++;
+                    continue;
+                }
+                fit_deriv_task t = {.spc = spc, .i_det = i_det, .cost = fdd->cost, .n_spectra = 0};
+                tasks[n_sim++] = t;
+            }
+        }
+        if(!cheap) {
+            qsort(tasks, n_sim, sizeof(fit_deriv_task), fit_deriv_task_compare);
+            n_expensive = n_sim;
+        }
+    }
+    const int n_tasks = (int) n_sim;
+    const int n_first = (int) n_expensive;
+    volatile int error = FALSE;
+    int i;
+#pragma omp parallel default(none) shared(fit, tasks, error, n_tasks, n_first)
+    {
+#pragma omp for schedule(dynamic)
+        for(i = 0; i < n_first; i++) {
+            if(!error && fit_deriv_task_run(fit, &tasks[i])) {
                 error = TRUE;
-                break;
             }
-            spc->n_spectra_calculated++;
-            for(size_t i = 0; i < fdd->n_ch; i++) {
-                double fnext = jabs_gsl_vector_get(&v.vector, i);
-                double fi = jabs_gsl_vector_get(fit->f_iter, fdd->f_offset + i);
-                jabs_gsl_matrix_set(J, i + fdd->f_offset, j, (fnext - fi) * spc->delta_inv);
+        }
+#pragma omp for schedule(dynamic)
+        for(i = n_first; i < n_tasks; i++) {
+            if(!error && fit_deriv_task_run(fit, &tasks[i])) {
+                error = TRUE;
             }
         }
-        if(error) {
-            continue;
+    }
+    for(i = 0; i < n_tasks; i++) {
+        if(tasks[i].spc) {
+            tasks[i].spc->n_spectra_calculated += tasks[i].n_spectra;
+        } else {
+            fit->stats.n_spectra_iter += tasks[i].n_spectra;
         }
     }
+    free(tasks);
+    if(!error) {
+        if(base) {
+            gsl_vector_memcpy(fit->x_iter, x);
+            fit->stats.n_evals_iter++;
+        }
+        for(size_t j = 0; j < fit->fit_params->n_active; j++) {
+            const jacobian_space *spc = &fit->jspace[j];
+            size_t i_start, i_stop;
+            fit_deriv_detectors(fit, spc->var, &i_start, &i_stop);
+            for(size_t i_det = i_start; i_det <= i_stop; i_det++) {
+                const fit_data_det *fdd = &fit->fdd[i_det];
+                if(fdd->n_ranges == 0) {
+                    continue;
+                }
+                if(spc->analytic) {
+                    fit_deriv_linear(fdd, fit->f_iter, spc->x, J, j);
+                    continue;
+                }
+                const size_t n_affected = n_ch_affected[j * n_det + i_det];
+                size_t i_vec = 0;
+                for(size_t i_range = 0; i_range < fdd->n_ranges; i_range++) {
+                    const roi *range = &fdd->ranges[i_range];
+                    for(size_t i_ch = range->low; i_ch <= range->high; i_ch++, i_vec++) {
+                        if(i_ch >= n_affected) { /* Structurally zero, residuals of skipped blocks were not computed */
+                            continue;
+                        }
+                        double fnext = jabs_gsl_vector_get(spc->f_param, fdd->f_offset + i_vec);
+                        double fi = jabs_gsl_vector_get(fit->f_iter, fdd->f_offset + i_vec);
+                        jabs_gsl_matrix_set(J, i_vec + fdd->f_offset, j, (fnext - fi) * spc->delta_inv);
+                    }
+                }
+            }
+        }
+    }
+    free(n_ch_affected);
     fit_deriv_cleanup_jspaces(fit);
     double end = jabs_clock();
     fit->stats.cputime_iter += (end - start);
-    return error ? GSL_FAILURE : GSL_SUCCESS;
+    if(error) {
+        return GSL_FAILURE;
+    }
+    fit->stats.n_jacobians++;
+    if(fit->broyden) {
+        fit_jacobian_broyden_store(fit->broyden, x, fit->f_iter, J);
+    }
+    if(fit->J_iter) {
+        gsl_matrix_memcpy(fit->J_iter, J);
+    }
+    return GSL_SUCCESS;
+}
+
+struct fit_function_det_data {
+    struct fit_data *fit;
+    gsl_vector *f;
+    int store; /* Store spectra and bricks on first call of iteration */
+};
+
+static int fit_function_det(size_t i_det, void *data) {
+    struct fit_function_det_data *d = (struct fit_function_det_data *) data;
+    struct fit_data *fit = d->fit;
+    fit_data_det *fdd = &fit->fdd[i_det];
+    if(fdd->n_ranges == 0) { /* This will NOT simulate those detectors that don't participate in fit! */
+        return EXIT_SUCCESS;
+    }
+    int first = (d->store && fit->stats.iter_call == 1);
+    result_spectra *spectra = (first ? &fit->spectra[fdd->i_det] : NULL); /* Pass spectra pointer on first call */
+    sim_workspace_bricks **bricks = (first ? &fdd->bricks : NULL); /* Same for bricks, these are needed for Jacobian */
+    gsl_vector_view f_det = gsl_vector_subvector(d->f, fdd->f_offset, fdd->n_ch);
+    double start = jabs_clock();
+    int status = fit_detector(fit->jibal, fit->ws_pool, fdd, fit->sim, spectra, bricks, &f_det.vector);
+    fdd->cost = jabs_clock() - start;
+    return status;
+}
+
+fit_eval_cache *fit_eval_cache_new(size_t n_max) {
+    fit_eval_cache *c = calloc(1, sizeof(fit_eval_cache));
+    if(!c) {
+        return NULL;
+    }
+    c->n_max = n_max;
+    c->entries = calloc(n_max, sizeof(fit_eval_cache_entry));
+    if(!c->entries) {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+static void fit_eval_cache_entry_spectra_free(fit_eval_cache_entry *e) {
+    if(!e->spectra) {
+        return;
+    }
+    for(size_t i = 0; i < e->n_spectra; i++) {
+        result_spectra_free(&e->spectra[i]);
+    }
+    free(e->spectra);
+    e->spectra = NULL;
+    e->n_spectra = 0;
+}
+
+void fit_eval_cache_free(fit_eval_cache *c) {
+    if(!c) {
+        return;
+    }
+    for(size_t i = 0; i < c->n; i++) {
+        fit_eval_cache_entry *e = &c->entries[i];
+        gsl_vector_free(e->x);
+        gsl_vector_free(e->f);
+        fit_eval_cache_entry_spectra_free(e);
+    }
+    free(c->entries);
+    free(c);
+}
+
+static int fit_eval_cache_stop_params_equal(const jabs_stop_step_params *a, const jabs_stop_step_params *b) {
+    return a->step == b->step && a->min == b->min && a->max == b->max && a->sigmas == b->sigmas;
+}
+
+static int fit_eval_cache_params_equal(const sim_calc_params *a, const sim_calc_params *b) { /* Parameters that can change the result of a simulation. Parallelization (parallel_*) is not one of them. */
+    return a->ds == b->ds && a->ds_steps_azi == b->ds_steps_azi && a->ds_steps_polar == b->ds_steps_polar &&
+           a->cs_stragg_pd == b->cs_stragg_pd && a->cs_n_stragg_steps == b->cs_n_stragg_steps && a->n_bricks_max == b->n_bricks_max &&
+           a->rk4 == b->rk4 && a->stop_adaptive == b->stop_adaptive && a->stop_adaptive_tolerance == b->stop_adaptive_tolerance &&
+           a->des_cache == b->des_cache && a->screening_cache == b->screening_cache && a->exit_tables == b->exit_tables &&
+           a->stop_tables == b->stop_tables && a->stop_table_tolerance == b->stop_table_tolerance &&
+           a->nuclear_stopping_accurate == b->nuclear_stopping_accurate && a->mean_conc_and_energy == b->mean_conc_and_energy &&
+           a->geostragg == b->geostragg && a->beta_manual == b->beta_manual && a->gaussian_accurate == b->gaussian_accurate &&
+           a->convolution == b->convolution &&
+           fit_eval_cache_stop_params_equal(&a->incident_stop_params, &b->incident_stop_params) &&
+           fit_eval_cache_stop_params_equal(&a->exiting_stop_params, &b->exiting_stop_params) &&
+           a->ds_incident_stop_step_factor == b->ds_incident_stop_step_factor && a->brick_width_sigmas == b->brick_width_sigmas &&
+           a->rough_layer_multiplier == b->rough_layer_multiplier && a->sigmas_cutoff == b->sigmas_cutoff &&
+           a->int_cs_max_intervals == b->int_cs_max_intervals && a->int_cs_accuracy == b->int_cs_accuracy &&
+           a->int_cs_stragg_max_intervals == b->int_cs_stragg_max_intervals && a->int_cs_stragg_accuracy == b->int_cs_stragg_accuracy &&
+           a->cs_adaptive == b->cs_adaptive && a->cs_energy_step_max == b->cs_energy_step_max && a->cs_depth_step_max == b->cs_depth_step_max &&
+           a->cs_stragg_step_sigmas == b->cs_stragg_step_sigmas && a->reaction_file_angle_tolerance == b->reaction_file_angle_tolerance &&
+           a->bricks_skip_zero_conc_ranges == b->bricks_skip_zero_conc_ranges && a->screening_tables == b->screening_tables;
+}
+
+static int fit_eval_cache_entry_match(const fit_eval_cache_entry *e, const gsl_vector *x, const sim_calc_params *params) {
+    if(e->x->size != x->size || !fit_eval_cache_params_equal(&e->params, params)) {
+        return FALSE;
+    }
+    for(size_t i = 0; i < x->size; i++) {
+        if(gsl_vector_get(e->x, i) != gsl_vector_get(x, i)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static fit_eval_cache_entry *fit_eval_cache_find(fit_eval_cache *c, const gsl_vector *x, const sim_calc_params *params) {
+    if(!c) {
+        return NULL;
+    }
+    for(size_t i = 0; i < c->n; i++) {
+        fit_eval_cache_entry *e = &c->entries[i];
+        if(fit_eval_cache_entry_match(e, x, params)) {
+            e->last_used = ++c->clock;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void fit_eval_cache_store(fit_eval_cache *c, const gsl_vector *x, const sim_calc_params *params, const gsl_vector *f, const result_spectra *spectra, size_t n_spectra) { /* Stores a copy of f (and spectra, if not NULL), replacing an entry with the same x or the least recently used entry */
+    if(!c || c->n_max == 0) {
+        return;
+    }
+    fit_eval_cache_entry *e = fit_eval_cache_find(c, x, params);
+    if(!e) {
+        if(c->n < c->n_max) {
+            e = &c->entries[c->n];
+            c->n++;
+        } else {
+            e = &c->entries[0];
+            for(size_t i = 1; i < c->n; i++) {
+                if(c->entries[i].last_used < e->last_used) {
+                    e = &c->entries[i];
+                }
+            }
+            gsl_vector_free(e->x);
+            gsl_vector_free(e->f);
+            fit_eval_cache_entry_spectra_free(e);
+        }
+        e->x = gsl_vector_alloc(x->size);
+        e->f = gsl_vector_alloc(f->size);
+        gsl_vector_memcpy(e->x, x);
+        e->params = *params;
+        e->last_used = ++c->clock;
+    }
+    gsl_vector_memcpy(e->f, f);
+    if(spectra) { /* Otherwise spectra (if any) from earlier evaluation of the same point are kept */
+        fit_eval_cache_entry_spectra_free(e);
+        e->spectra = calloc(n_spectra, sizeof(result_spectra));
+        if(e->spectra) {
+            e->n_spectra = n_spectra;
+            for(size_t i = 0; i < n_spectra; i++) {
+                result_spectra_copy(&e->spectra[i], &spectra[i]);
+            }
+        }
+    }
 }
 
 int fit_function(const gsl_vector *x, void *params, gsl_vector *f) {
@@ -195,55 +667,132 @@ int fit_function(const gsl_vector *x, void *params, gsl_vector *f) {
         fit->stats.error = FIT_ERROR_SANITY;
         return GSL_FAILURE;
     }
-    sample_free(fit->sim->sample); /* TODO: this is only necessary on first call of iter and when sample specific parameters are active */
-    fit->sim->sample = sample_from_sample_model(fit->sm);
-    if(!fit->sim->sample) {
+    if(fit_sample_update(fit)) {
         fit->stats.error = FIT_ERROR_SANITY;
         return GSL_FAILURE;
     }
-    double start = jabs_clock();
-    volatile int error = FALSE;
-    if(fit->sim->n_det == 1) { /* Skip OpenMP if only one workspace */
-        fit_data_det *fdd = &fit->fdd[0];
-        result_spectra *spectra = (fit->stats.iter_call == 1 ? &fit->spectra[fdd->i_det] : NULL);
-        error = fit_detector(fit->jibal, fdd, fit->sim, spectra, f);
+    const int first = (fit->stats.iter_call == 1); /* Spectra are stored on first call */
+    const fit_eval_cache_entry *e = fit_eval_cache_find(fit->eval_cache, x, fit->sim->params);
+    if(e && (e->spectra || !first)) {
+        DEBUGMSG("Fit iteration %zu call %zu found in cache.", fit->stats.iter, fit->stats.iter_call);
+        gsl_vector_memcpy(f, e->f);
+        for(size_t i = 0; first && i < fit->n_det_spectra && i < e->n_spectra; i++) {
+            result_spectra_copy(&fit->spectra[i], &e->spectra[i]);
+        }
+        for(size_t i_det = 0; first && i_det < fit->sim->n_det; i_det++) { /* Bricks are not cached, Jacobian of convolution only variables will be simulated */
+            sim_workspace_bricks_free(fit->fdd[i_det].bricks);
+            fit->fdd[i_det].bricks = NULL;
+        }
+        fit->stats.n_cache_hits++;
     } else {
-        int i;
-        const int n = (int) fit->sim->n_det;
-#pragma omp parallel default(none) shared(fit, error, f, n)
-#pragma omp for
-        for(i = 0; i < n; i++) {
-#ifdef _OPENMP
-            DEBUGMSG("Thread id %i got %i.", omp_get_thread_num(), i);
-#endif
-            fit_data_det *fdd = &fit->fdd[i];
-            if(fdd->n_ranges == 0) { /* This will NOT simulate those detectors that don't participate in fit! */
-                continue;
-            }
-            result_spectra *spectra = (fit->stats.iter_call == 1 ? &fit->spectra[fdd->i_det] : NULL); /* Pass spectra pointer on first call */
-            gsl_vector_view f_det = gsl_vector_subvector(f, fdd->f_offset, fdd->n_ch);
-            if(fit_detector(fit->jibal, fdd, fit->sim, spectra, &f_det.vector)) {
-                error = TRUE;
-            }
+        double start = jabs_clock();
+        struct fit_function_det_data data = {.fit = fit, .f = f, .store = TRUE};
+        int error = simulate_detectors(fit->sim->n_det, fit->sim->params->parallel_detectors, fit_function_det, &data);
+        double end = jabs_clock();
+        DEBUGMSG("Fit iteration %zu call %zu simulation done.", fit->stats.iter, fit->stats.iter_call);
+        if(error) {
+            jabs_message(MSG_ERROR, "Error in simulating (during fit).");
+            return EXIT_FAILURE;
         }
+        fit->stats.cputime_iter += (end - start);
+        fit->stats.n_evals_iter++;
+        fit->stats.n_spectra_iter += fit->sim->n_det;
+        fit_eval_cache_store(fit->eval_cache, x, fit->sim->params, f, first ? fit->spectra : NULL, fit->n_det_spectra);
     }
-    double end = jabs_clock();
-    DEBUGMSG("Fit iteration %zu call %zu simulation done.", fit->stats.iter, fit->stats.iter_call);
-    if(error) {
-        jabs_message(MSG_ERROR, "Error in simulating (during fit).");
-        return EXIT_FAILURE;
-    }
-    fit->stats.cputime_iter += (end - start);
-    fit->stats.n_evals_iter++;
-    fit->stats.n_spectra_iter += fit->sim->n_det;
-    if(fit->stats.iter_call == 1) {
+    if(first) {
         gsl_vector_memcpy(fit->f_iter, f); /* Store residual vector on first call, this acts as baseline for everything we do later */
+        gsl_vector_memcpy(fit->x_iter, x);
     }
     //gsl_vector_memcpy(f, fit->f);
     DEBUGSTR("Successful fit function call.");
     return GSL_SUCCESS;
 }
 
+static int fit_residuals_simulate(fit_data *fit, const gsl_vector *x, gsl_vector *f) { /* Residuals at x, simulated without storing anything (spectra, bricks or f_iter). Simulation is left at x. */
+    if(fit_parameters_set_from_vector(fit, x)) {
+        return GSL_FAILURE;
+    }
+    if(fit_sample_update(fit)) {
+        fit->stats.error = FIT_ERROR_SANITY;
+        return GSL_FAILURE;
+    }
+    double start = jabs_clock();
+    struct fit_function_det_data data = {.fit = fit, .f = f, .store = FALSE};
+    int error = simulate_detectors(fit->sim->n_det, fit->sim->params->parallel_detectors, fit_function_det, &data);
+    fit->stats.cputime_iter += (jabs_clock() - start);
+    if(error) {
+        return GSL_FAILURE;
+    }
+    fit->stats.n_spectra_iter += fit->sim->n_det;
+    return GSL_SUCCESS;
+}
+
+int fit_fvv_function(const gsl_vector *x, const gsl_vector *v, void *params, gsl_vector *fvv) { /* Second directional derivative of f along v, fvv = 2/h ((f(x + h v) - f(x))/h - J v), same as what GSL uses, but simulations are run like in fit_function() */
+    struct fit_data *fit = (struct fit_data *) params;
+    assert(fit->J_iter); /* Jacobian at x is from the latest call of fit_deriv_function() */
+    const double h = fit->h_fvv;
+    gsl_vector *f_base = NULL; /* Residuals at x, if they have to be computed */
+    const gsl_vector *f_x = fit->f_iter;
+    if(!fit_deriv_base_valid(fit, x)) { /* This is called for every trial step of an iteration. Residuals stored on first call of the iteration were computed at a (rejected) trial step, not at x. */
+        const fit_eval_cache_entry *e = fit_eval_cache_find(fit->eval_cache, x, fit->sim->params);
+        if(e) {
+            f_x = e->f;
+        } else {
+            DEBUGMSG("Residuals at x are not known (fit iteration %zu), computing them for geodesic acceleration.", fit->stats.iter);
+            f_base = gsl_vector_alloc(fvv->size);
+            if(!f_base || fit_residuals_simulate(fit, x, f_base)) {
+                jabs_message(MSG_ERROR, "Error in simulating (geodesic acceleration).\n");
+                gsl_vector_free(f_base);
+                return GSL_FAILURE;
+            }
+            fit->stats.n_evals_iter++;
+            f_x = f_base;
+        }
+    }
+    gsl_vector *x_trial = gsl_vector_alloc(x->size);
+    if(!x_trial) {
+        gsl_vector_free(f_base);
+        return GSL_FAILURE;
+    }
+    gsl_vector_memcpy(x_trial, x);
+    gsl_blas_daxpy(h, v, x_trial);
+    int status = fit_residuals_simulate(fit, x_trial, fvv);
+    gsl_vector_free(x_trial);
+    if(fit_parameters_set_from_vector(fit, x) || fit_sample_update(fit)) { /* Unperturb, simulation (including sample) is left at x */
+        status = GSL_FAILURE;
+    }
+    if(status) {
+        jabs_message(MSG_ERROR, "Error in simulating (geodesic acceleration).\n");
+        gsl_vector_free(f_base);
+        return GSL_FAILURE;
+    }
+    fit->stats.n_fvv++;
+    gsl_vector_sub(fvv, f_x);
+    gsl_vector_free(f_base);
+    gsl_blas_dgemv(CblasNoTrans, -h, fit->J_iter, v, 1.0, fvv); /* f(x + h v) - f(x) - h J v */
+    gsl_vector_scale(fvv, 2.0 / (h * h));
+    return GSL_SUCCESS;
+}
+
+static int fit_jacobian_final(fit_data *fit, const gsl_vector *x, const gsl_vector *weights, gsl_matrix *J) { /* Evaluates J at x using finite differences and applies weights like GSL does */
+    gsl_vector *f = gsl_vector_alloc(fit->fdf->n);
+    if(!f) {
+        return EXIT_FAILURE;
+    }
+    fit->stats.iter_call = 0; /* Next call is considered to be first, so that residuals are stored */
+    fit->broyden->valid = FALSE;
+    int status = fit_function(x, fit, f);
+    gsl_vector_free(f);
+    if(status != GSL_SUCCESS || fit_deriv_function(x, fit, J) != GSL_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    for(size_t i = 0; i < J->size1; i++) {
+        gsl_vector_view row = gsl_matrix_row(J, i);
+        gsl_vector_scale(&row.vector, sqrt(gsl_vector_get(weights, i)));
+    }
+    return EXIT_SUCCESS;
+}
+
 int fit_sanity_check(const fit_data *fit) {
     if(sample_model_sanity_check(fit->sm)) {
         return GSL_FAILURE;
@@ -354,6 +903,10 @@ void fit_data_defaults(fit_data *f) {
     f->xtol = FIT_XTOL;
     f->chisq_tol = FIT_CHISQ_TOL;
     f->chisq_fast_tol = FIT_FAST_CHISQ_TOL;
+    f->accel = FIT_ACCEL;
+    f->accel_fast = FIT_FAST_ACCEL;
+    f->jacobian_refresh = FIT_JACOBIAN_REFRESH;
+    f->jacobian_sparse = FIT_JACOBIAN_SPARSE;
     f->phase_start = FIT_PHASE_FAST;
     f->phase_stop = FIT_PHASE_SLOW;
 }
@@ -385,6 +938,7 @@ void fit_data_jspace_free(fit_data *fit) {
         jacobian_space *spc = &fit->jspace[j];
         free(spc->det);
         gsl_vector_free(spc->f_param);
+        sample_free(spc->sample);
     }
     free(fit->jspace);
     fit->jspace = NULL;
@@ -489,6 +1043,7 @@ fit_params *fit_params_all(fit_data *fit) {
     char *param_name = malloc(sizeof(char) * param_name_max_len);
     fit_params *params = fit_params_new();
     fit_params_add_parameter(params, FIT_VARIABLE_BEAM, &sim->fluence, "fluence", "", 1.0, 0); /* This must be the first parameter always, as there is a speedup in the fit routine */
+    params->vars[params->n - 1].linear = TRUE;
     fit_params_add_parameter(params, FIT_VARIABLE_GEOMETRY, &sim->sample_theta, "alpha", "deg", C_DEG, 0);
     fit_params_add_parameter(params, FIT_VARIABLE_BEAM, &sim->beam_E, "energy", "keV", C_KEV, 0);
 
@@ -545,6 +1100,7 @@ fit_params *fit_params_all(fit_data *fit) {
         }
         snprintf(param_name, param_name_max_len, "%ssolid", det_name);
         fit_params_add_parameter(params, FIT_VARIABLE_DETECTOR, &det->solid, param_name, "msr", C_MSR, i_det);
+        params->vars[params->n - 1].linear = TRUE;
 
         snprintf(param_name, param_name_max_len, "%stheta", det_name);
         fit_params_add_parameter(params, FIT_VARIABLE_DETECTOR, &det->theta, param_name, "deg", C_DEG, i_det);
@@ -567,6 +1123,7 @@ fit_params *fit_params_all(fit_data *fit) {
                          calib_param_name);
                 free(calib_param_name);
                 fit_params_add_parameter(params, FIT_VARIABLE_DETECTOR, calibration_get_param_ref(c, i), param_name, "keV", C_KEV, i_det);
+                params->vars[params->n - 1].convolution_only = TRUE;
             }
         }
         free(det_name);
@@ -638,6 +1195,7 @@ void fit_data_fdd_free(fit_data *fit) {
         }
         gsl_vector_free(fdd->f_iter);
         free(fdd->ranges);
+        sim_workspace_bricks_free(fdd->bricks);
     }
     free(fit->fdd);
     fit->fdd = NULL;
@@ -791,6 +1349,12 @@ struct fit_stats fit_stats_init(void) {
     s.n_spectra_iter = 0;
     s.cputime_cumul = 0.0;
     s.cputime_iter = 0.0;
+    s.walltime = 0.0;
+    s.n_jacobians = 0;
+    s.n_jacobian_updates = 0;
+    s.n_jacobian_blocks_skipped = 0;
+    s.n_fvv = 0;
+    s.n_cache_hits = 0;
     s.chisq0 = 0.0;
     s.chisq = 0.0;
     s.chisq_dof = 0.0;
@@ -874,7 +1438,9 @@ int jabs_gsl_multifit_nlinear_driver(const size_t maxiter, const double xtol, co
             fit_data->stats.cputime_iter = 0.0;
             fit_data->stats.n_evals_iter = 0;
             fit_data->stats.n_spectra_iter = 0;
+            double start = jabs_clock();
             status = gsl_multifit_nlinear_iterate(w);
+            fit_data->stats.walltime += jabs_clock() - start;
             DEBUGMSG("Iteration status %i (%s)", status, gsl_strerror(status));
         }
         if(fit_data->stats.error) {
@@ -926,7 +1492,18 @@ void fit_report_results(const fit_data *fit, const gsl_multifit_nlinear_workspac
     jabs_message(MSG_INFO, "function evaluations (GSL): %zu\n", fdf->nevalf);
 #endif
     jabs_message(MSG_INFO, "Jacobian evaluations: %zu\n", fdf->nevaldf);
+    if(fdf->fvv) {
+        jabs_message(MSG_INFO, "geodesic acceleration evaluations: %zu\n", fit->stats.n_fvv);
+    }
+    if(fit->broyden) {
+        jabs_message(MSG_INFO, "Jacobians from finite differences: %zu, Broyden updates: %zu\n", fit->stats.n_jacobians, fit->stats.n_jacobian_updates);
+    }
+    if(fit->jacobian_sparse) {
+        jabs_message(MSG_INFO, "structurally zero Jacobian blocks skipped: %zu\n", fit->stats.n_jacobian_blocks_skipped);
+    }
     jabs_message(MSG_INFO, "number of spectra simulated: %zu\n", fit->stats.n_spectra);
+    jabs_message(MSG_INFO, "function evaluations found in cache: %zu\n", fit->stats.n_cache_hits);
+    jabs_message(MSG_INFO, "wall time: %.3lf s\n", fit->stats.walltime);
     jabs_message(MSG_INFO, "reason for stopping: %s\n", fit_error_str(fit->stats.error));
     jabs_message(MSG_INFO, "initial |f(x)| = %f\n", sqrt(fit->stats.chisq0));
     jabs_message(MSG_INFO, "final   |f(x)| = %f\n", sqrt(fit->stats.chisq));
@@ -1035,7 +1612,7 @@ int fit(fit_data *fit) {
     if(fdf->df) {
         DEBUGSTR("Using our own function to calculate Jacobian.");
     }
-    fdf->fvv = NULL; /* No geodesic acceleration */
+    fdf->fvv = NULL; /* Geodesic acceleration is set for each phase */
     fdf->n = fit_data_ranges_calculate_number_of_channels(fit);
     fdf->p = fit_params->n_active;
     if(fdf->n < fdf->p) {
@@ -1045,6 +1622,7 @@ int fit(fit_data *fit) {
     }
     fit->dof = fdf->n - fdf->p;
     fit->h_df = fdf_params.h_df;
+    fit->h_fvv = fdf_params.h_fvv;
     jabs_message(MSG_INFO, "%zu channels and %zu parameters in fit, %zu degrees of %s\n", fdf->n, fdf->p, fit->dof, fit->dof < 10000 ? "freedom.":"FREEDOOOOM!!!");
     if(fit_data_jspace_init(fit, fdf->n)) {
         jabs_message(MSG_ERROR, "Could not initialize Jacobian evaluation workspace for %zu parameters.\n", fit->fit_params->n_active);
@@ -1075,8 +1653,17 @@ int fit(fit_data *fit) {
     if(fit_data_fdd_init(fit)) {
         return EXIT_FAILURE;
     }
+    fit->ws_pool = sim_workspace_pool_new();
+    if(fit->jacobian_refresh > 0) {
+        fit->broyden = fit_jacobian_broyden_new(fdf->n, fdf->p);
+    }
+    if((fit->accel && fit->phase_stop >= FIT_PHASE_SLOW) || (fit->accel_fast && fit->phase_start <= FIT_PHASE_FAST)) {
+        fit->J_iter = gsl_matrix_alloc(fdf->n, fdf->p);
+    }
     assert(i_w == fdf->n);
     fit->f_iter = gsl_vector_alloc(fdf->n);
+    fit->x_iter = gsl_vector_alloc(fdf->p);
+    fit->eval_cache = fit_eval_cache_new(FIT_EVAL_CACHE_SIZE);
     gsl_matrix *covar = gsl_matrix_alloc(fit_params->n_active, fit_params->n_active);
     gsl_vector *x = gsl_vector_alloc(fit_params->n_active);
 
@@ -1089,8 +1676,12 @@ int fit(fit_data *fit) {
     gsl_vector_view wts = gsl_vector_view_array(weights, i_w);
 
     w = gsl_multifit_nlinear_alloc(T, &fdf_params, fdf->n, fdf->p);
+    if(!w) {
+        jabs_message(MSG_ERROR, "Could not allocate fit workspace.\n");
+        fit->stats.error = FIT_ERROR_WORKSPACE_INITIALIZATION;
+    }
     sim_calc_params p_orig = *fit->sim->params; /* Store original values (will be used in final stage of fitting) */
-    for(int phase = fit->phase_start; phase <= fit->phase_stop; phase++) { /* Phase 1 is "fast", phase 2 normal. */
+    for(int phase = fit->phase_start; w && phase <= fit->phase_stop; phase++) { /* Phase 1 is "fast", phase 2 normal. */
         assert(phase >= FIT_PHASE_FAST && phase <= FIT_PHASE_SLOW);
         double xtol = fit->xtol;
         double chisq_tol = fit->chisq_tol;
@@ -1111,17 +1702,35 @@ int fit(fit_data *fit) {
             sim_calc_params_copy(&p_orig, fit->sim->params);
         }
         sim_calc_params_update(fit->sim->params);
+        int accel = (phase == FIT_PHASE_FAST) ? fit->accel_fast : fit->accel;
+        fdf->fvv = accel ? &fit_fvv_function : NULL;
+        fdf_params.trs = accel ? gsl_multifit_nlinear_trs_lmaccel : gsl_multifit_nlinear_trs_lm;
+        if(w->params.trs != fdf_params.trs) { /* Trust region subproblem method can only be set when allocating */
+            gsl_multifit_nlinear_free(w);
+            w = gsl_multifit_nlinear_alloc(T, &fdf_params, fdf->n, fdf->p);
+            if(!w) {
+                jabs_message(MSG_ERROR, "Could not allocate fit workspace.\n");
+                fit->stats.error = FIT_ERROR_WORKSPACE_INITIALIZATION;
+                break;
+            }
+        }
+        sim_workspace_pool_flush(fit->ws_pool); /* Workspaces have a copy of calculation parameters of the previous phase */
+        if(fit->broyden) {
+            fit->broyden->valid = FALSE; /* Jacobian of previous phase was computed with different parameters */
+        }
         for(size_t i = 0; i < fit_params->n; i++) { /* Set active variables to vector */
             fit_variable *var = &(fit_params->vars[i]);
             if(var->active) {
                 gsl_vector_set(x, var->i_v, *(var->value)/var->value_orig); /* We'll pass normalized values to GSL, so we are actually starting fit with always with vector full of 1.0. Next phase starts where previous ends. */
             }
         }
-        jabs_message(MSG_INFO, "\nInitializing fit phase %i. Xtol = %e, chisq_tol %e\n", phase, xtol, chisq_tol);
+        jabs_message(MSG_INFO, "\nInitializing fit phase %i. Xtol = %e, chisq_tol %e%s\n", phase, xtol, chisq_tol, accel ? ", geodesic acceleration" : "");
         jabs_message(MSG_VERBOSE, "Simulation parameters for this phase:\n");
         sim_calc_params_print(fit->sim->params, MSG_VERBOSE);
         jabs_message(MSG_IMPORTANT, "Initializing fit...\n");
+        double start = jabs_clock();
         status = gsl_multifit_nlinear_winit(x, &wts.vector, fdf, w);
+        fit->stats.walltime = jabs_clock() - start;
         if(status != 0) {
             jabs_message(MSG_ERROR, "Fit aborted in initialization.\n");
             fit->stats.error = FIT_ERROR_INIT;
@@ -1149,6 +1758,11 @@ int fit(fit_data *fit) {
     } else { /* Do final calculations when fit was successful */
         /* compute covariance of best fit parameters */
         J = gsl_multifit_nlinear_jac(w);
+        if(fit->broyden && fit->broyden->n_updates > 0) { /* Last Jacobian is an approximation, evaluate it properly for covariance */
+            if(fit_jacobian_final(fit, gsl_multifit_nlinear_position(w), &wts.vector, J)) {
+                jabs_message(MSG_WARNING, "Could not evaluate Jacobian at the end of the fit, uncertainties are computed from an approximate Jacobian.\n");
+            }
+        }
         gsl_multifit_nlinear_covar(J, 0.0, covar);
 
         /* compute final cost */
@@ -1169,11 +1783,23 @@ int fit(fit_data *fit) {
     }
     gsl_multifit_nlinear_free(w);
     gsl_vector_free(fit->f_iter);
+    gsl_vector_free(fit->x_iter);
+    fit_eval_cache_free(fit->eval_cache);
+    fit->eval_cache = NULL;
+    sample_model_map_free(fit->sm_map);
+    fit->sm_map = NULL;
     gsl_matrix_free(covar);
     gsl_vector_free(x);
     free(weights);
     free(fdf);
     fit_data_jspace_free(fit);
+    fit_jacobian_broyden_free(fit->broyden);
+    fit->broyden = NULL;
+    gsl_matrix_free(fit->J_iter);
+    fit->J_iter = NULL;
+    sim_workspace_pool_print_stats(fit->ws_pool, MSG_VERBOSE);
+    sim_workspace_pool_free(fit->ws_pool);
+    fit->ws_pool = NULL;
     return fit->stats.error;
 }
 
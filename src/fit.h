@@ -57,8 +57,14 @@ struct fit_stats {
     size_t n_evals_iter; /* Number of function evaluations per iteration */
     size_t n_spectra;
     size_t n_spectra_iter; /* Number of spectra (full spectra with roughness etc) actually simulated per iteration call */
+    size_t n_jacobians; /* Number of Jacobians evaluated using finite differences */
+    size_t n_jacobian_updates; /* Number of Broyden updates of Jacobian */
+    size_t n_jacobian_blocks_skipped; /* Number of (variable, detector) blocks of Jacobian that were structurally zero and not simulated */
+    size_t n_fvv; /* Number of second directional derivatives evaluated (geodesic acceleration) */
+    size_t n_cache_hits; /* Number of fit function evaluations found in cache */
     double cputime_cumul;
     double cputime_iter;
+    double walltime; /* Since start of fit phase */
     double chisq0;
     double chisq;
     double chisq_dof;
@@ -84,6 +90,8 @@ typedef struct fit_data_det {
     size_t n_ch; /* in fit ranges */
     size_t f_offset;
     gsl_vector *f_iter; /* Stored residual vector values of f on first call of iter */
+    sim_workspace_bricks *bricks; /* Bricks from first call of iter, NULL if not available. Used for Jacobian of convolution only variables. */
+    double cost; /* Time (s) of latest simulation of this detector, used for scheduling Jacobian calculations */
 } fit_data_det;
 
 typedef struct jacobian_space {
@@ -93,8 +101,35 @@ typedef struct jacobian_space {
     gsl_vector *f_param; /* Residuals vector */
     double delta_inv; /* Inverse of perturbation 1/delta */
     size_t n_spectra_calculated; /* How many spectra (detectors) were actually computed for this var */
+    int analytic; /* Variable is linear, Jacobian is computed from spectra of the current iteration. Nothing is perturbed or copied. */
+    double x; /* Current (normalized) value of variable */
+    sample *sample; /* Perturbed copy of sample (sample variables only), kept between iterations and updated in place */
 } jacobian_space; /* All the stuff needed to compute Jacobian */
 
+typedef struct fit_jacobian_broyden { /* Jacobian from previous iteration, for Broyden updates */
+    gsl_matrix *J; /* Unweighted */
+    gsl_vector *x; /* Parameters (normalized) of J */
+    gsl_vector *f; /* Residuals at x */
+    size_t n_updates; /* Number of consecutive updates since J was evaluated using finite differences */
+    int valid;
+} fit_jacobian_broyden;
+
+typedef struct fit_eval_cache_entry {
+    gsl_vector *x; /* Parameters (normalized) */
+    sim_calc_params params; /* Shallow copy of calculation parameters, see fit_eval_cache_params_equal() */
+    gsl_vector *f; /* Residuals (unweighted) */
+    result_spectra *spectra; /* Array, n_spectra elements. NULL if spectra were not stored on this evaluation. */
+    size_t n_spectra;
+    size_t last_used;
+} fit_eval_cache_entry;
+
+typedef struct fit_eval_cache { /* Latest evaluations of fit function, so that evaluating the same point again costs nothing */
+    fit_eval_cache_entry *entries; /* Array, n elements */
+    size_t n;
+    size_t n_max;
+    size_t clock;
+} fit_eval_cache;
+
 typedef struct fit_data {
     fit_data_det *fdd; /* Detector specific stuff */
     result_spectra *spectra; /* all spectra (array of n_det_spectra), updates every iter at the start of iter. */
@@ -112,6 +147,10 @@ typedef struct fit_data {
     double xtol; /* Tolerance of step size */
     double chisq_tol; /* Chi squared relative change tolerance */
     double chisq_fast_tol; /* Chi squared relative change tolerance (fast phase) */
+    int accel; /* Use geodesic acceleration (normal phase) */
+    int accel_fast; /* Use geodesic acceleration (fast phase) */
+    size_t jacobian_refresh; /* Maximum number of Broyden updates of Jacobian between finite difference evaluations. Zero disables updates. */
+    int jacobian_sparse; /* Channels not affected by a sample variable (reaction products from shallower depths) are not computed */
     gsl_multifit_nlinear_fdf *fdf;
     size_t dof; /* Degrees of freedom (calculated) */
     struct fit_stats stats; /* Fit statistics, updated as we iterate */
@@ -119,14 +158,26 @@ typedef struct fit_data {
     int phase_stop; /* Inclusive */
     int (*fit_iter_callback)(struct fit_stats stats);
     gsl_vector *f_iter;
+    gsl_vector *x_iter; /* Parameters f_iter was computed with */
     double h_df;
+    double h_fvv;
+    gsl_matrix *J_iter; /* Unweighted Jacobian from last call of fit_deriv_function(). Only stored when geodesic acceleration is used. */
     jacobian_space *jspace;
+    sim_workspace_pool *ws_pool; /* Workspaces reused by fit function and Jacobian evaluations, exists during fit() */
+    fit_jacobian_broyden *broyden; /* NULL if Broyden updates are not used, exists during fit() */
+    fit_eval_cache *eval_cache; /* Exists during fit() */
+    sample_model_map *sm_map; /* How sim->sample was made from sm, NULL if not known. Exists during fit(). */
 } fit_data;
 
 void fit_data_det_residual_vector_set(const fit_data_det *fdd, const jabs_histogram *histo_sum, gsl_vector *f);
 fit_data *fit_data_new(const jibal *jibal, simulation *sim);
+int fit_fvv_function(const gsl_vector *x, const gsl_vector *v, void *params, gsl_vector *fvv);
 int fit_data_jspace_init(fit_data *fit, size_t n_channels_in_fit);
 void fit_data_jspace_free(fit_data *fit);
+fit_eval_cache *fit_eval_cache_new(size_t n_max);
+void fit_eval_cache_free(fit_eval_cache *c);
+fit_jacobian_broyden *fit_jacobian_broyden_new(size_t n, size_t p);
+void fit_jacobian_broyden_free(fit_jacobian_broyden *b);
 void fit_data_defaults(fit_data *f);
 void fit_data_free(fit_data *fit); /* Doesn't free everything in fit, like sm, jibal, ... */
 void fit_data_reset(fit_data *fit);
@@ -80,6 +80,8 @@ int fit_params_add_parameter(fit_params *p, fit_variable_type type, double *valu
     var->unit = unit;
     var->unit_factor = unit_factor;
     var->active = FALSE;
+    var->linear = FALSE;
+    var->convolution_only = FALSE;
     var->i_v = SIZE_MAX;
     if(type == FIT_VARIABLE_DETECTOR) {
         var->i_det = i_det;
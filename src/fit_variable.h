@@ -42,6 +42,8 @@ typedef struct fit_variable {
     int active; /* Set to FALSE by default, if this variable is to be used it should be set to TRUE */
     size_t i_v; /* Index in fit */
     size_t i_det; /* For detector parameters, [0,sim->n_det). Set to sim->n_det or higher to mean all workspaces. */
+    int linear; /* TRUE if simulated spectra are directly proportional to this value, then the Jacobian can be computed without simulating */
+    int convolution_only; /* TRUE if this value only affects the convolution of bricks (calibration, resolution), then the Jacobian can be computed from stored bricks */
 } fit_variable;
 #ifdef __cplusplus
 }
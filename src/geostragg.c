@@ -125,19 +125,18 @@ geostragg_vars geostragg_vars_calculate(const ion *incident, double sample_theta
 }
 
 double geostragg(const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting, const sample *sample, const sim_reaction *r, const geostragg_vars_dir *gd, const depth d, const double E_0) {
-    ion ion;
-    ion = r->p;
-    ion_set_angle(&ion, gd->theta_product_plus, gd->phi_product_plus);
-    ion.E = reaction_product_energy(r->r, gd->theta_plus, E_0);
-    ion.S = 0.0; /* We don't need straggling for anything, might as well reset it */
-    stop_sample_exit(stop, stragg, params_exiting, &ion, d, sample);
-    double Eplus = ion.E;
-    ion = r->p;
-    ion_set_angle(&ion, gd->theta_product_minus, gd->phi_product_minus);
-    ion.E = reaction_product_energy(r->r, gd->theta_minus, E_0);
-    ion.S = 0.0; /* We don't need straggling for anything, might as well reset it */
-    stop_sample_exit(stop, stragg, params_exiting, &ion, d, sample);
-    double Eminus = ion.E;
+    ion ions[2]; /* Plus and minus, both exit the sample simultaneously */
+    ions[0] = r->p;
+    ion_set_angle(&ions[0], gd->theta_product_plus, gd->phi_product_plus);
+    ions[0].E = reaction_product_energy(r->r, gd->theta_plus, E_0);
+    ions[0].S = 0.0; /* We don't need straggling for anything, might as well reset it */
+    ions[1] = r->p;
+    ion_set_angle(&ions[1], gd->theta_product_minus, gd->phi_product_minus);
+    ions[1].E = reaction_product_energy(r->r, gd->theta_minus, E_0);
+    ions[1].S = 0.0;
+    stop_sample_exit_batch(stop, stragg, params_exiting, ions, 2, d, sample);
+    double Eplus = ions[0].E;
+    double Eminus = ions[1].E;
     double result = pow2(Eplus - Eminus);
     DEBUGVERBOSEMSG("Direction (%c), Eplus %g keV, Eminus %g keV, Straggling %g keV FWHM", gd->direction, Eplus/C_KEV, Eminus/C_KEV, C_FWHM*sqrt(result)/C_KEV);
     return result;
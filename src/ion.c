@@ -64,12 +64,16 @@ void ion_set_angle(ion *ion, double theta, double phi) {
 }
 
 double ion_nuclear_stop(const ion *ion, const jibal_isotope *isotope, int accurate) {
+    return ion_nuclear_stop_E(ion, isotope, ion->E, accurate);
+}
+
+double ion_nuclear_stop_E(const ion *ion, const jibal_isotope *isotope, double E, int accurate) {
 #ifdef DEBUG
     assert(isotope->i < ion->nucl_stop->n_isotopes);
     assert(ion->nucl_stop->t[isotope->i].target == isotope);
 #endif
     nucl_stop_pair x = ion->nucl_stop->t[isotope->i];
-    const double epsilon = x.eps0 * ion->E;
+    const double epsilon = x.eps0 * E;
     if(accurate) {
         if(epsilon <= 30.0) {
             return x.k * log(1 + 1.1383 * epsilon) / (2 * (epsilon + 0.01321 * pow(epsilon, 0.21226) + 0.19593 * sqrt(epsilon)));
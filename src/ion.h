@@ -59,6 +59,7 @@ void ion_reset(ion *ion);
 void ion_set_isotope(ion *ion, const jibal_isotope *isotope);
 void ion_set_angle(ion *ion, double theta, double phi);
 double ion_nuclear_stop(const ion *ion, const jibal_isotope *isotope, int accurate);
+double ion_nuclear_stop_E(const ion *ion, const jibal_isotope *isotope, double E, int accurate); /* Same as above, but at energy E instead of ion->E */
 void ion_rotate(ion *ion, double theta2, double phi2);
 void ion_print(FILE *f, const ion *ion);
 jabs_ion_gsto *ion_gsto_new(const jibal_isotope *incident, const jibal_gsto *gsto);
@@ -31,7 +31,11 @@
 #include "defaults.h"
 #include "message.h"
 #include "stop.h"
+#include "des_cache.h"
 #include "win_compat.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 double cross_section_straggling_fixed(const sim_reaction *sim_r, const prob_dist *pd, double E, double S) {
     const double std_dev = sqrt(S);
@@ -252,14 +256,21 @@ int simulate_reaction(const ion *incident, const depth depth_start, sim_workspac
         return EXIT_SUCCESS;
     }
     depth d_before, d_after = depth_start;
-    size_t i_des = 0;
     brick *b = NULL, *b_prev = NULL;
     int skipped, last = FALSE;
 #ifdef DEBUG_VERBOSE
     int crossed;
 #endif
     sim_r->last_brick = 0;
-    const des *des_min = des_table_min_energy_bin(dt);
+    const des des_min = des_table_min_energy_bin(dt);
+    exit_table *et = exit_tables_get(ws->exit_tables, &ws->stop, &ws->stragg, &ws->params->exiting_stop_params, &sim_r->p); /* NULL if not used */
+    exit_table *et_foil = NULL;
+    if(ws->exit_tables && ws->foil_tables) {
+        ion ion_foil = sim_r->p;
+        ion_set_angle(&ion_foil, 0.0, 0.0);
+        exit_tables_prepare(ws->foil_tables, ws->exit_tables->E_max);
+        et_foil = exit_tables_get(ws->foil_tables, &ws->stop, &ws->stragg, &ws->params->exiting_stop_params, &ion_foil);
+    }
     int product_and_incident_go_in_different_directions = (incident->inverse_cosine_theta * sim_r->p.inverse_cosine_theta < 0.0); /* false when transmission, true usually. */
     /* When the above is true, we can safely assume that once reaction product energy goes below some energy, we can stop calculating. */
     size_t i_brick = 0;
@@ -274,16 +285,16 @@ int simulate_reaction(const ion *incident, const depth depth_start, sim_workspac
         b->valid = TRUE; /* Will be invalidated if necessary */
         d_before = d_after;
         DEBUGVERBOSEMSG("E = %g keV (incident), i_brick = %zu", ion1.E / C_KEV, i_brick);
-        if(ion1.E < des_min->E) {
-            DEBUGMSG("E = %g keV (incident) is below %g keV. Changing energy.", ion1.E / C_KEV, des_min->E / C_KEV);
-            des_set_ion(des_min, &ion1);
-            d_after = des_min->d; /* des_table_find_depth() might change the depth */
+        if(ion1.E < des_min.E) {
+            DEBUGMSG("E = %g keV (incident) is below %g keV. Changing energy.", ion1.E / C_KEV, des_min.E / C_KEV);
+            des_set_ion(&des_min, &ion1);
+            d_after = des_min.d; /* des_table_find_depth() might change the depth */
         }
         if(i_brick != 0) {
-            d_after = des_table_find_depth(dt, &i_des, d_before, &ion1); /* Does this handle E below min? */
+            d_after = des_table_find_depth(dt, d_before, &ion1); /* Does this handle E below min? */
         }
-        if(ion1.E <= des_min->E) {
-            DEBUGMSG("This will be the last brick due to incident energy hitting DES minimum %g keV. d_after = %g tfu.", des_min->E / C_KEV, d_after.x / C_TFU);
+        if(ion1.E <= des_min.E) {
+            DEBUGMSG("This will be the last brick due to incident energy hitting DES minimum %g keV. d_after = %g tfu.", des_min.E / C_KEV, d_after.x / C_TFU);
             last = TRUE;
         }
         if(i_brick == 0 || d_after.i != d_before.i) { /* There was a layer (depth range) crossing. If step() took this into account when making DES table the only issue is the .i index. depth (.x) is not changed. */
@@ -316,7 +327,7 @@ int simulate_reaction(const ion *incident, const depth depth_start, sim_workspac
         b->E_r = sim_r->p.E;
         b->S_r = sim_r->p.S;
 
-        if(stop_sample_exit(&ws->stop, &ws->stragg, &ws->params->exiting_stop_params, &sim_r->p, d_after, sample) != 0) {
+        if(exit_table_exit(et, &ws->stop, &ws->stragg, &ws->params->exiting_stop_params, &sim_r->p, d_after, sample) != 0) {
             DEBUGMSG("Stop before exit, energy of reaction product after reaction %g keV.", b->E_r / C_KEV);
             if(product_and_incident_go_in_different_directions) { /* Lowering incident energy will lower reaction product energy */
                 DEBUGSTR("We can stop calculation, because lowering incident energy will also lower reaction product energy. This will be the last brick.");
@@ -330,7 +341,7 @@ int simulate_reaction(const ion *incident, const depth depth_start, sim_workspac
             depth d_foil = {.i = 0, .x = 0.0};
             ion ion_foil = *&sim_r->p;
             ion_set_angle(&ion_foil, 0.0, 0.0); /* Foils are not tilted. We use a temporary copy of "p" to do this step. */
-            if(stop_sample_exit(&ws->stop, &ws->stragg, &ws->params->exiting_stop_params, &ion_foil, d_foil, ws->det->foil)) {
+            if(exit_table_exit(et_foil, &ws->stop, &ws->stragg, &ws->params->exiting_stop_params, &ion_foil, d_foil, ws->det->foil)) {
                 DEBUGMSG("Stop in detector foil. Energy after reaction was %g keV.", b->E_r / C_KEV);
                 if(product_and_incident_go_in_different_directions) { /* Lowering incident energy will lower reaction product energy */
                     DEBUGSTR("We can stop calculation, because lowering incident energy will also lower reaction product energy. This will be the last brick.");
@@ -388,11 +399,10 @@ int simulate_reaction(const ion *incident, const depth depth_start, sim_workspac
         b->deriv = E_deriv;
         b->sc = sigma_conc;
         b->Q = ion1.inverse_cosine_theta * sigma_conc * b->thick;
-        DEBUGVERBOSEMSG("%s %s %3zu %3zu:%10.3lf %3zu:%10.3lf %3zu %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3e %8.3lf %2i",
+        DEBUGVERBOSEMSG("%s %s %3zu %3zu:%10.3lf %3zu:%10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3e %8.3lf %2i",
                 sim_r->r->target->name, reaction_type_to_string(sim_r->r->type), i_brick,
                 d_before.i, d_before.x / C_TFU,
                 d_after.i, d_after.x / C_TFU,
-                i_des,
                 b->E_0 / C_KEV, sqrt(b->S_0) / C_KEV,
                 b->E_r / C_KEV, sqrt(b->S_r) / C_KEV,
                 b->E_s / C_KEV, sqrt(b->S_s) / C_KEV,
@@ -414,7 +424,7 @@ int simulate_reaction(const ion *incident, const depth depth_start, sim_workspac
             break;
         }
         if(last) {
-            DEBUGMSG("Last brick (earlier decision, because des_min = %g keV or because reaction product stopped in the sample or detector foil).", des_min->E / C_KEV);
+            DEBUGMSG("Last brick (earlier decision, because des_min = %g keV or because reaction product stopped in the sample or detector foil).", des_min.E / C_KEV);
             break;
         }
         if(!skipped) {
@@ -434,6 +444,57 @@ int simulate_reaction(const ion *incident, const depth depth_start, sim_workspac
     return EXIT_SUCCESS;
 }
 
+static int simulate_reactions(const ion *incident, const depth depth_start, sim_workspace *ws, const sample *sample, const des_table *dt, const geostragg_vars *g) { /* Reactions are independent, each writes only to its own sim_reaction. Threads share the DES and exit tables, but need their own integration workspaces. */
+    volatile int error = FALSE;
+    const int n = (int) ws->n_reactions;
+    int i_reaction;
+#pragma omp parallel default(none) shared(incident, depth_start, ws, sample, dt, g, error, n) if(ws->params->parallel_reactions && n > 1)
+    {
+        sim_workspace ws_thread = *ws; /* Shallow copy */
+        int own_integration = FALSE;
+#ifdef _OPENMP
+        if(omp_get_thread_num() != 0) { /* Master thread can use integration workspaces of ws */
+            if(sim_workspace_init_integration(&ws_thread)) {
+                error = TRUE;
+            } else {
+                own_integration = TRUE;
+            }
+        }
+#endif
+#pragma omp for schedule(dynamic)
+        for(i_reaction = 0; i_reaction < n; i_reaction++) {
+            if(error) {
+                continue;
+            }
+            sim_reaction *sim_r = ws->reactions[i_reaction];
+            DEBUGMSG("Simulating reaction i_reaction = %i type %s target %s (i_isotope = %zu, i_jibal = %zu) product %s (i_jibal = %zu)",
+                    i_reaction, reaction_type_to_string(sim_r->r->type),
+                    sim_r->r->target->name, sim_r->i_isotope, sim_r->r->target->i,
+                    sim_r->r->product->name, sim_r->r->product->i);
+            if(simulate_reaction(incident, depth_start, &ws_thread, sample, dt, g, sim_r)) {
+                jabs_message(MSG_ERROR, "Simulating reaction %i (%s) failed.\n", i_reaction + 1, reaction_name(sim_r->r));
+                DEBUGMSG("Simulating reaction i_reaction = %i failed.", i_reaction);
+                error = TRUE;
+                continue;
+            }
+            DEBUGMSG("Finished. sim_r->last_brick = %zu (%zu/%zu). depth = %g tfu", sim_r->last_brick, sim_r->last_brick + 1, sim_r->n_bricks, sim_r->bricks[sim_r->last_brick].d.x / C_TFU);
+        }
+        if(own_integration) {
+            sim_workspace_free_integration(&ws_thread);
+        }
+    }
+    if(error) {
+        return EXIT_FAILURE;
+    }
+    for(size_t i = 0; i < ws->n_reactions; i++) { /* Warnings are given in order, regardless of threads */
+        const sim_reaction *sim_r = ws->reactions[i];
+        if(sim_r->last_brick + 1 == sim_r->n_bricks) {
+            jabs_message(MSG_WARNING, "Reaction %s may have produced incomplete results. Use set bricks_n to increase number of bricks from current setting (%zu)", reaction_name(sim_r->r), sim_r->n_bricks);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
 int simulate(const ion *incident, const depth depth_start, sim_workspace *ws, const sample *sample) {
     DEBUGMSG("Starting simulate(ion = %s (E = %.3lf keV, S = %.3lf keV, angles = %.3lf deg, %.3lf deg in sample), depth_start = %g tfu (i = %zu), ...)",
             incident->isotope->name, incident->E / C_KEV, C_FWHM * sqrt(incident->S) / C_KEV, incident->theta / C_DEG, incident->phi / C_DEG,
@@ -441,33 +502,35 @@ int simulate(const ion *incident, const depth depth_start, sim_workspace *ws, co
     geostragg_vars g = geostragg_vars_calculate(incident, ws->sim->sample_theta, ws->sim->sample_phi,
                                                 ws->det, ws->sim->beam_aperture,
                                                 ws->params->geostragg, ws->params->beta_manual);
-    des_table *dt = des_table_compute(&ws->stop, &ws->stragg, ws->params, sample, incident, depth_start, ws->emin); /* Depth, energy and straggling of incident ion */
+    int stop_tables_bound = (ws->stop_tables && stop_tables_bind(ws->stop_tables, ws->sample, sample) == EXIT_SUCCESS); /* Stopping tables of ws->sample are valid for sample copies with different range thicknesses (roughness) */
+    des_cache *dc = ws->params->des_cache ? ws->sim->des_cache : NULL; /* Without a cache, DES table is computed and freed by des_cache_release() */
+    const des_table *dt = des_cache_get(dc, &ws->stop, &ws->stragg, ws->params, sample, incident, depth_start, ws->emin); /* Depth, energy and straggling of incident ion */
     if(!dt) {
         jabs_message(MSG_ERROR, "DES table computation failed.\n");
+        if(stop_tables_bound) {
+            stop_tables_bind(ws->stop_tables, sample, ws->sample);
+        }
         return -1;
     }
 #ifdef DEBUG
     des_table_print(stderr, dt);
 #endif
-    int error = FALSE;
-    for(size_t i_reaction = 0; i_reaction < ws->n_reactions; i_reaction++) {
-        sim_reaction *sim_r = ws->reactions[i_reaction];
-        DEBUGMSG("Simulating reaction i_reaction = %zu type %s target %s (i_isotope = %zu, i_jibal = %zu) product %s (i_jibal = %zu)",
-                i_reaction, reaction_type_to_string(sim_r->r->type),
-                sim_r->r->target->name, sim_r->i_isotope, sim_r->r->target->i,
-                sim_r->r->product->name, sim_r->r->product->i);
-        if(simulate_reaction(incident, depth_start, ws, sample, dt, &g, sim_r)) {
-            jabs_message(MSG_ERROR, "Simulating reaction %zu (%s) failed.\n", i_reaction + 1, reaction_name(sim_r->r));
-            DEBUGMSG("Simulating reaction i_reaction = %zu failed.", i_reaction);
-            error = TRUE;
-            break;
-        }
-        DEBUGMSG("Finished. sim_r->last_brick = %zu (%zu/%zu). depth = %g tfu", sim_r->last_brick, sim_r->last_brick + 1, sim_r->n_bricks, sim_r->bricks[sim_r->last_brick].d.x / C_TFU);
-        if(sim_r->last_brick + 1 == sim_r->n_bricks) {
-            jabs_message(MSG_WARNING, "Reaction %s may have produced incomplete results. Use set bricks_n to increase number of bricks from current setting (%zu)", reaction_name(sim_r->r), sim_r->n_bricks);
-        }
+    if(ws->params->exit_tables) { /* Tables are computed when reactions need them */
+        double E_max = incident->E + ws->params->sigmas_cutoff * sqrt(incident->S);
+        double Q_max = 0.0;
+        for(size_t i_reaction = 0; i_reaction < ws->n_reactions; i_reaction++) {
+            Q_max = GSL_MAX_DBL(Q_max, fabs(ws->reactions[i_reaction]->r->Q));
+        }
+        ws->exit_tables = exit_tables_new(sample, (E_max + Q_max) * STOP_TABLE_E_MAX_MARGIN);
+    }
+    int error = simulate_reactions(incident, depth_start, ws, sample, dt, &g);
+    des_cache_release(dc, dt);
+    DEBUGMSG("Exit tables: %zu points.", exit_tables_size(ws->exit_tables));
+    exit_tables_free(ws->exit_tables);
+    ws->exit_tables = NULL;
+    if(stop_tables_bound) {
+        stop_tables_bind(ws->stop_tables, sample, ws->sample);
     }
-    des_table_free(dt);
     if(error) {
         return -1;
     }
@@ -610,7 +673,6 @@ int simulate_with_roughness(sim_workspace *ws) {
         ion_rotate(&ws->ion, ws->sim->sample_theta, ws->sim->sample_phi);
         return simulate(&ws->ion, depth_seek(ws->sample, 0.0 * C_TFU), ws, ws->sample);
     }
-    struct sample *sample_rough = sample_copy(ws->sample);
     size_t i_rl = 0;
     thick_prob_dist **tpds = calloc(n_rl, sizeof(thick_prob_dist *));
     if(!tpds) {
@@ -648,48 +710,139 @@ int simulate_with_roughness(sim_workspace *ws) {
         iter_total *= tpd->n;
         DEBUGMSG("TPD %zu/%zu, modulo %zu, total %zu (cumulating)\n", i_rl, n_rl, tpd->modulo, iter_total)
     }
-    for(size_t i_iter = 0; i_iter < iter_total; i_iter++) {
-        DEBUGMSG("Roughness step %zu/%zu.", i_iter+1, iter_total);
-        double p = 1.0;
-        for(size_t i_range = 0; i_range < ws->sample->n_ranges; i_range++) { /* Reset ranges for every iter */
-            sample_rough->ranges[i_range].x = ws->sample->ranges[i_range].x;
-        }
-        for(i_rl = 0; i_rl < n_rl; i_rl++) {
-            thick_prob_dist *tpd = tpds[i_rl]; /* One particular thickness probability distribution ("i"th one) */
-            if(!tpd) {
-                continue;
-            }
-            size_t j = (i_iter / tpd->modulo) % tpd->n; /* "j"th roughness element */
-            thick_prob *pj = &tpds[i_rl]->p[j]; /* ..is this one */
-            p *= pj->prob; /* Probability is multiplied by the "i"th roughness, element "j" to get the subspectra weight */
-            double x_diff = pj->x - ws->sample->ranges[tpd->i_range].x; /* Amount to change thickness of this and all subsequent layers */
-            DEBUGMSG("Modifying ranges from %zu to %zu by %g tfu.", tpd->i_range, ws->sample->n_ranges, x_diff/C_TFU);
-            for(size_t i_range = tpd->i_range; i_range < ws->sample->n_ranges; i_range++) {
-                sample_rough->ranges[i_range].x += x_diff;
-            }
+    volatile int error = FALSE;
+    const int n_iter = (int) iter_total;
+    int i_iter;
+#pragma omp parallel default(none) shared(ws, tpds, n_rl, n_iter, fluence_original, error, status) if(ws->params->parallel_roughness && n_iter > 1)
+    {
+        sim_workspace *ws_thread = sim_workspace_copy_for_thread(ws); /* Subspectra are simulated with a copy, then added to ws in order. Result does not depend on the number of threads. */
+        struct sample *sample_rough = sample_copy(ws->sample);
+        if(!ws_thread || !sample_rough) {
+            error = TRUE;
         }
+#pragma omp for schedule(dynamic) ordered
+        for(i_iter = 0; i_iter < n_iter; i_iter++) {
+            int n_ok = -1;
+            if(!error) {
+                DEBUGMSG("Roughness step %i/%i.", i_iter + 1, n_iter);
+                double p = 1.0;
+                for(size_t i_range = 0; i_range < ws->sample->n_ranges; i_range++) { /* Reset ranges for every iter */
+                    sample_rough->ranges[i_range].x = ws->sample->ranges[i_range].x;
+                }
+                for(size_t i = 0; i < n_rl; i++) {
+                    thick_prob_dist *tpd = tpds[i]; /* One particular thickness probability distribution ("i"th one) */
+                    if(!tpd) {
+                        continue;
+                    }
+                    size_t j = (i_iter / tpd->modulo) % tpd->n; /* "j"th roughness element */
+                    thick_prob *pj = &tpd->p[j]; /* ..is this one */
+                    p *= pj->prob; /* Probability is multiplied by the "i"th roughness, element "j" to get the subspectra weight */
+                    double x_diff = pj->x - ws->sample->ranges[tpd->i_range].x; /* Amount to change thickness of this and all subsequent layers */
+                    DEBUGMSG("Modifying ranges from %zu to %zu by %g tfu.", tpd->i_range, ws->sample->n_ranges, x_diff/C_TFU);
+                    for(size_t i_range = tpd->i_range; i_range < ws->sample->n_ranges; i_range++) {
+                        sample_rough->ranges[i_range].x += x_diff;
+                    }
+                }
 #ifdef DEBUG
-        jabs_message(MSG_DEBUG, "Roughness subspectrum %zu / %zu", i_iter, iter_total);
-        sample_print(sample_rough, FALSE, MSG_DEBUG);
+                jabs_message(MSG_DEBUG, "Roughness subspectrum %i / %i", i_iter, n_iter);
+                sample_print(sample_rough, FALSE, MSG_DEBUG);
 #endif
-        ws->fluence = p * fluence_original;
-        ion_set_angle(&ws->ion, 0.0, 0.0);
-        ion_rotate(&ws->ion, ws->sim->sample_theta, ws->sim->sample_phi);
-        sample_thickness_recalculate(sample_rough);
-        status = simulate(&ws->ion, depth_seek(ws->sample, 0.0), ws, sample_rough);
-        if(status < 0) {
-            break;
+                ws_thread->fluence = p * fluence_original;
+                ion_set_angle(&ws_thread->ion, 0.0, 0.0);
+                ion_rotate(&ws_thread->ion, ws->sim->sample_theta, ws->sim->sample_phi);
+                sample_thickness_recalculate(sample_rough);
+                n_ok = simulate(&ws_thread->ion, depth_seek(ws->sample, 0.0), ws_thread, sample_rough);
+            }
+#pragma omp ordered
+            {
+                if(n_ok < 0) {
+                    error = TRUE;
+                } else if(!error) {
+                    sim_workspace_histograms_accumulate(ws, ws_thread, i_iter == n_iter - 1); /* Bricks of the last subspectrum are kept, like before */
+                    status = n_ok;
+                }
+            }
         }
+        sample_free(sample_rough);
+        sim_workspace_free_thread_copy(ws_thread);
+    }
+    if(error) {
+        status = -1;
     }
     for(size_t i = 0; i < n_rl; i++) {
         thickness_probability_table_free(tpds[i]);
     }
-    sample_free(sample_rough);
     free(tpds);
     ws->fluence = fluence_original;
     return status;
 }
 
+int simulate_detectors(size_t n_det, int parallel, int (*simulate_det)(size_t i_det, void *data), void *data) {
+    volatile int error = FALSE;
+    const int n = (int) n_det;
+    int i;
+#pragma omp parallel default(none) shared(simulate_det, data, error, n) if(parallel && n > 1)
+#pragma omp for schedule(dynamic)
+    for(i = 0; i < n; i++) {
+#ifdef _OPENMP
+        DEBUGMSG("Thread id %i got detector %i.", omp_get_thread_num(), i);
+#endif
+        if(simulate_det((size_t) i, data)) {
+            error = TRUE;
+        }
+    }
+    return error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+typedef struct ds_task { /* One dual scattering simulation: ion after first scattering and the fluence of such ions */
+    ion ion;
+    double fluence;
+} ds_task;
+
+static int simulate_thread_num(void) {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+static int simulate_ds_tasks(sim_workspace *ws, sim_workspace **ws_threads, int n_threads, const ds_task *tasks, int n_tasks, depth d_halfdepth, const char *progress) { /* Returns largest number of reactions that produced something in a task, or -1 on error. Results are added to ws in task order. */
+    volatile int error = FALSE;
+    int n_running = 0;
+    int n_done = 0;
+    int i_task;
+#pragma omp parallel default(none) shared(ws, ws_threads, tasks, n_tasks, d_halfdepth, progress, error, n_running, n_done) num_threads(n_threads) if(n_threads > 1 && n_tasks > 1)
+#pragma omp for schedule(dynamic) ordered
+    for(i_task = 0; i_task < n_tasks; i_task++) {
+        sim_workspace *ws_thread = ws_threads[simulate_thread_num()];
+        int n_ok = -1;
+        if(!error) {
+            ws_thread->fluence = tasks[i_task].fluence;
+            n_ok = simulate(&tasks[i_task].ion, d_halfdepth, ws_thread, ws->sample);
+        }
+#pragma omp ordered
+        {
+            if(n_ok < 0) {
+                error = TRUE;
+            } else if(!error) {
+                sim_workspace_histograms_accumulate(ws, ws_thread, i_task == n_tasks - 1);
+                if(n_ok > n_running) {
+                    n_running = n_ok;
+                }
+            }
+            n_done++;
+            if(n_done % 32 == 0 || n_done == n_tasks) { /* Progress counter is only updated here, in task order */
+                jabs_message(MSG_VERBOSE, "\r%s %5i/%i.", progress, n_done, n_tasks);
+            }
+        }
+    }
+    if(error) {
+        return -1;
+    }
+    return n_running;
+}
+
 int simulate_with_ds(sim_workspace *ws) {
     if(!ws) {
         jabs_message(MSG_ERROR, "Congratulations, you've found a bug in %s:%i.\n", __FILE__, __LINE__);
@@ -706,19 +859,32 @@ int simulate_with_ds(sim_workspace *ws) {
     ion_set_angle(&ws->ion, 0.0, 0.0);
     ion_rotate(&ws->ion, ws->sim->sample_theta, ws->sim->sample_phi);
     ion ion1 = ws->ion;
-    ion ion2 = ion1;
     depth d_before = depth_seek(ws->sample, 0.0);
     int ds_steps_polar = ws->params->ds_steps_polar;
     int ds_steps_azi = ws->params->ds_steps_azi;
+#ifdef _OPENMP
+    const int n_threads = (ws->params->parallel_ds && !omp_in_parallel()) ? omp_get_max_threads() : 1; /* Nested regions (e.g. fit) would be run by one thread */
+#else
+    const int n_threads = 1;
+#endif
     sim_calc_params_defaults_fast(ws->params); /* This makes DS faster. Changes to ws->params are not reverted, but they don't affect original sim settings */
     ws->params->incident_stop_params.min *= 3.0;
     sim_calc_params_update(ws->params);
     const jibal_isotope *incident = ws->sim->beam_isotope;
+    ds_task *tasks = malloc(ds_steps_polar * ds_steps_azi * ws->sample->n_isotopes * sizeof(ds_task));
+    sim_workspace **ws_threads = calloc(n_threads, sizeof(sim_workspace *)); /* Copies of ws (made after changing parameters), one per thread. Simulations are added to ws in the same order regardless of the number of threads. */
+    int status = (tasks && ws_threads) ? EXIT_SUCCESS : EXIT_FAILURE;
+    for(int i = 0; i < n_threads && status == EXIT_SUCCESS; i++) {
+        ws_threads[i] = sim_workspace_copy_for_thread(ws);
+        if(!ws_threads[i]) {
+            status = EXIT_FAILURE;
+        }
+    }
     int last = FALSE;
     jabs_message(MSG_VERBOSE, "Dual scattering simulation starts.\n\n");
     double emin = ws->emin;
 
-    while(1) {
+    while(status == EXIT_SUCCESS) {
         if(last) {
             break;
         }
@@ -739,10 +905,7 @@ int simulate_with_ds(sim_workspace *ws) {
                                         2.0, .i = d_after.i}; /* Stop step performs all calculations in a single range (the one in output!). That is why d_after.i instead of d_before.i */
         double E_back = ion1.E;
         const double E_mean = (E_front + E_back) / 2.0;
-
-        jabs_message(MSG_VERBOSE, "\rDS depth from %9.3lf to %9.3lf tfu, E from %6.1lf to %6.1lf keV.", d_before.x / C_TFU, d_after.x / C_TFU, E_front / C_KEV,
-                     E_back / C_KEV);
-        int n_running = 0; /* How many reactions are still producing data, largest number of all simulations for this depth step. */
+        int n_tasks = 0;
         for(int i_polar = 0; i_polar < ds_steps_polar; i_polar++) {
             const double ds_polar_min = 20.0 * C_DEG;
             const double ds_polar_max = 180.0 * C_DEG;
@@ -768,29 +931,32 @@ int simulate_with_ds(sim_workspace *ws) {
                 double fluence_tot = cs_sum * thick_step * ion1.inverse_cosine_theta * (2.0 * C_PI) * ds_polar_step; /* TODO: check calculation after moving from p_sr to fluence!*/
                 double fluence_azi = fluence_tot / (1.0 * (ds_steps_azi));
                 for(int i_azi = 0; i_azi < ds_steps_azi; i_azi++) {
-                    ion2 = ion1;
+                    ion ion2 = ion1;
                     double K = jibal_kin_rbs(incident->mass, target->mass, ds_polar, '+');
                     ion2.E *= K;
                     ion2.S *= pow2(K);
                     double ds_azi = C_2PI * (1.0 * i_azi) / (ds_steps_azi * 1.0);
                     ion_rotate(&ion2, ds_polar, ds_azi); /* Dual scattering: first scattering to some angle (scattering angle: ds_polar). Note that this does not follow SimNRA conventions. */
-                    ws->fluence = fluence_azi * fluence;
                     double scatangle = scattering_angle(&ion2, ws->sim->sample_theta, ws->sim->sample_phi, ws->det);
                     if(d_before.x == 0.0) {
                         DEBUGMSG("DS polar %.3lf, azi %.3lf, scatter %.3lf", ds_polar/C_DEG, ds_azi/C_DEG, scatangle/C_DEG);
                     }
                     if(scatangle > 19.99999 * C_DEG) {
-                        int n_ok = simulate(&ion2, d_halfdepth, ws, ws->sample);
-                        if(n_ok < 0) {
-                            return EXIT_FAILURE;
-                        }
-                        if(n_ok > n_running) {
-                            n_running = n_ok;
-                        }
+                        tasks[n_tasks].ion = ion2;
+                        tasks[n_tasks].fluence = fluence_azi * fluence;
+                        n_tasks++;
                     }
                 }
             }
         }
+        char progress[128];
+        snprintf(progress, sizeof(progress), "DS depth from %9.3lf to %9.3lf tfu, E from %6.1lf to %6.1lf keV.", d_before.x / C_TFU, d_after.x / C_TFU, E_front / C_KEV, E_back / C_KEV);
+        jabs_message(MSG_VERBOSE, "\r%s", progress);
+        int n_running = simulate_ds_tasks(ws, ws_threads, n_threads, tasks, n_tasks, d_halfdepth, progress); /* How many reactions are still producing data, largest number of all simulations for this depth step. */
+        if(n_running < 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
         if(ws->sample->ranges[ws->sample->n_ranges - 1].x - d_after.x < 0.01 * C_TFU)
             break;
         d_before = d_after;
@@ -799,6 +965,14 @@ int simulate_with_ds(sim_workspace *ws) {
             break;
         }
     }
+    for(int i = 0; ws_threads && i < n_threads; i++) {
+        sim_workspace_free_thread_copy(ws_threads[i]);
+    }
+    free(ws_threads);
+    free(tasks);
+    if(status != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
     jabs_message(MSG_VERBOSE, "\nDual scattering simulation complete.\n");
     sim_workspace_calculate_sum_spectra(ws);
     return EXIT_SUCCESS;
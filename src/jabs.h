@@ -35,6 +35,7 @@ int assign_stopping(jibal_gsto *gsto, const simulation *sim);
 int assign_stopping_Z2(jibal_gsto *gsto, const simulation *sim, int Z2); /* Assigns stopping and straggling (GSTO) for given Z2. Goes through all possible Z1s (beam and reaction products). */
 int assign_stopping_Z1_Z2(jibal_gsto *gsto, int Z1, int Z2);
 int simulate_with_ds(sim_workspace *ws);
+int simulate_detectors(size_t n_det, int parallel, int (*simulate_det)(size_t i_det, void *data), void *data); /* Calls simulate_det() for every detector, concurrently (OpenMP) if parallel is TRUE. Detectors are simulated with their own workspaces, results should be gathered by simulate_det() into per detector storage. Returns EXIT_FAILURE if any call failed. */
 double cross_section_concentration_product(const sim_workspace *ws, const sample *sample, const sim_reaction *sim_r, double E_front, double E_back, const depth *d_before, const depth *d_after, double S_front, double S_back);
 double cross_section_concentration_product_adaptive(const sim_workspace *ws, const sample *sample, const sim_reaction *sim_r, double E_front, double E_back, const depth *d_before, const depth *d_after, double S_front, double S_back);
 double cross_section_straggling(const sim_reaction *sim_r, gsl_integration_workspace *w, double accuracy, const prob_dist *pd, double E, double S);
@@ -86,6 +86,9 @@ int main(int argc, char * const *argv) {
     cmdline_options *cmd_opt = cmdline_options_init();
     read_options(cmd_opt, &argc, &argv);
     jabs_message_verbosity = cmd_opt->verbose;
+    if(cmd_opt->screening_store) {
+        session->screening_store = strdup(cmd_opt->screening_store);
+    }
     DEBUGMSG("Verbosity %i", jabs_message_verbosity);
     if(argc == 0) {
         cmd_opt->interactive = TRUE;
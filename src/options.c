@@ -56,6 +56,7 @@ void read_options(cmdline_options *cmd_opt, int *argc, char *const **argv) {
             {"version",     no_argument,       NULL, 'V'},
             {"interactive", no_argument,       NULL, 'i'},
             {"verbose",     optional_argument, NULL, 'v'},
+            {"screening-store", required_argument, NULL, 's'},
             {NULL, 0,                          NULL, 0}
     };
     static const char *help_texts[] = {
@@ -63,11 +64,12 @@ void read_options(cmdline_options *cmd_opt, int *argc, char *const **argv) {
             "Print version number (-V).",
             "Interactive mode (-i). If script file(s) are given, they will be run first.",
             "Increase verbosity (no argument) or set it (-v).",
+            "Load screening tables from given file and save them there when finished (-s). Same as \"set screening_store\".",
             NULL
     }; /* It is important to have the elements of this array correspond to the elements of the long_options[] array to avoid confusion. */
     while (1) {
         int option_index = 0;
-        int c = getopt_long(*argc, *argv, "ihvV", long_options, &option_index);
+        int c = getopt_long(*argc, *argv, "ihvVs:", long_options, &option_index);
         if (c == -1)
             break;
         switch (c) {
@@ -106,6 +108,10 @@ void read_options(cmdline_options *cmd_opt, int *argc, char *const **argv) {
             case 'i':
                 cmd_opt->interactive = TRUE;
                 break;
+            case 's':
+                free(cmd_opt->screening_store);
+                cmd_opt->screening_store = strdup(optarg);
+                break;
             default:
                 usage();
                 exit(EXIT_FAILURE);
@@ -123,5 +129,8 @@ cmdline_options *cmdline_options_init(void) {
 }
 
 void cmdline_options_free(cmdline_options *cmd_opt) {
+    if(!cmd_opt)
+        return;
+    free(cmd_opt->screening_store);
     free(cmd_opt);
 }
@@ -21,6 +21,7 @@ extern "C" {
 typedef struct {
     int verbose;
     int interactive;
+    char *screening_store; /* NULL if not given */
 } cmdline_options;
 
 
@@ -12,6 +12,7 @@
 
  */
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <string.h>
 #include "jabs_debug.h"
@@ -184,17 +185,21 @@ void sample_renormalize(sample *sample) {
         return;
     }
     for(size_t i = 0; i < sample->n_ranges; i++) {
-        double sum = 0.0;
-        for(size_t i_isotope = 0; i_isotope < sample->n_isotopes; i_isotope++) {
-            if(*(sample_conc_bin(sample, i, i_isotope)) < 0.0)
-                *(sample_conc_bin(sample, i, i_isotope)) = 0.0;
-            sum += *(sample_conc_bin(sample, i, i_isotope));
-        }
-        if(sum == 0.0)
-            continue;
-        for(size_t i_isotope = 0; i_isotope < sample->n_isotopes; i_isotope++) {
-            *(sample_conc_bin(sample, i, i_isotope)) /= sum;
-        }
+        sample_renormalize_range(sample, i);
+    }
+}
+
+void sample_renormalize_range(sample *sample, size_t i) {
+    double sum = 0.0;
+    for(size_t i_isotope = 0; i_isotope < sample->n_isotopes; i_isotope++) {
+        if(*(sample_conc_bin(sample, i, i_isotope)) < 0.0)
+            *(sample_conc_bin(sample, i, i_isotope)) = 0.0;
+        sum += *(sample_conc_bin(sample, i, i_isotope));
+    }
+    if(sum == 0.0)
+        return;
+    for(size_t i_isotope = 0; i_isotope < sample->n_isotopes; i_isotope++) {
+        *(sample_conc_bin(sample, i, i_isotope)) /= sum;
     }
 }
 
@@ -378,6 +383,191 @@ sample *sample_from_sample_model(const sample_model *sm) { /* TODO: renormalize
     return s;
 }
 
+sample_model_map *sample_model_map_new(const sample_model *sm, const sample *s) {
+    sample_model_map *map = malloc(sizeof(sample_model_map));
+    if(!map) {
+        return NULL;
+    }
+    map->type = sm->type;
+    map->n_ranges = sm->n_ranges;
+    map->n_materials = sm->n_materials;
+    map->n_isotopes = s->n_isotopes;
+    map->materials = malloc(sm->n_materials * sizeof(jibal_material *));
+    map->weights = calloc(s->n_isotopes * sm->n_materials, sizeof(double));
+    if(!map->materials || !map->weights) {
+        sample_model_map_free(map);
+        return NULL;
+    }
+    for(size_t i_mat = 0; i_mat < sm->n_materials; i_mat++) {
+        const jibal_material *mat = sm->materials[i_mat];
+        map->materials[i_mat] = mat;
+        for(size_t i_elem = 0; i_elem < mat->n_elements; i_elem++) {
+            for(size_t i_isotope = 0; i_isotope < mat->elements[i_elem].n_isotopes; i_isotope++) {
+                for(size_t i = 0; i < s->n_isotopes; i++) {
+                    if(s->isotopes[i] == mat->elements[i_elem].isotopes[i_isotope]) {
+                        map->weights[i * sm->n_materials + i_mat] += mat->elements[i_elem].concs[i_isotope] * mat->concs[i_elem];
+                    }
+                }
+            }
+        }
+    }
+    return map;
+}
+
+void sample_model_map_free(sample_model_map *map) {
+    if(!map) {
+        return;
+    }
+    free(map->materials);
+    free(map->weights);
+    free(map);
+}
+
+static size_t sample_model_map_n_ranges(const sample_model_map *map) { /* Number of ranges in sample */
+    return map->type == SAMPLE_MODEL_LAYERED ? 2 * map->n_ranges : map->n_ranges;
+}
+
+int sample_model_map_valid(const sample_model_map *map, const sample_model *sm, const sample *s) {
+    if(!map || !sm || !s) {
+        return FALSE;
+    }
+    if(map->type != sm->type || map->n_ranges != sm->n_ranges || map->n_materials != sm->n_materials) {
+        return FALSE;
+    }
+    if(map->n_isotopes != s->n_isotopes || sample_model_map_n_ranges(map) != s->n_ranges) {
+        return FALSE;
+    }
+    for(size_t i_mat = 0; i_mat < sm->n_materials; i_mat++) {
+        if(map->materials[i_mat] != sm->materials[i_mat]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+size_t sample_model_range_of_value(const sample_model *sm, const double *value) {
+    for(size_t i = 0; i < sm->n_ranges; i++) {
+        const sample_range *r = &sm->ranges[i];
+        if(value == &r->x || value == &r->rough.x || value == &r->yield || value == &r->yield_slope || value == &r->bragg || value == &r->stragg || value == &r->density) {
+            return i;
+        }
+        for(size_t i_mat = 0; i_mat < sm->n_materials; i_mat++) {
+            if(value == sample_model_conc_bin(sm, i, i_mat)) {
+                return i;
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+static void sample_range_update(sample_range *dst, const sample_range *src, int smooth) { /* Copies range corrections and roughness of src, except depth and roughness file. If smooth is TRUE, roughness is not copied (first point of a layer). */
+    dst->yield = src->yield;
+    dst->yield_slope = src->yield_slope;
+    dst->bragg = src->bragg;
+    dst->stragg = src->stragg;
+    dst->density = src->density;
+    if(smooth || src->rough.model == ROUGHNESS_FILE) {
+        return;
+    }
+    dst->rough.model = src->rough.model;
+    dst->rough.x = src->rough.x;
+    dst->rough.n = src->rough.n;
+    if(dst->rough.model == ROUGHNESS_GAMMA && dst->rough.n == 0) { /* Same as in sample_from_sample_model() */
+        dst->rough.n = GAMMA_ROUGHNESS_STEPS;
+    }
+    roughness_reset_if_below_tolerance(&dst->rough);
+}
+
+void sample_update_range(sample *s, const sample_model *sm, const sample_model_map *map, size_t i_range) {
+    size_t i_start = i_range, i_stop = i_range;
+    if(map->type == SAMPLE_MODEL_LAYERED) { /* Two points per layer */
+        i_start = 2 * i_range;
+        i_stop = 2 * i_range + 1;
+    }
+    for(size_t i = i_start; i <= i_stop; i++) {
+        sample_range_update(&s->ranges[i], &sm->ranges[i_range], map->type == SAMPLE_MODEL_LAYERED && i == i_start);
+        for(size_t i_isotope = 0; i_isotope < s->n_isotopes; i_isotope++) {
+            const double *w = map->weights + i_isotope * map->n_materials;
+            double c = 0.0;
+            for(size_t i_mat = 0; i_mat < map->n_materials; i_mat++) {
+                c += *(sample_model_conc_bin(sm, i_range, i_mat)) * w[i_mat];
+            }
+            *(sample_conc_bin(s, i, i_isotope)) = c;
+        }
+        sample_renormalize_range(s, i);
+    }
+}
+
+void sample_update_depths(sample *s, const sample_model *sm, const sample_model_map *map, size_t i_range) {
+    for(size_t i = i_range; i < sm->n_ranges; i++) {
+        switch(map->type) {
+            case SAMPLE_MODEL_LAYERED:
+                s->ranges[2 * i].x = i ? s->ranges[2 * i - 1].x : 0.0;
+                s->ranges[2 * i + 1].x = s->ranges[2 * i].x + sm->ranges[i].x;
+                break;
+            case SAMPLE_MODEL_POINT_BY_POINT_CUMULATIVE:
+                s->ranges[i].x = i ? s->ranges[i - 1].x + sm->ranges[i].x : 0.0;
+                break;
+            default:
+                s->ranges[i].x = sm->ranges[i].x;
+                break;
+        }
+    }
+    sample_thickness_recalculate(s);
+}
+
+double sample_model_range_depth_start(const sample *s, const sample_model_map *map, size_t i_range) {
+    size_t i = (map->type == SAMPLE_MODEL_LAYERED) ? 2 * i_range : i_range; /* First range of s made from range i_range, see sample_update_range() */
+    if(i == 0 || i > s->n_ranges) {
+        return 0.0;
+    }
+    return s->ranges[i - 1].x; /* Concentrations are interpolated from the previous point */
+}
+
+int sample_update_from_sample_model(sample *s, const sample_model *sm, const sample_model_map *map) {
+    if(sample_model_sanity_check(sm)) {
+        return EXIT_FAILURE;
+    }
+    assert(sample_model_map_valid(map, sm, s));
+    for(size_t i = 0; i < sm->n_ranges; i++) {
+        sample_update_range(s, sm, map, i);
+    }
+    sample_update_depths(s, sm, map, 0);
+    return EXIT_SUCCESS;
+}
+
+void sample_copy_values(sample *dst, const sample *src) {
+    assert(dst->n_ranges == src->n_ranges && dst->n_isotopes == src->n_isotopes);
+    for(size_t i = 0; i < src->n_ranges; i++) {
+        sample_range *r = &dst->ranges[i];
+        roughness_file *file = r->rough.file; /* Keep our own (deep) copy */
+        *r = src->ranges[i];
+        r->rough.file = file;
+    }
+    memcpy(dst->cbins, src->cbins, sizeof(double) * src->n_isotopes * src->n_ranges);
+    dst->thickness = src->thickness;
+}
+
+int sample_values_equal(const sample *a, const sample *b) {
+    if(a == b) {
+        return TRUE;
+    }
+    if(!a || !b || a->n_ranges != b->n_ranges || a->n_isotopes != b->n_isotopes || a->no_conc_gradients != b->no_conc_gradients || a->thickness != b->thickness) {
+        return FALSE;
+    }
+    if(memcmp(a->isotopes, b->isotopes, a->n_isotopes * sizeof(jibal_isotope *)) != 0) {
+        return FALSE;
+    }
+    for(size_t i = 0; i < a->n_ranges; i++) {
+        const sample_range *ra = &a->ranges[i];
+        const sample_range *rb = &b->ranges[i];
+        if(ra->x != rb->x || ra->bragg != rb->bragg || ra->stragg != rb->stragg || ra->yield != rb->yield || ra->yield_slope != rb->yield_slope || ra->density != rb->density) {
+            return FALSE;
+        }
+    }
+    return memcmp(a->cbins, b->cbins, sizeof(double) * a->n_isotopes * a->n_ranges) == 0;
+}
+
 int sample_model_print(const char *filename, const sample_model *sm, jabs_msg_level msg_level) {
     if(!sm) {
         return EXIT_FAILURE;
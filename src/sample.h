@@ -68,6 +68,15 @@ typedef struct sample_model {
     double *cbins; /* 2D-table: size is n_materials * n_ranges  */
 } sample_model;
 
+typedef struct sample_model_map { /* Describes how a sample was made from a sample model by sample_from_sample_model(), so that values can be updated in place */
+    sample_model_type type;
+    size_t n_ranges; /* In sample model */
+    size_t n_materials;
+    const jibal_material **materials; /* Array, n_materials elements. Pointers are only compared. */
+    size_t n_isotopes; /* In sample */
+    double *weights; /* 2D-table: size is n_isotopes * n_materials. Concentration of (sample) isotope in material. */
+} sample_model_map;
+
 inline double *sample_model_conc_bin(const sample_model *sm, size_t i_range, size_t i_material) {
     return sm->cbins + i_range * sm->n_materials + i_material;
 }
@@ -78,6 +87,7 @@ sample_model *sample_model_alloc(size_t n_materials, size_t n_ranges);
 int sample_model_sanity_check(const sample_model *sm);
 int sample_model_renormalize(sample_model *sm);
 void sample_renormalize(sample *sample);
+void sample_renormalize_range(sample *sample, size_t i_range);
 sample_model *sample_model_split_elements(const struct sample_model *sm);
 sample_model *sample_model_from_file(const jibal *jibal, const char *filename);
 sample_model *sample_model_from_argv(const jibal *jibal, int *argc, char * const **argv);
@@ -88,6 +98,16 @@ size_t sample_model_element_count(const sample_model *sm);
 void sample_model_free(sample_model *sm);
 sample_model *sample_model_clone(const sample_model *sm_orig);
 sample *sample_from_sample_model(const sample_model *sm);
+sample_model_map *sample_model_map_new(const sample_model *sm, const sample *s); /* s must be from sample_from_sample_model(sm) */
+void sample_model_map_free(sample_model_map *map);
+int sample_model_map_valid(const sample_model_map *map, const sample_model *sm, const sample *s); /* TRUE if structure of sm and s (number of ranges, materials, isotopes) is still the same as when map was made */
+size_t sample_model_range_of_value(const sample_model *sm, const double *value); /* Index of range value (e.g. pointer to thickness or concentration) belongs to, SIZE_MAX if none */
+void sample_update_range(sample *s, const sample_model *sm, const sample_model_map *map, size_t i_range); /* Updates concentrations and range corrections of ranges of s made from range i_range of sm. Depths are not updated. */
+void sample_update_depths(sample *s, const sample_model *sm, const sample_model_map *map, size_t i_range); /* Updates depths of ranges of s made from ranges i_range, i_range + 1, ... of sm */
+double sample_model_range_depth_start(const sample *s, const sample_model_map *map, size_t i_range); /* Depth of s where changes to range i_range of sample model begin to have an effect, s is not affected shallower than this */
+int sample_update_from_sample_model(sample *s, const sample_model *sm, const sample_model_map *map); /* Same result as sample_from_sample_model(), but s is updated in place. Map must be valid. */
+void sample_copy_values(sample *dst, const sample *src); /* Copies depths, concentrations and range corrections. Samples must have the same structure. */
+int sample_values_equal(const sample *a, const sample *b); /* TRUE if samples have the same isotopes, depths, concentrations and range corrections. Roughness is not compared. */
 int sample_model_print(const char *filename, const sample_model *sm, jabs_msg_level msg_level);
 size_t sample_model_number_of_rough_ranges(const sample_model *sm); /* May change to real sample, since minor roughness can be neglected. */
 size_t sample_model_number_of_ranges_with_bragg_or_stragg_corrections(const sample_model *sm);
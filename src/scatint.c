@@ -163,73 +163,92 @@ double apsis_f (double x, void *p) {
 
 int apsis(scatint_params *params) {
     int status;
-    int iter = 0, max_iter = 100;
+    int iter = 0;
     gsl_function F;
     F.function = &apsis_f;
     F.params = params;
-    double x_lo = IMPACT_MIN, x_hi = IMPACT_MAX;
-    const gsl_root_fsolver_type *T;
-    gsl_root_fsolver *solver;
-    T = gsl_root_fsolver_brent;
-    solver = gsl_root_fsolver_alloc (T);
-    double r;
-    gsl_root_fsolver_set (solver, &F, x_lo, x_hi);
-    double accuracy = 1e-9;
-    do
-    {
-      iter++;
-      status = gsl_root_fsolver_iterate(solver);
-      r = gsl_root_fsolver_root(solver);
-      x_lo = gsl_root_fsolver_x_lower(solver);
-      x_hi = gsl_root_fsolver_x_upper(solver);
-      status = gsl_root_test_interval (x_lo, x_hi, 0, accuracy);
-#if 0
-      if (status == GSL_SUCCESS)
-        printf ("Converged:\n");
-      printf ("%5d [%.7f, %.7f] %.7f %.7f\n",
-              iter, x_lo, x_hi,
-              r, x_hi - x_lo);
-#endif
+    /* Screening functions are at most one, so apsis is between s and the apsis of unscreened Coulomb potential. Upper limit has some margin to bracket the root also with pure Coulomb. */
+    double x_lo = GSL_MAX_DBL(params->s, IMPACT_MIN);
+    double x_hi = 1.001 * (1.0 / params->E_rel + sqrt(1.0 / pow2(params->E_rel) + 4.0 * pow2(params->s))) / 2.0;
+    if(!(x_hi < IMPACT_MAX) || apsis_f(x_hi, params) < 0.0) {
+        x_hi = IMPACT_MAX;
+    }
+    params->R = -1.0;
+    gsl_set_error_handler_off();
+    if(x_lo >= x_hi || gsl_root_fsolver_set(params->solver, &F, x_lo, x_hi)) {
+        DEBUGMSG("Apsis is not in range [%g, %g].", x_lo, x_hi);
+        return EXIT_FAILURE;
     }
-    while (status == GSL_CONTINUE && iter < max_iter);
-    if(iter == max_iter - 1) {
-        fprintf(stderr, "Max iters reached!\n");
-        params->R = -1.0;
+    double r;
+    do {
+        iter++;
+        status = gsl_root_fsolver_iterate(params->solver);
+        if(status) {
+            return EXIT_FAILURE;
+        }
+        r = gsl_root_fsolver_root(params->solver);
+        x_lo = gsl_root_fsolver_x_lower(params->solver);
+        x_hi = gsl_root_fsolver_x_upper(params->solver);
+        status = gsl_root_test_interval(x_lo, x_hi, 0, SCATINT_APSIS_ACCURACY);
+    } while(status == GSL_CONTINUE && iter < SCATINT_ITER_MAX);
+    if(status != GSL_SUCCESS) {
+        DEBUGSTR("Max iters reached!");
         return EXIT_FAILURE;
     }
-    gsl_root_fsolver_free(solver);
     params->R = r;
     return EXIT_SUCCESS;
 }
 
-double scat_theta_f(double x, void *params) {
-    struct scatint_params *p = (struct scatint_params *) params;
-    double f = sqrt(apsis_f(x, p));
-    double out = 1.0/(x*x*f);
-    return out;
+static int scatint_quadrature_init(scatint_params *p, size_t n) {
+    /* Scattering integral is transformed with r = R/u and u = cos(beta) (Gauss-Mehler), which removes the singularity at apsis. The remaining integrand is smooth in beta and is integrated with Gauss-Legendre quadrature on [0, pi/2]. */
+    gsl_integration_glfixed_table *t = gsl_integration_glfixed_table_alloc(n);
+    if(!t) {
+        return EXIT_FAILURE;
+    }
+    p->n_quad = n;
+    p->quad_u = malloc(n * sizeof(double));
+    p->quad_sin2 = malloc(n * sizeof(double));
+    p->quad_w = malloc(n * sizeof(double));
+    if(!p->quad_u || !p->quad_sin2 || !p->quad_w) {
+        gsl_integration_glfixed_table_free(t);
+        return EXIT_FAILURE;
+    }
+    for(size_t i = 0; i < n; i++) {
+        double beta, w;
+        gsl_integration_glfixed_point(0.0, C_PI / 2.0, i, &beta, &w, t);
+        p->quad_u[i] = cos(beta);
+        p->quad_sin2[i] = pow2(sin(beta)); /* More accurate than 1 - u^2 near apsis */
+        p->quad_w[i] = w;
+    }
+    gsl_integration_glfixed_table_free(t);
+    return EXIT_SUCCESS;
 }
 
 int calc_scattering_angle(struct scatint_params *params) {
-    double result, error;
-    gsl_function F;
-    F.function = &scat_theta_f;
-    F.params = params;
     if(apsis(params)) {
         DEBUGSTR("Could not calculate apsis.");
         return EXIT_FAILURE;
     }
-    DEBUGVERBOSEMSG("Integration from %g to infinity, accuracy %g.", params->R, params->accuracy);
-    gsl_set_error_handler_off();
-    int status = gsl_integration_qagiu(&F, params->R, 0, params->accuracy, params->w->limit, params->w, &result, &error);
-    if(status == GSL_ESING) { /* TODO: GSL probably reports an error for a reason. We choose to ignore it here.  */
-        DEBUGSTR("GSL reports a non-integrable singularity or other bad integrand behavior was found in the integration interval.")
-        status = 0;
+    /* Using F(R) = 0, the radial function F(R/u) = 1 - s^2 u^2 / R^2 - u * V(R/u) / (R * E_rel) can be written without cancellation of large terms:
+     * F(R/u) / (1 - u^2) = s^2 / R^2 + (V(R) - u V(R/u)) / (R * E_rel * (1 - u^2)) */
+    const double R = params->R;
+    const double s2 = pow2(params->s / R);
+    const double V_R = params->potential(R);
+    const double k = 1.0 / (R * params->E_rel);
+    double result = 0.0;
+    for(size_t i = 0; i < params->n_quad; i++) {
+        const double u = params->quad_u[i];
+        const double f = s2 + k * (V_R - u * params->potential(R / u)) / params->quad_sin2[i];
+        if(!(f > 0.0)) {
+            DEBUGMSG("Scattering integral failed at u = %g, s = %g, R = %g.", u, params->s, R);
+            return EXIT_FAILURE;
+        }
+        result += params->quad_w[i] / sqrt(f);
     }
+    result /= R;
     DEBUGVERBOSEMSG("result          = % .18f", result);
-    DEBUGVERBOSEMSG("estimated error = %.18f", error);
-    DEBUGVERBOSEMSG("intervals       = %zu", params->w->size);
     params->theta_cm = C_PI - 2.0 * params->s * result;
-    return status;
+    return EXIT_SUCCESS;
 }
 
 int cs(scatint_params *p) {
@@ -242,14 +261,15 @@ int cs(scatint_params *p) {
         DEBUGSTR("Failed to calculate angle.");
         return EXIT_FAILURE;
     }
-    scatint_params p2 = *p;
-    p2.s = p->s * 1.00001 + 1e-9;
-    if(calc_scattering_angle(&p2)) {
+    scatint_params p_lo = *p, p_hi = *p; /* Central difference. Angle is a smooth function of s, since quadrature has a fixed order. */
+    p_lo.s = p->s * (1.0 - SCATINT_DIFF_STEP);
+    p_hi.s = p->s * (1.0 + SCATINT_DIFF_STEP);
+    if(calc_scattering_angle(&p_lo) || calc_scattering_angle(&p_hi)) {
         DEBUGSTR("Failed to calculate angle (with difference).");
         return EXIT_FAILURE;
     }
-    double cos_theta_cm_delta = cos(p2.theta_cm) - cos(p->theta_cm);
-    double sigma_cm = 2.0 * C_PI * (pow2(p2.s)-pow2(p->s))/cos_theta_cm_delta; /* TODO: this is positive diff */
+    double cos_theta_cm_delta = cos(p_hi.theta_cm) - cos(p_lo.theta_cm);
+    double sigma_cm = 2.0 * C_PI * (pow2(p_hi.s)-pow2(p_lo.s))/cos_theta_cm_delta; /* TODO: this is positive diff */
     sigma_cm *= p->a * p->a / (4.0 * C_PI);
     double theta_lab = atan2(sin(p->theta_cm), (cos(p->theta_cm) + p->m12));
     DEBUGVERBOSEMSG("Sigma conversion from C.M to lab is %g", p->sigma_lab_to_cm_ratio);
@@ -335,8 +355,11 @@ scatint_params *scatint_init(reaction_type rt, potential_type pt, const jibal_is
     p->theta_max = asin(target->mass/incident->mass); /* only valid when incident->mass >= target->mass */
     p->ik_scaling = 1.0; /* Will be changed for ERD when theta is changed */
     p->E_ik_ratio = target->mass / incident->mass; /* Remember, target and incident are already inverted */
-    p->w = gsl_integration_workspace_alloc(INTEGRATION_WORKSPACE_N);
-    p->accuracy = INTEGRATION_ACCURACY;
+    p->solver = gsl_root_fsolver_alloc(gsl_root_fsolver_brent);
+    if(!p->solver || scatint_quadrature_init(p, SCATINT_QUADRATURE_N)) {
+        scatint_params_free(p);
+        return NULL;
+    }
     return p;
 }
 
@@ -344,7 +367,12 @@ void scatint_params_free(scatint_params *p) {
     if(!p) {
         return;
     }
-    gsl_integration_workspace_free(p->w);
+    if(p->solver) {
+        gsl_root_fsolver_free(p->solver);
+    }
+    free(p->quad_u);
+    free(p->quad_sin2);
+    free(p->quad_w);
     free(p);
 }
 
@@ -402,33 +430,79 @@ int scatint_set_theta(scatint_params *p, double theta_lab) {
     return EXIT_SUCCESS;
 }
 
+static int s_seek_eval(scatint_params *p, double s, double g_target, double *g) {
+    p->s = s;
+    if(calc_scattering_angle(p)) {
+        DEBUGMSG("Could not calculate scattering angle with s = %g (%g m).\n", p->s, scatint_get_impact_parameter(p));
+        return EXIT_FAILURE;
+    }
+    *g = 1.0 / tan(p->theta_cm / 2.0) - g_target;
+    return EXIT_SUCCESS;
+}
+
 int s_seek(scatint_params *p, double theta_cm) {
-    double s_low = 0.0;
-    double s_high = IMPACT_MAX;
-    const size_t n_iter_max = 100;
-    double s = sqrt(IMPACT_MIN*IMPACT_MAX);
-    double accuracy = IMPACT_FACTOR_ACCURACY; /* of theta_cm */
+    /* Find s for a given theta_cm. Small s => large theta_cm. Solves g(s) = cot(theta(s)/2) - cot(theta_cm/2) = 0, which is linear in s for unscreened Coulomb potential, using regula falsi (Illinois variant). */
+    const double accuracy = IMPACT_FACTOR_ACCURACY; /* of theta_cm */
     if(!p->potential) {
         fprintf(stderr, "No potential has been set.\n");
         return EXIT_FAILURE;
     }
-    for(size_t i = 0; i < n_iter_max; i++) { /* Find s for a given theta_cm. Small s => large theta_cm */
-        p->s = s;
-        if(calc_scattering_angle(p)) {
-            DEBUGMSG("Fail on iter %zu. Could not calculate scattering angle with s = %g (%g m).\n", i+1, p->s, scatint_get_impact_parameter(p));
+    if(!(theta_cm > 0.0 && theta_cm < C_PI)) {
+        return EXIT_FAILURE;
+    }
+    const double g_target = 1.0 / tan(theta_cm / 2.0);
+    double s_low = 0.0; /* Head-on collision, theta = pi */
+    double g_low = -g_target;
+    double s_high = g_target / (2.0 * p->E_rel); /* Coulomb scattering, screening can only decrease the angle */
+    double g_high;
+    while(1) {
+        if(s_seek_eval(p, s_high, g_target, &g_high)) {
+            p->s = -1.0;
             return EXIT_FAILURE;
         }
-        double result = p->theta_cm;
-        DEBUGVERBOSEMSG("Iter %zu [%g, %g], tried %g got %g, diff %g", i+1, s_low, s_high, s, result, result - theta_cm);
-        if(fabs(theta_cm - result) / theta_cm < accuracy) {
+        if(fabs(theta_cm - p->theta_cm) / theta_cm < accuracy) {
             return EXIT_SUCCESS;
         }
-        if(result < theta_cm) {
-            s_high = s;
-        } else {
+        if(g_high > 0.0) {
+            break;
+        }
+        s_low = s_high; /* Not bracketed, should not happen with ordinary screening functions */
+        g_low = g_high;
+        s_high *= 2.0;
+        if(s_high > IMPACT_MAX) {
+            p->s = -1.0;
+            return EXIT_FAILURE;
+        }
+    }
+    int side = 0;
+    for(size_t i = 0; i < SCATINT_ITER_MAX; i++) {
+        double s = (s_low * g_high - s_high * g_low) / (g_high - g_low);
+        if(!(s > s_low && s < s_high)) {
+            s = (s_low + s_high) / 2.0;
+        }
+        double g;
+        if(s_seek_eval(p, s, g_target, &g)) {
+            break;
+        }
+        DEBUGVERBOSEMSG("Iter %zu [%g, %g], tried %g got %g, diff %g", i+1, s_low, s_high, s, p->theta_cm, p->theta_cm - theta_cm);
+        if(fabs(theta_cm - p->theta_cm) / theta_cm < accuracy) {
+            return EXIT_SUCCESS;
+        }
+        if(g < 0.0) {
             s_low = s;
+            g_low = g;
+            if(side == -1) { /* Same side twice, Illinois modification */
+                g_high /= 2.0;
+            }
+            side = -1;
+        } else {
+            s_high = s;
+            g_high = g;
+            if(side == 1) {
+                g_low /= 2.0;
+            }
+            side = 1;
         }
-        s = (s_low + s_high)/2.0;
     }
     p->s = -1.0; /* Invalidate */
     return EXIT_FAILURE;
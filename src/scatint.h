@@ -14,7 +14,7 @@
 #ifndef JABS_SCATINT_H
 #define JABS_SCATINT_H
 
-#include <gsl/gsl_integration.h>
+#include <gsl/gsl_roots.h>
 #include "reaction.h"
 #ifdef __cplusplus
 extern "C" {
@@ -22,9 +22,11 @@ extern "C" {
 
 #define IMPACT_MIN (1e-9) /* In units of screening length. Apsis can not be below this! */
 #define IMPACT_MAX (100.0)
-#define INTEGRATION_WORKSPACE_N (20000)
-#define INTEGRATION_ACCURACY (1e-7)
 #define IMPACT_FACTOR_ACCURACY (1e-9)
+#define SCATINT_QUADRATURE_N (64) /* Order of Gauss-Mehler quadrature used for scattering integral */
+#define SCATINT_APSIS_ACCURACY (1e-13)
+#define SCATINT_ITER_MAX (100)
+#define SCATINT_DIFF_STEP (1e-5) /* Relative step of impact parameter in numerical derivative of scattering angle */
 
 
 typedef enum potential_type {
@@ -64,8 +66,11 @@ typedef struct scatint_params {
     double E_ik_ratio;
     double sigma_lab_to_cm_ratio;
     double (*potential)(double);
-    gsl_integration_workspace *w;
-    double accuracy;
+    size_t n_quad; /* Quadrature nodes, see scatint_quadrature_init() */
+    double *quad_u; /* Inverse of distance from the apsis, u = R/r */
+    double *quad_sin2; /* 1 - u^2 */
+    double *quad_w; /* Weights */
+    gsl_root_fsolver *solver; /* Used by apsis() */
 } scatint_params;
 
 double scatint_sigma_lab(scatint_params *p, double E_lab, double theta_lab); /* This is the easiest one to use */
@@ -81,7 +86,6 @@ double screening_length_thomas_fermi(int Z2);
 double potential_bohr(double x);
 double apsis_f (double x, void *p);
 int apsis(scatint_params *params);
-double scat_theta_f(double x, void *params);
 int calc_scattering_angle(struct scatint_params *params);
 int cs(scatint_params *p);
 scatint_params *scatint_init(reaction_type rt, potential_type pt, const jibal_isotope *incident, const jibal_isotope *target);
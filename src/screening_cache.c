@@ -0,0 +1,418 @@
+/*
+
+    Jaakko's Backscattering Simulator (JaBS)
+    Copyright (C) 2021 - 2024 Jaakko Julin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    See LICENSE.txt for the full license.
+
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef WIN32
+#include <process.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "jabs_debug.h"
+#include "defaults.h"
+#include "screening_cache.h"
+
+#define SCREENING_STORE_MAGIC "JABSSCR"
+#define SCREENING_STORE_POINTS_MAX (1000000)
+
+typedef struct screening_store_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; /* Written as 0x01020304, files from machines with different byte order are ignored */
+    uint64_t n_tables;
+} screening_store_header;
+
+typedef struct screening_store_record { /* Followed by n points (struct reaction_point) */
+    int32_t type;
+    int32_t cs;
+    int32_t Z1;
+    int32_t Z2;
+    double m1;
+    double m2;
+    double theta;
+    double emin;
+    double emax;
+    uint64_t n;
+    uint64_t checksum; /* FNV-1a of the fields above and the points */
+} screening_store_record;
+
+static int screening_table_key_equal(const screening_table_key *a, const screening_table_key *b) {
+    return a->type == b->type && a->cs == b->cs && a->Z1 == b->Z1 && a->Z2 == b->Z2 && a->m1 == b->m1 && a->m2 == b->m2 &&
+           a->theta == b->theta && a->emin == b->emin && a->emax == b->emax && a->n == b->n;
+}
+
+static size_t screening_cache_table_size(const screening_table_key *key) {
+    return sizeof(screening_cache_entry) + key->n * sizeof(struct reaction_point);
+}
+
+static screening_cache_entry *screening_cache_find(screening_cache *sc, const screening_table_key *key) {
+    for(size_t i = 0; i < sc->n; i++) {
+        if(screening_table_key_equal(&sc->entries[i].key, key)) {
+            return &sc->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void screening_cache_remove(screening_cache *sc, size_t i) {
+    screening_cache_entry *e = &sc->entries[i];
+    sc->size -= screening_cache_table_size(&e->key);
+    free(e->table);
+    sc->n--;
+    if(i != sc->n) {
+        *e = sc->entries[sc->n];
+    }
+}
+
+static void screening_cache_evict(screening_cache *sc) { /* Removes least recently used tables until memory use is below the limit */
+    while(sc->size > sc->size_max && sc->n) {
+        size_t i_lru = 0;
+        for(size_t i = 1; i < sc->n; i++) {
+            if(sc->entries[i].last_used < sc->entries[i_lru].last_used) {
+                i_lru = i;
+            }
+        }
+        DEBUGMSG("Screening cache evicts table %zu, cache size %zu bytes.", i_lru, sc->size);
+        screening_cache_remove(sc, i_lru);
+    }
+}
+
+screening_cache *screening_cache_new(size_t size_max) {
+    screening_cache *sc = calloc(1, sizeof(screening_cache));
+    if(!sc) {
+        return NULL;
+    }
+    sc->size_max = size_max;
+    return sc;
+}
+
+void screening_cache_free(screening_cache *sc) {
+    if(!sc) {
+        return;
+    }
+    for(size_t i = 0; i < sc->n; i++) {
+        free(sc->entries[i].table);
+    }
+    free(sc->entries);
+    free(sc->store_filename);
+    free(sc);
+}
+
+void screening_cache_reset_stats(screening_cache *sc) {
+    if(!sc) {
+        return;
+    }
+#pragma omp critical(screening_cache)
+    {
+        sc->hits = 0;
+        sc->misses = 0;
+    }
+}
+
+int screening_cache_get(screening_cache *sc, const screening_table_key *key, struct reaction_point *table) {
+    if(!sc) {
+        return EXIT_FAILURE;
+    }
+    int found = FALSE;
+#pragma omp critical(screening_cache)
+    {
+        screening_cache_entry *e = screening_cache_find(sc, key);
+        if(e) {
+            memcpy(table, e->table, key->n * sizeof(struct reaction_point));
+            e->last_used = ++sc->clock;
+            sc->hits++;
+            found = TRUE;
+        } else {
+            sc->misses++;
+        }
+    }
+    return found ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int screening_cache_insert(screening_cache *sc, const screening_table_key *key, struct reaction_point *table) { /* Cache takes ownership of table on success */
+    if(sc->n == sc->n_alloc) {
+        size_t n_alloc = sc->n_alloc ? sc->n_alloc * 2 : 8;
+        screening_cache_entry *entries = realloc(sc->entries, n_alloc * sizeof(screening_cache_entry));
+        if(!entries) {
+            return EXIT_FAILURE;
+        }
+        sc->entries = entries;
+        sc->n_alloc = n_alloc;
+    }
+    screening_cache_entry *e = &sc->entries[sc->n];
+    e->key = *key;
+    e->table = table;
+    e->last_used = ++sc->clock;
+    sc->size += screening_cache_table_size(key);
+    sc->n++;
+    return EXIT_SUCCESS;
+}
+
+void screening_cache_put(screening_cache *sc, const screening_table_key *key, const struct reaction_point *table) {
+    if(!sc) {
+        return;
+    }
+    struct reaction_point *copy = malloc(key->n * sizeof(struct reaction_point)); /* Copied outside critical section */
+    if(!copy) {
+        return;
+    }
+    memcpy(copy, table, key->n * sizeof(struct reaction_point));
+#pragma omp critical(screening_cache)
+    {
+        if(screening_cache_find(sc, key) || screening_cache_insert(sc, key, copy)) { /* Another thread computed the same table or insert failed */
+            free(copy);
+        } else {
+            sc->modified = TRUE;
+            screening_cache_evict(sc);
+        }
+    }
+}
+
+void screening_cache_print_stats(const screening_cache *sc, jabs_msg_level msg_level) {
+    if(!sc || sc->hits + sc->misses == 0) {
+        return;
+    }
+    jabs_message(msg_level, "Screening cache: %zu hits, %zu misses, %zu tables (%.1lf kB).\n", sc->hits, sc->misses, sc->n, sc->size / 1024.0);
+}
+
+static uint64_t screening_store_checksum(const screening_store_record *rec, const struct reaction_point *points) { /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *bytes = (const unsigned char *) rec;
+    for(size_t i = 0; i < offsetof(screening_store_record, checksum); i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    bytes = (const unsigned char *) points;
+    for(size_t i = 0; i < rec->n * sizeof(struct reaction_point); i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static const unsigned char *screening_store_map(const char *filename, size_t *size) { /* Returns contents of file (read-only), NULL if file can not be read */
+#ifdef WIN32
+    FILE *f = fopen(filename, "rb");
+    if(!f) {
+        return NULL;
+    }
+    unsigned char *data = NULL;
+    if(fseek(f, 0, SEEK_END) == 0) {
+        long l = ftell(f);
+        if(l > 0 && fseek(f, 0, SEEK_SET) == 0) {
+            data = malloc(l);
+            if(data && fread(data, 1, l, f) != (size_t) l) {
+                free(data);
+                data = NULL;
+            }
+            *size = l;
+        }
+    }
+    fclose(f);
+    return data;
+#else
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *data = NULL;
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED) {
+            data = NULL;
+        }
+        *size = st.st_size;
+    }
+    close(fd); /* Mapping remains valid */
+    return data;
+#endif
+}
+
+static void screening_store_unmap(const unsigned char *data, size_t size) {
+#ifdef WIN32
+    (void) size;
+    free((void *) data);
+#else
+    munmap((void *) data, size);
+#endif
+}
+
+int screening_cache_load(screening_cache *sc, const char *filename) {
+    if(!sc || !filename) {
+        return EXIT_FAILURE;
+    }
+    if(sc->store_filename && strcmp(sc->store_filename, filename) == 0) {
+        return EXIT_SUCCESS;
+    }
+    free(sc->store_filename);
+    sc->store_filename = strdup(filename);
+    size_t size = 0;
+    const unsigned char *data = screening_store_map(filename, &size);
+    if(!data) {
+        DEBUGMSG("Screening store %s could not be read, it will be created.", filename);
+        return EXIT_SUCCESS;
+    }
+    screening_store_header header;
+    if(size < sizeof(header)) {
+        screening_store_unmap(data, size);
+        return EXIT_SUCCESS;
+    }
+    memcpy(&header, data, sizeof(header));
+    if(strncmp(header.magic, SCREENING_STORE_MAGIC, sizeof(header.magic)) != 0 || header.version != SCREENING_STORE_VERSION || header.byte_order != 0x01020304) {
+        jabs_message(MSG_WARNING, "Screening store %s is not compatible with this version, it will be overwritten.\n", filename);
+        screening_store_unmap(data, size);
+        return EXIT_SUCCESS;
+    }
+    size_t offset = sizeof(header);
+    size_t n_loaded = 0, n_invalid = 0;
+    for(uint64_t i = 0; i < header.n_tables; i++) {
+        screening_store_record rec;
+        if(size - offset < sizeof(rec)) {
+            n_invalid++;
+            break;
+        }
+        memcpy(&rec, data + offset, sizeof(rec));
+        offset += sizeof(rec);
+        if(rec.n < 2 || rec.n > SCREENING_STORE_POINTS_MAX || (size - offset) / sizeof(struct reaction_point) < rec.n) {
+            n_invalid++;
+            break;
+        }
+        struct reaction_point *table = malloc(rec.n * sizeof(struct reaction_point));
+        if(!table) {
+            break;
+        }
+        memcpy(table, data + offset, rec.n * sizeof(struct reaction_point));
+        offset += rec.n * sizeof(struct reaction_point);
+        const screening_table_key key = {.type = rec.type, .cs = rec.cs, .Z1 = rec.Z1, .Z2 = rec.Z2, .m1 = rec.m1, .m2 = rec.m2,
+                                         .theta = rec.theta, .emin = rec.emin, .emax = rec.emax, .n = rec.n};
+        int ok = (screening_store_checksum(&rec, table) == rec.checksum);
+#pragma omp critical(screening_cache)
+        {
+            if(!ok || screening_cache_find(sc, &key) || screening_cache_insert(sc, &key, table)) {
+                free(table);
+            } else {
+                n_loaded++;
+            }
+        }
+        if(!ok) {
+            n_invalid++;
+        }
+    }
+    screening_store_unmap(data, size);
+#pragma omp critical(screening_cache)
+    screening_cache_evict(sc);
+    if(n_invalid) {
+        jabs_message(MSG_WARNING, "Screening store %s has %zu invalid tables, they were skipped.\n", filename, n_invalid);
+    }
+    jabs_message(MSG_VERBOSE, "Loaded %zu screening tables from %s.\n", n_loaded, filename);
+    return EXIT_SUCCESS;
+}
+
+static int screening_cache_entry_compare_recent(const void *a, const void *b) {
+    const screening_cache_entry *e_a = (const screening_cache_entry *) a;
+    const screening_cache_entry *e_b = (const screening_cache_entry *) b;
+    if(e_a->last_used > e_b->last_used) {
+        return -1;
+    }
+    return e_a->last_used < e_b->last_used ? 1 : 0;
+}
+
+int screening_cache_save(screening_cache *sc, const char *filename, size_t size_max) {
+    if(!sc || !filename) {
+        return EXIT_FAILURE;
+    }
+    if(!sc->modified) {
+        return EXIT_SUCCESS;
+    }
+    char *filename_tmp = malloc(strlen(filename) + 32);
+    if(!filename_tmp) {
+        return EXIT_FAILURE;
+    }
+#ifdef WIN32
+    sprintf(filename_tmp, "%s.%i.tmp", filename, _getpid());
+#else
+    sprintf(filename_tmp, "%s.%li.tmp", filename, (long) getpid()); /* Other processes may be writing the same store */
+#endif
+    FILE *f = fopen(filename_tmp, "wb");
+    if(!f) {
+        jabs_message(MSG_ERROR, "Could not write screening store %s.\n", filename_tmp);
+        free(filename_tmp);
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+#pragma omp critical(screening_cache)
+    {
+        qsort(sc->entries, sc->n, sizeof(screening_cache_entry), &screening_cache_entry_compare_recent);
+        screening_store_header header;
+        memset(&header, 0, sizeof(header));
+        strncpy(header.magic, SCREENING_STORE_MAGIC, sizeof(header.magic));
+        header.version = SCREENING_STORE_VERSION;
+        header.byte_order = 0x01020304;
+        size_t size = sizeof(header);
+        for(header.n_tables = 0; header.n_tables < sc->n; header.n_tables++) {
+            size_t size_table = sizeof(screening_store_record) + sc->entries[header.n_tables].key.n * sizeof(struct reaction_point);
+            if(size + size_table > size_max) {
+                break;
+            }
+            size += size_table;
+        }
+        if(fwrite(&header, sizeof(header), 1, f) != 1) {
+            status = EXIT_FAILURE;
+        }
+        for(size_t i = 0; i < header.n_tables && status == EXIT_SUCCESS; i++) {
+            const screening_cache_entry *e = &sc->entries[i];
+            screening_store_record rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.type = e->key.type;
+            rec.cs = e->key.cs;
+            rec.Z1 = e->key.Z1;
+            rec.Z2 = e->key.Z2;
+            rec.m1 = e->key.m1;
+            rec.m2 = e->key.m2;
+            rec.theta = e->key.theta;
+            rec.emin = e->key.emin;
+            rec.emax = e->key.emax;
+            rec.n = e->key.n;
+            rec.checksum = screening_store_checksum(&rec, e->table);
+            if(fwrite(&rec, sizeof(rec), 1, f) != 1 || fwrite(e->table, sizeof(struct reaction_point), e->key.n, f) != e->key.n) {
+                status = EXIT_FAILURE;
+            }
+        }
+        if(status == EXIT_SUCCESS) {
+            sc->modified = FALSE;
+            DEBUGMSG("Screening store %s: %zu tables of %zu, %zu bytes.", filename, (size_t) header.n_tables, sc->n, size);
+        }
+    }
+    if(fclose(f) != 0) {
+        status = EXIT_FAILURE;
+    }
+#ifdef WIN32
+    if(status == EXIT_SUCCESS) {
+        remove(filename); /* rename() doesn't replace files on Windows */
+    }
+#endif
+    if(status != EXIT_SUCCESS || rename(filename_tmp, filename) != 0) {
+        jabs_message(MSG_ERROR, "Could not write screening store %s.\n", filename);
+        remove(filename_tmp);
+        status = EXIT_FAILURE;
+    }
+    free(filename_tmp);
+    return status;
+}
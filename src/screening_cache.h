@@ -0,0 +1,66 @@
+/*
+
+    Jaakko's Backscattering Simulator (JaBS)
+    Copyright (C) 2021 - 2024 Jaakko Julin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    See LICENSE.txt for the full license.
+
+ */
+#ifndef JABS_SCREENING_CACHE_H
+#define JABS_SCREENING_CACHE_H
+#include "reaction.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct screening_table_key { /* Everything a screening table (see sim_reaction_recalculate_screening_table()) depends on */
+    reaction_type type;
+    jabs_reaction_cs cs;
+    int Z1;
+    int Z2;
+    double m1;
+    double m2;
+    double theta; /* Scattering angle (lab) */
+    double emin; /* Energy of first point */
+    double emax; /* Energy of last point */
+    size_t n; /* Number of points */
+} screening_table_key;
+
+typedef struct screening_cache_entry {
+    screening_table_key key;
+    struct reaction_point *table; /* Array, key.n elements */
+    size_t last_used; /* Value of screening_cache->clock when this entry was last used */
+} screening_cache_entry;
+
+typedef struct screening_cache { /* Screening tables of reactions, shared by workspaces and threads. Least recently used tables are evicted when memory use exceeds size_max. */
+    screening_cache_entry *entries; /* Array, n elements */
+    size_t n;
+    size_t n_alloc;
+    size_t size; /* Total memory used by tables (bytes) */
+    size_t size_max;
+    size_t clock;
+    size_t hits;
+    size_t misses;
+    int modified; /* Tables have been added since cache was loaded from or saved to a store */
+    char *store_filename; /* Store the cache was loaded from, NULL if none */
+} screening_cache;
+
+screening_cache *screening_cache_new(size_t size_max);
+void screening_cache_free(screening_cache *sc);
+void screening_cache_reset_stats(screening_cache *sc);
+int screening_cache_get(screening_cache *sc, const screening_table_key *key, struct reaction_point *table); /* Copies a cached table (key->n points) to table and returns EXIT_SUCCESS, or returns EXIT_FAILURE if there is no such table. sc can be NULL. */
+void screening_cache_put(screening_cache *sc, const screening_table_key *key, const struct reaction_point *table); /* Stores a copy of table (key->n points). sc can be NULL. */
+void screening_cache_print_stats(const screening_cache *sc, jabs_msg_level msg_level);
+int screening_cache_load(screening_cache *sc, const char *filename); /* Adds tables from a store file written by screening_cache_save(). File is memory mapped. Missing file or a file with a different version is not an error, invalid tables are skipped. Does nothing if cache was already loaded from the same file. */
+int screening_cache_save(screening_cache *sc, const char *filename, size_t size_max); /* Writes most recently used tables, at most size_max bytes, to a store file if tables have been added. File is replaced atomically. */
+#ifdef __cplusplus
+}
+#endif
+#endif // JABS_SCREENING_CACHE_H
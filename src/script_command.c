@@ -28,6 +28,8 @@
 #include "sample.h"
 #include "spectrum.h"
 #include "simulation.h"
+#include "des_cache.h"
+#include "screening_cache.h"
 #include "fit.h"
 #include "options.h"
 #include "git.h"
@@ -108,6 +110,10 @@ int script_prepare_sim_or_fit(script_session *s) {
     jibal_gsto_load_all(fit->jibal->gsto);
     DEBUGSTR("Updating calculation params before sim/fit");
     sim_calc_params_update(fit->sim->params);
+    des_cache_flush(fit->sim->des_cache); /* Stopping data was (re)loaded, old tables may be invalid */
+    stop_table_cache_flush(fit->sim->stop_table_cache);
+    screening_cache_reset_stats(fit->sim->screening_cache); /* Screening tables remain valid */
+    script_session_screening_store_load(s);
     jabs_message(MSG_VERBOSE, "Simulation parameters:\n");
     sim_print(fit->sim, MSG_VERBOSE);
 
@@ -141,6 +147,10 @@ int script_finish_sim_or_fit(script_session *s) {
     } else {
         jabs_message(MSG_IMPORTANT, "\n...finished! Total time: %.3lf ms.\n", time * 1000.0);
     }
+    des_cache_print_stats(s->fit->sim->des_cache, MSG_VERBOSE);
+    screening_cache_print_stats(s->fit->sim->screening_cache, MSG_VERBOSE);
+    stop_table_cache_print_stats(s->fit->sim->stop_table_cache, MSG_VERBOSE);
+    script_session_screening_store_save(s);
     fit_data_fdd_free(s->fit);
 #ifdef CLEAR_GSTO_ASSIGNMENTS_WHEN_FINISHED
     jibal_gsto_assign_clear_all(s->fit->jibal->gsto); /* Is it necessary? No. Here? No. Does it clear old stuff? Yes. */
@@ -172,6 +182,30 @@ void script_command_not_found(const char *cmd, const script_command *c_parent) {
     }
 }
 
+static int script_simulate_detector(size_t i_det, void *data) { /* Detectors may be simulated concurrently, see simulate_detectors() */
+    script_session *s = (script_session *) data;
+    struct fit_data *fit = s->fit;
+    detector *det = fit->sim->det[i_det];
+    detector_update(det);
+    sim_workspace *ws = sim_workspace_init(s->jibal, fit->sim, det);
+    if(!ws || simulate_with_ds(ws)) {
+        jabs_message(MSG_ERROR, "Simulation of detector %s failed.\n", det->name);
+        sim_workspace_free(ws);
+        return EXIT_FAILURE;
+    }
+#ifdef DEBUG
+    char *bricks_filename;
+    asprintf(&bricks_filename, "bricks_%zu.dat", i_det + 1);
+    if(bricks_filename) {
+        sim_workspace_print_bricks(ws, bricks_filename);
+        free(bricks_filename);
+    }
+#endif
+    fit_data_spectra_copy_to_spectra_from_ws(&fit->spectra[i_det], det, fit->exp[i_det], ws);
+    sim_workspace_free(ws);
+    return EXIT_SUCCESS;
+}
+
 script_command_status script_simulate(script_session *s, int argc, char *const *argv) {
     const int argc_orig = argc;
     (void) argv;
@@ -184,25 +218,8 @@ script_command_status script_simulate(script_session *s, int argc, char *const *
     }
     sim_calc_params_print(fit->sim->params, MSG_VERBOSE);
     jabs_message(MSG_IMPORTANT, "Simulation begins...\n");
-    for(size_t i_det = 0; i_det < fit->sim->n_det; i_det++) {
-        detector *det = fit->sim->det[i_det];
-        detector_update(det);
-        sim_workspace *ws = sim_workspace_init(s->jibal, fit->sim, det);
-        if(simulate_with_ds(ws)) {
-            jabs_message(MSG_ERROR, "Simulation failed.\n");
-            sim_workspace_free(ws);
-            return SCRIPT_COMMAND_FAILURE;
-        }
-#ifdef DEBUG
-        char *bricks_filename;
-        asprintf(&bricks_filename, "bricks_%zu.dat", i_det + 1);
-        if(bricks_filename) {
-            sim_workspace_print_bricks(ws, bricks_filename);
-            free(bricks_filename);
-        }
-#endif
-        fit_data_spectra_copy_to_spectra_from_ws(&fit->spectra[i_det], det, s->fit->exp[i_det], ws);
-        sim_workspace_free(ws);
+    if(simulate_detectors(fit->sim->n_det, fit->sim->params->parallel_detectors, script_simulate_detector, s)) {
+        return SCRIPT_COMMAND_FAILURE;
     }
     script_finish_sim_or_fit(s);
     return argc_orig - argc;
@@ -1290,9 +1307,26 @@ script_command *script_commands_create(struct script_session *s) {
             {JIBAL_CONFIG_VAR_DOUBLE, "xtolerance",                    0,     0,                               &fit->xtol,                                  NULL},
             {JIBAL_CONFIG_VAR_DOUBLE, "chisq_tolerance",               0,     0,                               &fit->chisq_tol,                             NULL},
             {JIBAL_CONFIG_VAR_DOUBLE, "chisq_fast_tolerance",          0,     0,                               &fit->chisq_fast_tol,                        NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "fit_accel",                     0,     0,                               &fit->accel,                                 NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "fit_fast_accel",                0,     0,                               &fit->accel_fast,                            NULL},
+            {JIBAL_CONFIG_VAR_SIZE,   "jacobian_refresh",              0,     0,                               &fit->jacobian_refresh,                      NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "jacobian_sparse",               0,     0,                               &fit->jacobian_sparse,                       NULL},
             {JIBAL_CONFIG_VAR_SIZE,   "n_bricks_max",                  0,     0,                               &sim->params->n_bricks_max,                  NULL},
             {JIBAL_CONFIG_VAR_BOOL,   "ds",                            0,     0,                               &sim->params->ds,                            NULL},
             {JIBAL_CONFIG_VAR_BOOL,   "rk4",                           0,     0,                               &sim->params->rk4,                           NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "stop_adaptive",                 0,     0,                               &sim->params->stop_adaptive,                 NULL},
+            {JIBAL_CONFIG_VAR_DOUBLE, "stop_adaptive_tolerance",       0,     0,                               &sim->params->stop_adaptive_tolerance,       NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "des_cache",                     0,     0,                               &sim->params->des_cache,                     NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "screening_cache",               0,     0,                               &sim->params->screening_cache,               NULL},
+            {JIBAL_CONFIG_VAR_PATH,   "screening_store",               0,     0,                               &s->screening_store,                         NULL},
+            {JIBAL_CONFIG_VAR_SIZE,   "screening_store_size",          0,     0,                               &s->screening_store_size_max,                NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "parallel_reactions",            0,     0,                               &sim->params->parallel_reactions,            NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "parallel_roughness",            0,     0,                               &sim->params->parallel_roughness,            NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "parallel_ds",                   0,     0,                               &sim->params->parallel_ds,                   NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "parallel_detectors",            0,     0,                               &sim->params->parallel_detectors,            NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "exit_tables",                   0,     0,                               &sim->params->exit_tables,                   NULL},
+            {JIBAL_CONFIG_VAR_BOOL,   "stop_tables",                   0,     0,                               &sim->params->stop_tables,                   NULL},
+            {JIBAL_CONFIG_VAR_DOUBLE, "stop_table_tolerance",          0,     0,                               &sim->params->stop_table_tolerance,          NULL},
             {JIBAL_CONFIG_VAR_DOUBLE, "brick_width_sigmas",            0,     0,                               &sim->params->brick_width_sigmas,            NULL},
             {JIBAL_CONFIG_VAR_DOUBLE, "sigmas_cutoff",                 0,     0,                               &sim->params->sigmas_cutoff,                 NULL},
             {JIBAL_CONFIG_VAR_UNIT,   "incident_stop_step",            "keV", JIBAL_UNIT_TYPE_ENERGY,          &sim->params->incident_stop_params.step,     NULL},
@@ -1310,6 +1344,7 @@ script_command *script_commands_create(struct script_session *s) {
             {JIBAL_CONFIG_VAR_BOOL,   "beta_manual",                   "deg", JIBAL_UNIT_TYPE_ANGLE,           &sim->params->beta_manual,                   NULL},
             {JIBAL_CONFIG_VAR_SIZE,   "cs_n_stragg_steps",             0,     0,                               &sim->params->cs_n_stragg_steps,             NULL},
             {JIBAL_CONFIG_VAR_BOOL,   "gaussian_accurate",             0,     0,                               &sim->params->gaussian_accurate,             NULL},
+            {JIBAL_CONFIG_VAR_OPTION, "convolution",                   0,     0,                               &sim->params->convolution,                   bricks_convolution_option},
             {JIBAL_CONFIG_VAR_SIZE,   "int_cs_max_intervals",          0,     0,                               &sim->params->int_cs_max_intervals,          NULL},
             {JIBAL_CONFIG_VAR_DOUBLE, "int_cs_accuracy",               0,     0,                               &sim->params->int_cs_accuracy,               NULL},
             {JIBAL_CONFIG_VAR_SIZE,   "int_cs_stragg_max_intervals",   0,     0,                               &sim->params->int_cs_stragg_max_intervals,   NULL},
@@ -1755,6 +1790,7 @@ script_command_status script_reset(script_session *s, int argc, char *const *arg
 
     sample_model_free(fit->sm);
     fit->sm = NULL;
+    script_session_screening_store_save(s); /* Session keeps the store, but the cache is freed with sim */
     sim_free(fit->sim);
     fit_data_free(s->fit);
     s->fit = fit_data_new(s->jibal, sim_init(s->jibal));
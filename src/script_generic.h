@@ -44,6 +44,8 @@ typedef struct script_session {
     struct script_command *commands;
     size_t i_det_active; /* Used by "set detector" */
     int Z_active; /* Used by "set detector calibration" */
+    char *screening_store; /* File where screening tables are stored between runs, NULL if not used. Not affected by reset. */
+    size_t screening_store_size_max;
 } script_session;
 
 #define SCRIPT_COMMAND_SUCCESS (0) /* Anything above and including zero is success */
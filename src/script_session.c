@@ -20,6 +20,7 @@
 #include "script_command.h"
 #include "script_file.h"
 #include "script_session.h"
+#include "screening_cache.h"
 
 script_session *script_session_init(jibal *jibal, simulation *sim) {
     if(!jibal)
@@ -42,6 +43,8 @@ script_session *script_session_init(jibal *jibal, simulation *sim) {
     }
     s->file_depth = 0;
     s->files[0] = NULL;
+    s->screening_store = NULL;
+    s->screening_store_size_max = SCREENING_STORE_SIZE_MAX;
     s->commands = script_commands_create(s);
     return s;
 }
@@ -65,13 +68,29 @@ int script_session_load_script(script_session *s, const char *filename) {
     return EXIT_SUCCESS;
 }
 
+int script_session_screening_store_load(script_session *s) {
+    if(!s || !s->screening_store || !s->fit || !s->fit->sim) {
+        return EXIT_SUCCESS;
+    }
+    return screening_cache_load(s->fit->sim->screening_cache, s->screening_store);
+}
+
+int script_session_screening_store_save(script_session *s) {
+    if(!s || !s->screening_store || !s->fit || !s->fit->sim) {
+        return EXIT_SUCCESS;
+    }
+    return screening_cache_save(s->fit->sim->screening_cache, s->screening_store, s->screening_store_size_max);
+}
+
 void script_session_free(script_session *s) {
     if(!s)
         return;
+    script_session_screening_store_save(s);
     sim_free(s->fit->sim);
     sample_model_free(s->fit->sm);
     fit_data_free(s->fit);
     script_commands_free(s->commands);
+    free(s->screening_store);
     free(s);
 }
 
@@ -27,6 +27,8 @@ extern "C" {
 script_session *script_session_init(jibal *jibal, simulation *sim); /* sim can be NULL or a previously initialized sim can be given. Note that it will be free'd by script_session_free()! */
 void script_session_free(script_session *s);
 int script_session_load_script(script_session *s, const char *filename);
+int script_session_screening_store_load(script_session *s); /* Loads screening tables from s->screening_store (if set) to screening cache of sim */
+int script_session_screening_store_save(script_session *s); /* Saves screening cache to s->screening_store (if set and there are new tables) */
 int script_get_detector_number(const simulation *sim, int allow_empty, int *argc, char * const **argv, size_t *i_det);
 #ifdef __cplusplus
 }
@@ -38,12 +38,24 @@ sim_calc_params *sim_calc_params_defaults(sim_calc_params *p) {
     p->ds_steps_azi = 0;
     p->ds_steps_polar = 0;
     p->rk4 = TRUE;
+    p->stop_adaptive = FALSE;
+    p->stop_adaptive_tolerance = STOP_ADAPTIVE_TOLERANCE_DEFAULT;
+    p->des_cache = TRUE;
+    p->screening_cache = TRUE;
+    p->parallel_reactions = TRUE;
+    p->parallel_roughness = TRUE;
+    p->parallel_ds = TRUE;
+    p->parallel_detectors = TRUE;
+    p->exit_tables = FALSE;
+    p->stop_tables = FALSE;
+    p->stop_table_tolerance = STOP_TABLE_TOLERANCE_DEFAULT;
     p->nuclear_stopping_accurate = TRUE;
     p->mean_conc_and_energy = FALSE;
     p->cs_n_stragg_steps = CS_STRAGG_STEPS;
     p->rough_layer_multiplier = 1.0;
     p->sigmas_cutoff = SIGMAS_CUTOFF;
     p->gaussian_accurate = FALSE;
+    p->convolution = BRICKS_CONVOLUTION_FAST;
     p->int_cs_max_intervals = CS_CONC_MAX_INTEGRATION_INTERVALS;
     p->int_cs_accuracy = CS_CONC_INTEGRATION_ACCURACY;
     p->int_cs_stragg_max_intervals = CS_STRAGG_MAX_INTEGRATION_INTERVALS;
@@ -63,6 +75,9 @@ sim_calc_params *sim_calc_params_defaults(sim_calc_params *p) {
 sim_calc_params *sim_calc_params_defaults_fast(sim_calc_params *p) {
     sim_calc_params_defaults(p);
     p->rk4 = FALSE;
+    p->exit_tables = TRUE;
+    p->stop_tables = TRUE;
+    p->stop_table_tolerance *= 10.0;
     p->nuclear_stopping_accurate = FALSE;
     p->mean_conc_and_energy = TRUE;
     p->cs_n_stragg_steps = 0; /* Not used if mean_conc_and_energy == TRUE */
@@ -165,11 +180,27 @@ void sim_calc_params_print(const sim_calc_params *params, jabs_msg_level msg_lev
         jabs_message(msg_level, "maximum step for exiting ions = %.3lf keV\n", params->exiting_stop_params.max / C_KEV);
     }
     jabs_message(msg_level, "stopping RK4 = %s\n", params->rk4?"true":"false");
+    jabs_message(msg_level, "adaptive stopping steps = %s\n", params->stop_adaptive?"true":"false");
+    if(params->stop_adaptive) {
+        jabs_message(msg_level, "adaptive stopping step tolerance = %g\n", params->stop_adaptive_tolerance);
+    }
+    jabs_message(msg_level, "stopping tables = %s\n", params->stop_tables?"true":"false");
+    if(params->stop_tables) {
+        jabs_message(msg_level, "stopping table tolerance = %g\n", params->stop_table_tolerance);
+    }
+    jabs_message(msg_level, "DES cache = %s\n", params->des_cache?"true":"false");
+    jabs_message(msg_level, "screening cache = %s\n", params->screening_cache?"true":"false");
+    jabs_message(msg_level, "parallel reactions = %s\n", params->parallel_reactions?"true":"false");
+    jabs_message(msg_level, "parallel roughness = %s\n", params->parallel_roughness?"true":"false");
+    jabs_message(msg_level, "parallel dual scattering = %s\n", params->parallel_ds?"true":"false");
+    jabs_message(msg_level, "parallel detectors = %s\n", params->parallel_detectors?"true":"false");
+    jabs_message(msg_level, "exit tables = %s\n", params->exit_tables?"true":"false");
     jabs_message(msg_level, "accurate nuclear stopping = %s\n", params->nuclear_stopping_accurate?"true":"false");
     if(params->n_bricks_max) {
         jabs_message(msg_level, "maximum number of bricks = %zu\n", params->n_bricks_max);
     }
     jabs_message(msg_level, "geometric broadening = %s\n", params->geostragg?"true":"false");
+    jabs_message(msg_level, "convolution = %s\n", params->gaussian_accurate ? "exact (gaussian_accurate)" : jibal_option_get_string(bricks_convolution_option, params->convolution));
     jabs_message(msg_level, "brick width = %g times detector and straggling sum sigma\n", params->brick_width_sigmas);
     jabs_message(msg_level, "cross section of brick determined using mean concentration and energy = %s\n", params->mean_conc_and_energy?"true":"false");
     if(!params->mean_conc_and_energy) {
@@ -15,6 +15,7 @@
 #define JABS_SIM_CALC_PARAMS_H
 #include "stop.h"
 #include "prob_dist.h"
+#include "brick.h"
 #include "message.h"
 
 #ifdef __cplusplus
@@ -29,11 +30,23 @@ typedef struct sim_calc_params {
     size_t cs_n_stragg_steps; /* Number of steps to take, when calculating straggling weighted cross sections. If zero, adaptive integration is used. */
     size_t n_bricks_max;
     int rk4; /* Use fourth order Runge-Kutta for energy loss calculation (differential equation with dE/dx). When false, a first-order method is used. */
+    int stop_adaptive; /* Use embedded adaptive Runge-Kutta (Dormand-Prince 5(4)) for energy loss calculation. Step sizes given by stop step parameters are used as upper limits. Overrides rk4. */
+    double stop_adaptive_tolerance; /* Local error tolerance (relative to energy) of adaptive steps */
+    int des_cache; /* Reuse DES tables of incident ions between detectors and fit evaluations, true/false */
+    int screening_cache; /* Reuse screening tables of reactions, true/false */
+    int parallel_reactions; /* Simulate reactions of a spectrum in parallel (OpenMP), true/false */
+    int parallel_roughness; /* Simulate roughness subspectra in parallel (OpenMP), true/false */
+    int parallel_ds; /* Simulate dual scattering in parallel (OpenMP), true/false */
+    int parallel_detectors; /* Simulate detectors in parallel (OpenMP), both in simulation and fits, true/false */
+    int exit_tables; /* Tabulate energy and straggling of exiting reaction products as a function of depth and energy, true/false */
+    int stop_tables; /* Precompute stopping and straggling tables for each sample range and ion, true/false */
+    double stop_table_tolerance; /* Relative accuracy of stopping tables */
     int nuclear_stopping_accurate; /* Use accurate nuclear stopping equation true/false. When false a faster (poorly approximating) equation is used below the nuclear stopping maximum. */
     int mean_conc_and_energy; /* Calculation of cross-section concentration product is simplified by calculating cross section at mean energy of a depth step and concentration at mid-bin (only relevant for samples with concentration gradients) */
     int geostragg; /* Geometric straggling true/false */
     int beta_manual; /* Don't calculate exit angle based on detector geometry, use something given by user, true/false */
     int gaussian_accurate; /* If this is FALSE an approximative gaussian CDF is used in convolution of spectra, otherwise function from GSL is used. */
+    bricks_convolution convolution; /* Convolution method, used when gaussian_accurate is FALSE. Default is fast, table must be selected explicitly. */
     jabs_stop_step_params incident_stop_params;
     jabs_stop_step_params exiting_stop_params;
     double ds_incident_stop_step_factor;
@@ -20,6 +20,7 @@
 #include "sim_reaction.h"
 #include "scatint.h"
 #include "defaults.h"
+#include "screening_cache.h"
 
 sim_reaction *sim_reaction_init(const sample *sample, const detector *det, const reaction *r, size_t n_channels, size_t n_bricks) {
     if(!r) {
@@ -28,6 +29,16 @@ sim_reaction *sim_reaction_init(const sample *sample, const detector *det, const
     assert(r->product);
     sim_reaction *sim_r = calloc(1, sizeof(sim_reaction));
     sim_r->r = r;
+    sim_r->histo = jabs_histogram_alloc(n_channels); /* free'd by sim_workspace_free */
+    sim_r->n_bricks = n_bricks;
+    sim_r->bricks = calloc(sim_r->n_bricks, sizeof(brick));
+    sim_r->bricks_soa = bricks_soa_alloc(sim_r->n_bricks); /* If this fails, bricks_convolute() makes its own */
+    sim_reaction_reset(sim_r, sample, det);
+    return sim_r;
+}
+
+void sim_reaction_reset(sim_reaction *sim_r, const sample *sample, const detector *det) {
+    const reaction *r = sim_r->r;
     ion *p = &sim_r->p;
     ion_reset(p);
     sim_r->i_isotope = sample->n_isotopes; /* Intentionally not valid */
@@ -38,11 +49,9 @@ sim_reaction *sim_reaction_init(const sample *sample, const detector *det, const
             sim_r->i_isotope = i_isotope;
         }
     }
-    sim_r->histo = jabs_histogram_alloc(n_channels); /* free'd by sim_workspace_free */
     calibration_apply_to_histogram(detector_get_calibration(det, r->product->Z), sim_r->histo); /* Setting histogram with Z-specific (or as fallback, default) calibration. */
     jabs_histogram_reset(sim_r->histo);
-    sim_r->n_bricks = n_bricks;
-    sim_r->bricks = calloc(sim_r->n_bricks, sizeof(brick));
+    sim_r->n_convolution_calls = 0;
     ion_set_isotope(p, r->product);
     p->nucl_stop = r->nucl_stop; /* We just borrow this */
     assert(p->nucl_stop);
@@ -51,7 +60,6 @@ sim_reaction *sim_reaction_init(const sample *sample, const detector *det, const
     assert(p->ion_gsto);
     assert(p->ion_gsto->incident = p->isotope);
     sim_reaction_set_cross_section_by_type(sim_r);
-    return sim_r;
 }
 
 void sim_reaction_free(sim_reaction *sim_r) {
@@ -66,6 +74,7 @@ void sim_reaction_free(sim_reaction *sim_r) {
         free(sim_r->bricks);
         sim_r->bricks = NULL;
     }
+    bricks_soa_free(sim_r->bricks_soa);
     free(sim_r->cs_table);
     free(sim_r);
 }
@@ -167,13 +176,6 @@ int sim_reaction_recalculate_screening_table(sim_reaction *sim_r) {
         default:
             return EXIT_SUCCESS;
     }
-    if(pt != POTENTIAL_NONE) {
-        sp = scatint_init(sim_r->r->type, pt, sim_r->r->incident, sim_r->r->target);
-        if(!sp) {
-            return EXIT_FAILURE;
-        }
-        scatint_set_theta(sp, sim_r->theta);
-    }
     sim_r->cs_table = malloc(n * sizeof(struct reaction_point));
     if(!sim_r->cs_table) {
         return EXIT_FAILURE;
@@ -182,6 +184,20 @@ int sim_reaction_recalculate_screening_table(sim_reaction *sim_r) {
     double emin = sim_r->emin_incident * 0.9; /* Safety factor included, note that screening table is *just* a screening table, cross section below sim_r->r->E_min should be zero, but screening is not! */
     double emax = sim_r->emax_incident * 1.1;
     sim_r->cs_estep = (emax - emin)/(n - 1);
+    const screening_table_key key = {.type = sim_r->r->type, .cs = cs, .Z1 = sim_r->r->incident->Z, .Z2 = sim_r->r->target->Z,
+                                     .m1 = sim_r->r->incident->mass, .m2 = sim_r->r->target->mass, .theta = sim_r->theta,
+                                     .emin = emin, .emax = emax, .n = n};
+    if(screening_cache_get(sim_r->screening_cache, &key, sim_r->cs_table) == EXIT_SUCCESS) {
+        DEBUGVERBOSEMSG("Screening table of reaction %s found in cache.", sim_r->r->name);
+        return EXIT_SUCCESS;
+    }
+    if(pt != POTENTIAL_NONE) {
+        sp = scatint_init(sim_r->r->type, pt, sim_r->r->incident, sim_r->r->target);
+        if(!sp) {
+            return EXIT_FAILURE;
+        }
+        scatint_set_theta(sp, sim_r->theta);
+    }
     DEBUGMSG("Computing screening, reaction %s, from %g keV to %g keV with %zu steps of %g keV", sim_r->r->name, emin / C_KEV, emax / C_KEV, n, sim_r->cs_estep / C_KEV);
     for(size_t i = 0; i < n; i++) {
         double E = emin + (sim_r->cs_estep) * i;
@@ -213,12 +229,14 @@ int sim_reaction_recalculate_screening_table(sim_reaction *sim_r) {
         }
     }
     scatint_params_free(sp);
+    screening_cache_put(sim_r->screening_cache, &key, sim_r->cs_table);
     DEBUGVERBOSEMSG("Screening table with %zu points recalculated, energy in range [%g keV, %g keV]", sim_r->n_cs_table, emin / C_KEV, emax / C_KEV);
     return EXIT_SUCCESS;
 }
 
 void sim_reaction_reset_screening_table(sim_reaction *sim_r) {
     free(sim_r->cs_table);
+    sim_r->cs_table = NULL;
     sim_r->n_cs_table = 0;
 }
 
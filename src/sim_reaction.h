@@ -27,6 +27,7 @@ typedef struct sim_reaction {
     ion p; /* Reaction product */
     jabs_histogram *histo;
     brick *bricks;
+    bricks_soa *bricks_soa; /* Buffer for convolution of bricks, space for n_bricks. Can be NULL. */
     size_t n_bricks;
     size_t last_brick; /* inclusive, from 0 up to n_bricks-1 */
     int stop;
@@ -50,10 +51,12 @@ typedef struct sim_reaction {
     struct reaction_point *cs_table; /* precalculated screening corrections from emin to emax, n_cs_table points */
     size_t n_cs_table;
     double cs_estep; /* calculated by sim_reaction_recalculate_screening_table(), step size based on n_cs_table */
+    struct screening_cache *screening_cache; /* Shared cache of screening tables, can be NULL */
 } sim_reaction; /* Workspace for a single reaction. Yes, the naming is confusing. */
 
 sim_reaction *sim_reaction_init(const sample *sample, const detector *det, const reaction *r, size_t n_channels, size_t n_bricks);
 void sim_reaction_free(sim_reaction *sim_r);
+void sim_reaction_reset(sim_reaction *sim_r, const sample *sample, const detector *det); /* Resets histogram and product ion, used by sim_reaction_init() and when a workspace is reused for another sample or detector (histogram size and number of bricks must not change) */
 int sim_reaction_recalculate_internal_variables(sim_reaction *sim_r, const sim_calc_params *params, double theta, double emin, double emin_incident, double emax_incident);
 int sim_reaction_recalculate_screening_table(sim_reaction *sim_r);
 void sim_reaction_reset_screening_table(sim_reaction *sim_r);
@@ -18,6 +18,8 @@
 #include <string.h>
 #include <gsl/gsl_integration.h>
 #include "simulation.h"
+#include "des_cache.h"
+#include "screening_cache.h"
 #include "defaults.h"
 #include "rotate.h"
 #include "message.h"
@@ -48,6 +50,9 @@ simulation *sim_init(jibal *jibal) {
     sim->cs_rbs = jabs_reaction_cs_from_jibal_cs(jibal->config->cs_rbs);
     sim->cs_erd = jabs_reaction_cs_from_jibal_cs(jibal->config->cs_erd);
     ion_reset(&sim->ion);
+    sim->des_cache = des_cache_new(DES_CACHE_SIZE_MAX);
+    sim->screening_cache = screening_cache_new(SCREENING_CACHE_SIZE_MAX);
+    sim->stop_table_cache = stop_table_cache_new(STOP_TABLE_CACHE_SIZE_MAX);
     sim_det_add(sim, detector_default(NULL));
     return sim;
 }
@@ -70,6 +75,9 @@ void sim_free(simulation *sim) {
     sim_calc_params_free(sim->params);
     nuclear_stopping_free(sim->ion.nucl_stop);
     ion_gsto_free(sim->ion.ion_gsto);
+    des_cache_free(sim->des_cache);
+    screening_cache_free(sim->screening_cache);
+    stop_table_cache_free(sim->stop_table_cache);
     free(sim);
 }
 
@@ -51,6 +51,9 @@ typedef struct simulation {
     jabs_reaction_cs cs_rbs;
     jabs_reaction_cs cs_erd;
     ion ion; /* This ion is not to be used in calculations, it is simply copied to ws->ion. We do store the nuclear stopping (ion->nucl_stop) here too. */
+    struct des_cache *des_cache; /* DES tables of incident ions (see des_cache.h), shared by shallow copies of this simulation */
+    struct screening_cache *screening_cache; /* Screening tables of reactions (see screening_cache.h), shared like des_cache */
+    stop_table_cache *stop_table_cache; /* Stopping tables of samples and detector foils (see stop_table.h), shared like des_cache */
 } simulation;
 
 simulation *sim_init(jibal *jibal);
@@ -18,6 +18,9 @@
 #include "generic.h"
 #include "message.h"
 #include "simulation_workspace.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "spectrum.h"
 
 
@@ -26,6 +29,9 @@ void sim_workspace_init_reactions(sim_workspace *ws) {
     ws->reactions = calloc(sim->n_reactions, sizeof (sim_reaction *));
     for(size_t i_reaction = 0; i_reaction < sim->n_reactions; i_reaction++) {
         ws->reactions[i_reaction] = sim_reaction_init(sim->sample, ws->det, sim->reactions[i_reaction], ws->n_channels, ws->n_bricks);
+        if(ws->reactions[i_reaction] && ws->params->screening_cache) {
+            ws->reactions[i_reaction]->screening_cache = sim->screening_cache;
+        }
         ws->n_reactions++;
     }
 }
@@ -56,6 +62,44 @@ void sim_workspace_calculate_number_of_bricks(sim_workspace *ws) {
     DEBUGMSG("Number of bricks in workspace: %zu", n_bricks);
 }
 
+static void sim_workspace_set_params(sim_workspace *ws, const simulation *sim) { /* Copies calculation parameters from sim and sets stopping calculation parameters accordingly */
+    sim_calc_params_copy(sim->params,  ws->params);
+    sim_calc_params_update(ws->params);
+    if(sim->params->beta_manual && sim->params->ds) {
+        jabs_message(MSG_WARNING,  "Manual exit angle is enabled in addition to dual scattering. This is an unsupported combination. Manual exit angle calculation will be disabled.\n");
+        ws->params->beta_manual  = FALSE;
+    }
+
+    if(sim->params->beta_manual && sim->params->geostragg) {
+        jabs_message(MSG_WARNING,  "Manual exit angle is enabled in addition to geometric scattering. This is an unsupported combination. Geometric straggling calculation will be disabled.\n");
+        ws->params->geostragg = FALSE;
+    }
+    ws->stop.type = GSTO_STO_TOT; /* ws->stop.gsto is set once in sim_workspace_init() */
+    ws->stop.rk4 = ws->params->rk4;
+    ws->stop.adaptive = ws->params->stop_adaptive;
+    ws->stop.adaptive_tolerance = ws->params->stop_adaptive_tolerance;
+    ws->stop.nuclear_stopping_accurate = ws->params->nuclear_stopping_accurate;
+    ws->stop.emin = ws->emin;
+    ws->stop.tables = ws->stop_tables;
+    ws->stragg = ws->stop; /* Copy */
+    ws->stragg.type = GSTO_STO_STRAGG;
+}
+
+static void sim_workspace_set_sim(sim_workspace *ws, const simulation *sim, const detector *det) { /* Sets everything that can change between simulations without reinitializing ws */
+    ws->sim = sim;
+    ws->emin = sim->emin;
+    ws->fluence = sim->fluence;
+    ws->det = det;
+    ws->sample = sim->sample;
+    ws->ion = sim->ion; /* Shallow copy, but that is ok */
+    ws->ion.E = sim->beam_E;
+    ws->ion.S = pow2(sim->beam_E_broad / C_FWHM);
+}
+
+static double sim_workspace_incident_E_max(const sim_workspace *ws) {
+    return ws->sim->beam_E + ws->params->sigmas_cutoff * ws->sim->beam_E_broad / C_FWHM;
+}
+
 sim_workspace *sim_workspace_init(const jibal *jibal, const simulation *sim, const detector *det) {
     if(!jibal || !sim || !det) {
         jabs_message(MSG_ERROR,  "No JIBAL, sim or det. Guru thinks: %p, %p %p.\n", jibal, sim, det);
@@ -66,30 +110,16 @@ sim_workspace *sim_workspace_init(const jibal *jibal, const simulation *sim, con
         return NULL;
     }
     sim_workspace *ws = calloc(1, sizeof(sim_workspace));
-    ws->sim = sim;
-    ws->emin = sim->emin;
-    ws->fluence = sim->fluence;
-    ws->det = det;
-    ws->sample = sim->sample;
+    sim_workspace_set_sim(ws, sim, det);
     ws->params = sim_calc_params_defaults(NULL);
-    sim_calc_params_copy(sim->params,  ws->params);
-    sim_calc_params_update(ws->params);
     ws->gsto = jibal->gsto;
+    ws->stop.gsto = jibal->gsto;
     ws->isotopes = jibal->isotopes;
     ws->n_reactions = 0; /* Will be incremented later */
-
-    if(sim->params->beta_manual && sim->params->ds) {
-        jabs_message(MSG_WARNING,  "Manual exit angle is enabled in addition to dual scattering. This is an unsupported combination. Manual exit angle calculation will be disabled.\n");
-        ws->params->beta_manual  = FALSE;
-    }
-
-    if(sim->params->beta_manual && sim->params->geostragg) {
-        jabs_message(MSG_WARNING,  "Manual exit angle is enabled in addition to geometric scattering. This is an unsupported combination. Geometric straggling calculation will be disabled.\n");
-        ws->params->geostragg = FALSE;
+    sim_workspace_set_params(ws, sim);
+    if(ws->params->convolution == BRICKS_CONVOLUTION_TABLE) {
+        erf_Q_table_init();
     }
-    ws->ion = sim->ion; /* Shallow copy, but that is ok */
-    ws->ion.E = sim->beam_E;
-    ws->ion.S = pow2(sim->beam_E_broad / C_FWHM);
 
     sim_workspace_recalculate_n_channels(ws, ws->sim);
 
@@ -115,6 +145,89 @@ sim_workspace *sim_workspace_init(const jibal *jibal, const simulation *sim, con
     sim_workspace_calculate_number_of_bricks(ws);
     sim_workspace_init_reactions(ws);
 
+    if(sim_workspace_init_integration(ws)) {
+        jabs_message(MSG_ERROR, "Could not allocate integration workspaces.\n");
+        sim_workspace_free(ws);
+        return NULL;
+    }
+    if(det->foil) {
+        ws->foil_tables = exit_tables_new(det->foil, 0.0);
+        if(!ws->foil_tables) {
+            sim_workspace_free(ws);
+            return NULL;
+        }
+    }
+    if(ws->params->stop_tables) {
+        if(sim_workspace_init_stop_tables(ws)) {
+            jabs_message(MSG_ERROR, "Could not compute stopping tables.\n");
+            sim_workspace_free(ws);
+            return NULL;
+        }
+        ws->stop.tables = ws->stop_tables;
+        ws->stragg.tables = ws->stop_tables;
+    }
+    return ws;
+}
+
+int sim_workspace_init_stop_tables(sim_workspace *ws) {
+    size_t n_ions = 0;
+    const ion **ions = calloc(ws->n_reactions + 1, sizeof(ion *));
+    double *E_max = calloc(ws->n_reactions + 1, sizeof(double));
+    if(!ions || !E_max) {
+        free(ions);
+        free(E_max);
+        return EXIT_FAILURE;
+    }
+    double E_incident_max = sim_workspace_incident_E_max(ws);
+    ions[n_ions] = &ws->ion;
+    E_max[n_ions] = E_incident_max * STOP_TABLE_E_MAX_MARGIN;
+    n_ions++;
+    for(size_t i_reaction = 0; i_reaction < ws->n_reactions; i_reaction++) {
+        const sim_reaction *sim_r = ws->reactions[i_reaction];
+        double E = (E_incident_max + fabs(sim_r->r->Q)) * STOP_TABLE_E_MAX_MARGIN; /* Reaction product can't have more kinetic energy than this */
+        size_t i;
+        for(i = 0; i < n_ions; i++) {
+            if(ions[i]->isotope == sim_r->p.isotope) { /* Same ion, one table is enough */
+                E_max[i] = GSL_MAX_DBL(E_max[i], E);
+                break;
+            }
+        }
+        if(i == n_ions) {
+            ions[n_ions] = &sim_r->p;
+            E_max[n_ions] = E;
+            n_ions++;
+        }
+    }
+    ws->stop_tables = stop_tables_new(ws->params->stop_table_tolerance, ws->sim->stop_table_cache); /* Workspaces initialized for the same sample composition share tables */
+    int status = EXIT_SUCCESS;
+    if(!ws->stop_tables || stop_tables_add_sample(ws->stop_tables, ws->sample, ws->params->nuclear_stopping_accurate, ions, E_max, n_ions)) {
+        status = EXIT_FAILURE;
+    }
+    if(status == EXIT_SUCCESS && ws->det->foil) {
+        status = stop_tables_add_sample(ws->stop_tables, ws->det->foil, ws->params->nuclear_stopping_accurate, ions, E_max, n_ions);
+    }
+    DEBUGMSG("Stopping tables for %zu ions computed, %zu points in total.", n_ions, stop_tables_size(ws->stop_tables));
+    free(ions);
+    free(E_max);
+    return status;
+}
+
+void sim_workspace_free(sim_workspace *ws) {
+    if(!ws)
+        return;
+    sim_calc_params_free(ws->params);
+    for(size_t i = 0; i < ws->n_reactions; i++) {
+        sim_reaction_free(ws->reactions[i]);
+    }
+    free(ws->reactions);
+    sim_workspace_free_integration(ws);
+    jabs_histogram_free(ws->histo_sum);
+    stop_tables_free(ws->stop_tables);
+    exit_tables_free(ws->foil_tables);
+    free(ws);
+}
+
+int sim_workspace_init_integration(sim_workspace *ws) {
     if(ws->params->cs_adaptive) { /* Actually integrate, allocate workspace for this */
         DEBUGMSG("cs_n_steps = 0, allocating integration workspace w_int_cs with %zu max intervals.", ws->params->int_cs_max_intervals);
         ws->w_int_cs = gsl_integration_workspace_alloc(ws->params->int_cs_max_intervals);
@@ -127,30 +240,91 @@ sim_workspace *sim_workspace_init(const jibal *jibal, const simulation *sim, con
     } else {
         ws->w_int_cs_stragg = NULL;
     }
-    ws->stop.type = GSTO_STO_TOT;
-    ws->stop.gsto = jibal->gsto;
-    ws->stop.rk4 = ws->params->rk4;
-    ws->stop.nuclear_stopping_accurate = ws->params->nuclear_stopping_accurate;
-    ws->stop.emin = ws->emin;
-    ws->stragg = ws->stop; /* Copy */
-    ws->stragg.type = GSTO_STO_STRAGG;
-    return ws;
+    if((ws->params->cs_adaptive && !ws->w_int_cs) || (ws->params->cs_n_stragg_steps == 0 && !ws->w_int_cs_stragg)) {
+        sim_workspace_free_integration(ws);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
 }
 
-void sim_workspace_free(sim_workspace *ws) {
-    if(!ws)
+void sim_workspace_free_integration(sim_workspace *ws) {
+    gsl_integration_workspace_free(ws->w_int_cs);
+    gsl_integration_workspace_free(ws->w_int_cs_stragg);
+    ws->w_int_cs = NULL;
+    ws->w_int_cs_stragg = NULL;
+}
+
+sim_workspace *sim_workspace_copy_for_thread(const sim_workspace *ws) {
+    sim_workspace *ws_copy = malloc(sizeof(sim_workspace));
+    if(!ws_copy) {
+        return NULL;
+    }
+    *ws_copy = *ws; /* Shallow copy, parameters are shared */
+    ws_copy->histo_sum = NULL;
+    ws_copy->exit_tables = NULL;
+    ws_copy->w_int_cs = NULL;
+    ws_copy->w_int_cs_stragg = NULL;
+    ws_copy->stop_tables = NULL;
+    ws_copy->reactions = calloc(ws->n_reactions, sizeof(sim_reaction *));
+    if(!ws_copy->reactions) {
+        free(ws_copy);
+        return NULL;
+    }
+    int fail = FALSE;
+    for(size_t i = 0; i < ws->n_reactions; i++) {
+        ws_copy->reactions[i] = sim_reaction_init(ws->sample, ws->det, ws->reactions[i]->r, ws->n_channels, ws->n_bricks);
+        if(!ws_copy->reactions[i]) {
+            fail = TRUE;
+        } else {
+            ws_copy->reactions[i]->screening_cache = ws->reactions[i]->screening_cache;
+        }
+    }
+    if(ws->stop_tables) {
+        ws_copy->stop_tables = stop_tables_view(ws->stop_tables);
+        fail = fail || !ws_copy->stop_tables;
+    }
+    ws_copy->stop.tables = ws_copy->stop_tables;
+    ws_copy->stragg.tables = ws_copy->stop_tables;
+    if(fail || sim_workspace_init_integration(ws_copy)) {
+        sim_workspace_free_thread_copy(ws_copy);
+        return NULL;
+    }
+    return ws_copy;
+}
+
+void sim_workspace_free_thread_copy(sim_workspace *ws) {
+    if(!ws) {
         return;
-    sim_calc_params_free(ws->params);
+    }
     for(size_t i = 0; i < ws->n_reactions; i++) {
         sim_reaction_free(ws->reactions[i]);
     }
     free(ws->reactions);
-    gsl_integration_workspace_free(ws->w_int_cs);
-    gsl_integration_workspace_free(ws->w_int_cs_stragg);
-    jabs_histogram_free(ws->histo_sum);
+    sim_workspace_free_integration(ws);
+    stop_tables_view_free(ws->stop_tables);
     free(ws);
 }
 
+void sim_workspace_histograms_accumulate(sim_workspace *ws, sim_workspace *ws_thread, int copy_bricks) {
+    for(size_t i = 0; i < ws->n_reactions; i++) {
+        sim_reaction *r = ws->reactions[i];
+        sim_reaction *r_thread = ws_thread->reactions[i];
+        if(r_thread->n_convolution_calls) {
+            size_t n = GSL_MIN(r->histo->n, r_thread->histo->n);
+            for(size_t i_bin = 0; i_bin < n; i_bin++) {
+                r->histo->bin[i_bin] += r_thread->histo->bin[i_bin];
+            }
+            jabs_histogram_reset(r_thread->histo);
+            r->n_convolution_calls += r_thread->n_convolution_calls;
+            r_thread->n_convolution_calls = 0;
+        }
+        if(copy_bricks) {
+            memcpy(r->bricks, r_thread->bricks, (r_thread->last_brick + 1) * sizeof(brick));
+            r->last_brick = r_thread->last_brick;
+        }
+    }
+}
+
 void sim_workspace_recalculate_n_channels(sim_workspace *ws, const simulation *sim) { /* TODO: assumes calibration function is increasing */
     size_t n_max = CHANNELS_ABSOLUTE_MIN; /* Always simulate at least CHANNELS_ABSOLUTE_MIN channels */
     for(size_t i_reaction = 0; i_reaction < sim->n_reactions; i_reaction++) {
@@ -206,6 +380,314 @@ void sim_workspace_calculate_sum_spectra(sim_workspace *ws) {
     }
 }
 
+static int sim_workspace_pool_thread(void) {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+static void sim_workspace_pool_entry_sizes_clear(sim_workspace_pool_entry *e) {
+    for(size_t i = 0; e->calibrations && i < e->n_calibrations; i++) {
+        calibration_free(e->calibrations[i]);
+    }
+    free(e->calibrations);
+    e->calibrations = NULL;
+    e->n_calibrations = 0;
+}
+
+static const calibration *sim_workspace_pool_entry_calibration(const simulation *sim, const detector *det, size_t i) { /* Calibration i of those stored in sim_workspace_pool_entry */
+    if(i < sim->n_reactions) {
+        return detector_get_calibration(det, sim->reactions[i]->product->Z);
+    }
+    return detector_get_calibration(det, sim->beam_isotope->Z);
+}
+
+static void sim_workspace_pool_entry_sizes_store(sim_workspace_pool_entry *e, const simulation *sim, const detector *det) { /* Stores everything number of channels and bricks of e->ws depend on (apart from reactions and calculation parameters, which are the same for all reuses) */
+    sim_workspace_pool_entry_sizes_clear(e);
+    e->calibrations = calloc(sim->n_reactions + 1, sizeof(calibration *));
+    if(!e->calibrations) {
+        return;
+    }
+    e->n_calibrations = sim->n_reactions + 1;
+    for(size_t i = 0; i < e->n_calibrations; i++) {
+        const calibration *c = sim_workspace_pool_entry_calibration(sim, det, i);
+        e->calibrations[i] = calibration_clone(c);
+        if(!e->calibrations[i]) { /* Can not be compared later */
+            sim_workspace_pool_entry_sizes_clear(e);
+            return;
+        }
+        e->calibrations[i]->resolution_variance = c->resolution_variance;
+    }
+    e->beam_E = sim->beam_E;
+    e->beam_E_broad = sim->beam_E_broad;
+    e->theta = det->theta;
+    e->length = det->length;
+    e->det_type = det->type;
+    e->n_ranges = sim->sample->n_ranges;
+}
+
+static int sim_workspace_pool_entry_sizes_valid(const sim_workspace_pool_entry *e, const simulation *sim, const detector *det) { /* TRUE if number of channels and bricks of e->ws need not be recalculated */
+    if(!e->calibrations || e->n_calibrations != sim->n_reactions + 1) {
+        return FALSE;
+    }
+    if(e->beam_E != sim->beam_E || e->beam_E_broad != sim->beam_E_broad || e->theta != det->theta || e->length != det->length || e->det_type != det->type || e->n_ranges != sim->sample->n_ranges) {
+        return FALSE;
+    }
+    for(size_t i = 0; i < e->n_calibrations; i++) {
+        if(!calibration_equal(e->calibrations[i], sim_workspace_pool_entry_calibration(sim, det, i))) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void sim_workspace_pool_entry_clear(sim_workspace_pool_entry *e) {
+    sim_workspace_free(e->ws);
+    sample_free(e->sample);
+    sample_free(e->foil);
+    sim_workspace_pool_entry_sizes_clear(e);
+    e->ws = NULL;
+    e->sample = NULL;
+    e->foil = NULL;
+}
+
+static int sim_workspace_pool_entry_init(sim_workspace_pool_entry *e, const jibal *jibal, const simulation *sim, const detector *det) {
+    e->ws = sim_workspace_init(jibal, sim, det);
+    if(!e->ws) {
+        return EXIT_FAILURE;
+    }
+    e->E_incident_max = sim_workspace_incident_E_max(e->ws);
+    if(e->ws->stop_tables) { /* Tables are bound to copies, since sim->sample and det->foil may be freed before the workspace is reused */
+        e->sample = sample_copy(sim->sample);
+        if(!e->sample) {
+            return EXIT_FAILURE;
+        }
+    }
+    if(det->foil) {
+        e->foil = sample_copy(det->foil);
+        if(!e->foil) {
+            return EXIT_FAILURE;
+        }
+    }
+    sim_workspace_pool_entry_sizes_store(e, sim, det);
+    return EXIT_SUCCESS;
+}
+
+static int sim_workspace_pool_entry_stop_tables_rebuild(sim_workspace_pool_entry *e, const simulation *sim) { /* Stopping tables for a sample with different concentrations (or higher beam energy). Tables of foil (and of samples seen earlier) come from the stopping table cache. */
+    sim_workspace *ws = e->ws;
+    stop_tables_free(ws->stop_tables);
+    ws->stop_tables = NULL;
+    ws->stop.tables = NULL;
+    ws->stragg.tables = NULL;
+    sample_free(e->sample);
+    e->sample = sample_copy(sim->sample);
+    if(!e->sample || sim_workspace_init_stop_tables(ws)) {
+        return EXIT_FAILURE;
+    }
+    ws->stop.tables = ws->stop_tables;
+    ws->stragg.tables = ws->stop_tables;
+    e->E_incident_max = sim_workspace_incident_E_max(ws);
+    return EXIT_SUCCESS;
+}
+
+static int sim_workspace_pool_entry_reuse(sim_workspace_pool_entry *e, const simulation *sim, const detector *det) { /* Prepares e->ws for simulation of sim and det, returns EXIT_FAILURE if this is not possible */
+    sim_workspace *ws = e->ws;
+    if(!ws || ws->n_reactions != sim->n_reactions || (sim->params->stop_tables != (ws->stop_tables != NULL))) {
+        return EXIT_FAILURE;
+    }
+    for(size_t i = 0; i < ws->n_reactions; i++) {
+        if(!ws->reactions[i] || ws->reactions[i]->r != sim->reactions[i]) {
+            return EXIT_FAILURE;
+        }
+    }
+    if((det->foil != NULL) != (e->foil != NULL) || (det->foil && !sample_values_equal(e->foil, det->foil))) { /* Foil tables are only valid for the same foil */
+        return EXIT_FAILURE;
+    }
+    sim_workspace_set_sim(ws, sim, det);
+    sim_workspace_set_params(ws, sim); /* Parameters may have been changed by the previous simulation (e.g. dual scattering) */
+    if((ws->params->cs_adaptive != (ws->w_int_cs != NULL)) || ((ws->params->cs_n_stragg_steps == 0) != (ws->w_int_cs_stragg != NULL))) {
+        sim_workspace_free_integration(ws);
+        if(sim_workspace_init_integration(ws)) {
+            return EXIT_FAILURE;
+        }
+    }
+    if(!sim_workspace_pool_entry_sizes_valid(e, sim, det)) { /* Calibration, beam or sample structure changed, see if histograms and bricks are still large enough */
+        size_t n_channels = ws->n_channels;
+        size_t n_bricks = ws->n_bricks;
+        sim_workspace_recalculate_n_channels(ws, sim);
+        sim_workspace_calculate_number_of_bricks(ws);
+        if(ws->n_channels != n_channels || ws->n_bricks != n_bricks || detector_sanity_check(det, ws->n_channels)) {
+            return EXIT_FAILURE;
+        }
+        sim_workspace_pool_entry_sizes_store(e, sim, det);
+    }
+    if(ws->foil_tables) { /* New tables are made for the live foil. Workspace is not in use, nothing else can be making tables now. */
+        ws->foil_tables->sample = det->foil;
+    }
+    if(ws->stop_tables) {
+        int rebuild = (sim_workspace_incident_E_max(ws) > e->E_incident_max);
+        if(!rebuild && stop_tables_bind(ws->stop_tables, e->sample, sim->sample)) {
+            rebuild = TRUE; /* Concentrations changed */
+        }
+        if(!rebuild && det->foil && stop_tables_bind(ws->stop_tables, e->foil, det->foil)) {
+            stop_tables_bind(ws->stop_tables, sim->sample, e->sample);
+            rebuild = TRUE;
+        }
+        if(rebuild && sim_workspace_pool_entry_stop_tables_rebuild(e, sim)) {
+            return EXIT_FAILURE;
+        }
+    }
+    for(size_t i = 0; i < ws->n_reactions; i++) {
+        sim_reaction_reset(ws->reactions[i], sim->sample, det);
+    }
+    calibration_apply_to_histogram(det->calibration, ws->histo_sum);
+    jabs_histogram_reset(ws->histo_sum);
+    return EXIT_SUCCESS;
+}
+
+sim_workspace_pool *sim_workspace_pool_new(void) {
+    return calloc(1, sizeof(sim_workspace_pool));
+}
+
+void sim_workspace_pool_free(sim_workspace_pool *pool) {
+    if(!pool) {
+        return;
+    }
+    for(size_t i = 0; i < pool->n; i++) {
+        sim_workspace_pool_entry_clear(pool->entries[i]);
+        free(pool->entries[i]);
+    }
+    free(pool->entries);
+    free(pool);
+}
+
+void sim_workspace_pool_flush(sim_workspace_pool *pool) {
+    if(!pool) {
+        return;
+    }
+#pragma omp critical(sim_workspace_pool)
+    {
+        for(size_t i = 0; i < pool->n; i++) {
+            if(!pool->entries[i]->in_use) {
+                sim_workspace_pool_entry_clear(pool->entries[i]);
+            }
+        }
+    }
+}
+
+sim_workspace *sim_workspace_pool_get(sim_workspace_pool *pool, size_t i_det, const jibal *jibal, const simulation *sim, const detector *det) {
+    if(!pool) {
+        return sim_workspace_init(jibal, sim, det);
+    }
+    sim_workspace_pool_entry *e = NULL;
+    const int thread = sim_workspace_pool_thread();
+#pragma omp critical(sim_workspace_pool)
+    {
+        for(size_t i = 0; i < pool->n; i++) { /* Prefer an entry with a workspace of the same detector and thread, but take an empty one if there is nothing else */
+            sim_workspace_pool_entry *e_i = pool->entries[i];
+            if(e_i->in_use) {
+                continue;
+            }
+            if(e_i->ws && e_i->i_det == i_det && e_i->thread == thread) {
+                e = e_i;
+                break;
+            }
+            if(!e_i->ws && !e) {
+                e = e_i;
+            }
+        }
+        if(!e) {
+            if(pool->n == pool->n_alloc) {
+                size_t n_alloc = pool->n_alloc ? pool->n_alloc * 2 : 8;
+                sim_workspace_pool_entry **entries = realloc(pool->entries, n_alloc * sizeof(sim_workspace_pool_entry *));
+                if(entries) {
+                    pool->entries = entries;
+                    pool->n_alloc = n_alloc;
+                }
+            }
+            if(pool->n < pool->n_alloc) {
+                e = calloc(1, sizeof(sim_workspace_pool_entry));
+                if(e) {
+                    pool->entries[pool->n] = e;
+                    pool->n++;
+                }
+            }
+        }
+        if(e) {
+            e->in_use = TRUE;
+        }
+    }
+    if(!e) { /* Could not be pooled, sim_workspace_pool_release() will free this */
+        return sim_workspace_init(jibal, sim, det);
+    }
+    int reused = (e->ws && e->i_det == i_det && e->thread == thread && sim_workspace_pool_entry_reuse(e, sim, det) == EXIT_SUCCESS);
+    if(!reused) {
+        sim_workspace_pool_entry_clear(e);
+        e->i_det = i_det;
+        e->thread = thread;
+        if(sim_workspace_pool_entry_init(e, jibal, sim, det)) {
+            sim_workspace_pool_entry_clear(e);
+        }
+    }
+    sim_workspace *ws = e->ws;
+#pragma omp critical(sim_workspace_pool)
+    {
+        if(reused) {
+            pool->n_reuse++;
+        } else if(ws) {
+            pool->n_init++;
+        }
+        if(!ws) {
+            e->in_use = FALSE;
+        }
+    }
+    return ws;
+}
+
+void sim_workspace_pool_release(sim_workspace_pool *pool, sim_workspace *ws) {
+    if(!ws) {
+        return;
+    }
+    sim_workspace_pool_entry *e = NULL;
+    if(pool) {
+#pragma omp critical(sim_workspace_pool)
+        {
+            for(size_t i = 0; i < pool->n; i++) {
+                if(pool->entries[i]->ws == ws) {
+                    e = pool->entries[i];
+                    break;
+                }
+            }
+        }
+    }
+    if(!e) { /* Workspace was not pooled */
+        sim_workspace_free(ws);
+        return;
+    }
+    if(ws->stop_tables) { /* Live sample and foil may be freed soon, bind tables to our copies */
+        int fail = stop_tables_bind(ws->stop_tables, ws->sample, e->sample);
+        if(e->foil) {
+            fail = stop_tables_bind(ws->stop_tables, ws->det->foil, e->foil) || fail;
+        }
+        if(fail) {
+            sim_workspace_pool_entry_clear(e);
+        }
+    }
+#pragma omp critical(sim_workspace_pool)
+    {
+        e->in_use = FALSE;
+    }
+}
+
+void sim_workspace_pool_print_stats(const sim_workspace_pool *pool, jabs_msg_level msg_level) {
+    if(!pool || pool->n_init + pool->n_reuse == 0) {
+        return;
+    }
+    jabs_message(msg_level, "Workspace pool: %zu workspaces initialized, %zu reused.\n", pool->n_init, pool->n_reuse);
+}
+
 void sim_workspace_histograms_reset(sim_workspace *ws) {
     jabs_histogram_reset(ws->histo_sum);
     for(size_t i = 0; i < ws->n_reactions; i++) {
@@ -216,6 +698,152 @@ void sim_workspace_histograms_reset(sim_workspace *ws) {
     }
 }
 
+static bricks_convolution sim_workspace_convolution_method(const sim_workspace *ws) {
+    return ws->params->gaussian_accurate ? BRICKS_CONVOLUTION_EXACT : ws->params->convolution;
+}
+
+sim_workspace_bricks *sim_workspace_bricks_copy(const sim_workspace *ws) {
+    if(ws->sim->params->ds) {
+        return NULL;
+    }
+    for(size_t i = 0; i < ws->n_reactions; i++) {
+        if(ws->reactions[i] && ws->reactions[i]->n_convolution_calls > 1) { /* Histogram is a sum of several simulations (roughness) */
+            return NULL;
+        }
+    }
+    sim_workspace_bricks *wb = calloc(1, sizeof(sim_workspace_bricks));
+    if(!wb) {
+        return NULL;
+    }
+    wb->n_channels = ws->n_channels;
+    wb->sigmas_cutoff = ws->params->sigmas_cutoff;
+    wb->emin = ws->emin;
+    wb->method = sim_workspace_convolution_method(ws);
+    wb->reactions = calloc(ws->n_reactions, sizeof(sim_reaction_bricks));
+    if(!wb->reactions) {
+        free(wb);
+        return NULL;
+    }
+    for(size_t i = 0; i < ws->n_reactions; i++) {
+        const sim_reaction *r = ws->reactions[i];
+        if(!r || r->n_convolution_calls == 0 || r->last_brick == 0) {
+            if(r && !r->stop) {
+                wb->n_reactions_empty++;
+            }
+            continue;
+        }
+        sim_reaction_bricks *rb = &wb->reactions[wb->n_reactions];
+        rb->isotope = r->p.isotope;
+        rb->scale = ws->fluence * r->r->yield;
+        rb->last_brick = r->last_brick;
+        rb->reflection = (ws->ion.inverse_cosine_theta > 0.0 && r->p.inverse_cosine_theta < 0.0);
+        rb->bricks = malloc((r->last_brick + 1) * sizeof(brick));
+        if(!rb->bricks) {
+            sim_workspace_bricks_free(wb);
+            return NULL;
+        }
+        memcpy(rb->bricks, r->bricks, (r->last_brick + 1) * sizeof(brick));
+        wb->n_reactions++;
+    }
+    return wb;
+}
+
+void sim_workspace_bricks_free(sim_workspace_bricks *wb) {
+    if(!wb) {
+        return;
+    }
+    for(size_t i = 0; i < wb->n_reactions; i++) {
+        free(wb->reactions[i].bricks);
+    }
+    free(wb->reactions);
+    free(wb);
+}
+
+jabs_histogram *sim_workspace_bricks_convolute(const sim_workspace_bricks *wb, const detector *det) {
+    jabs_histogram *histo_sum = jabs_histogram_alloc(wb->n_channels);
+    size_t n_bricks_max = 0;
+    for(size_t i = 0; i < wb->n_reactions; i++) {
+        n_bricks_max = GSL_MAX(n_bricks_max, wb->reactions[i].last_brick + 1);
+    }
+    if(n_bricks_max == 0) { /* No reactions, spectrum is empty */
+        if(histo_sum) {
+            calibration_apply_to_histogram(det->calibration, histo_sum);
+            jabs_histogram_reset(histo_sum);
+        }
+        return histo_sum;
+    }
+    jabs_histogram *histo = jabs_histogram_alloc(wb->n_channels);
+    brick *bricks = malloc(n_bricks_max * sizeof(brick)); /* Copy, since sigmas are recalculated */
+    bricks_soa *bs = bricks_soa_alloc(n_bricks_max); /* Shared by all reactions */
+    if(!histo_sum || !histo || !bricks) {
+        jabs_histogram_free(histo_sum);
+        jabs_histogram_free(histo);
+        free(bricks);
+        bricks_soa_free(bs);
+        return NULL;
+    }
+    calibration_apply_to_histogram(det->calibration, histo_sum);
+    jabs_histogram_reset(histo_sum);
+    for(size_t i = 0; i < wb->n_reactions; i++) {
+        const sim_reaction_bricks *rb = &wb->reactions[i];
+        const calibration *c = detector_get_calibration(det, rb->isotope->Z);
+        calibration_apply_to_histogram(c, histo);
+        jabs_histogram_reset(histo);
+        memcpy(bricks, rb->bricks, (rb->last_brick + 1) * sizeof(brick));
+        bricks_calculate_sigma(det, rb->isotope, bricks, rb->last_brick);
+        bricks_convolute(histo, c, bricks, rb->last_brick, rb->scale * det->solid, wb->sigmas_cutoff, wb->emin, wb->method, bs);
+        for(size_t i_bin = 0; i_bin < histo->n; i_bin++) {
+            histo_sum->bin[i_bin] += histo->bin[i_bin];
+        }
+    }
+    jabs_histogram_free(histo);
+    free(bricks);
+    bricks_soa_free(bs);
+    return histo_sum;
+}
+
+size_t sim_workspace_bricks_channels_affected(const sim_workspace_bricks *wb, const detector *det, double depth) {
+    if(!wb || wb->n_reactions_empty) { /* Spectra of empty reactions could appear anywhere */
+        return SIZE_MAX;
+    }
+    size_t n = 0;
+    for(size_t i = 0; i < wb->n_reactions; i++) {
+        const sim_reaction_bricks *rb = &wb->reactions[i];
+        if(!rb->reflection) { /* In transmission, reaction products from shallower depths go through the changed part of the sample */
+            return SIZE_MAX;
+        }
+        size_t i_start = rb->last_brick; /* Bricks deeper than last brick can appear, their energy is lower */
+        for(size_t i_brick = 1; i_brick <= rb->last_brick; i_brick++) {
+            if(rb->bricks[i_brick].d.x >= depth) {
+                i_start = i_brick - 1; /* Convolution of brick i_brick extends to energy of previous brick */
+                break;
+            }
+        }
+        double E_max = 0.0, S_max = 0.0;
+        for(size_t i_brick = i_start; i_brick <= rb->last_brick; i_brick++) {
+            const brick *b = &rb->bricks[i_brick];
+            E_max = GSL_MAX_DBL(E_max, b->E);
+            S_max = GSL_MAX_DBL(S_max, b->S_sum);
+        }
+        E_max += wb->sigmas_cutoff * S_max * BRICKS_SPARSE_BROADENING_MARGIN;
+        const calibration *c = detector_get_calibration(det, rb->isotope->Z);
+        if(!calibration_is_monotonically_increasing(c, wb->n_channels)) {
+            return SIZE_MAX;
+        }
+        size_t lo = 0, hi = wb->n_channels; /* Find first channel with low energy edge above E_max, convolution does not reach it */
+        while(lo < hi) {
+            size_t mi = lo + (hi - lo) / 2;
+            if(calibration_eval(c, mi) > E_max) {
+                hi = mi;
+            } else {
+                lo = mi + 1;
+            }
+        }
+        n = GSL_MAX(n, lo);
+    }
+    return n;
+}
+
 size_t sim_workspace_histograms_calculate(sim_workspace *ws) {
     size_t n_meaningful = 0;
     for(size_t i = 0; i < ws->n_reactions; i++) {
@@ -232,7 +860,7 @@ size_t sim_workspace_histograms_calculate(sim_workspace *ws) {
         fprintf(stdout, "BRICK #Reaction %zu: %s, last brick %zu\n", i + 1, r->r->name, r->last_brick);
 #endif
         double scale = ws->fluence * ws->det->solid * r->r->yield;
-        bricks_convolute(r->histo, c, r->bricks, r->last_brick, scale, ws->params->sigmas_cutoff, ws->emin, ws->params->gaussian_accurate);
+        bricks_convolute(r->histo, c, r->bricks, r->last_brick, scale, ws->params->sigmas_cutoff, ws->emin, sim_workspace_convolution_method(ws), r->bricks_soa);
 #ifdef DEBUG_BRICK_OUTPUT
         fprintf(stdout, "BRICK \nBRICK \n");
 #endif
@@ -17,6 +17,8 @@
 #include "simulation.h"
 #include "sim_reaction.h"
 #include "spectrum.h"
+#include "exit_table.h"
+#include "message.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -38,20 +40,83 @@ typedef struct sim_workspace {
     sim_calc_params *params;
     jabs_stop stop; /* Stopping calculation parameters and data, set on sim_workspace_init() */
     jabs_stop stragg; /* Straggling calculation parameters and data */
+    stop_tables *stop_tables; /* Precomputed stopping for sample and detector foil, NULL if not used. Shared by stop and stragg. */
+    exit_tables *exit_tables; /* Exit energies of reaction products, valid during one simulate() call, NULL if not used. */
+    exit_tables *foil_tables; /* Energies of ions after the detector foil, computed as needed and kept as long as ws. Shared by threads. NULL if detector has no foil. */
     double emin;
     gsl_integration_workspace *w_int_cs; /* Integration workspace for conc * cross section product */
     gsl_integration_workspace *w_int_cs_stragg;
     size_t n_bricks; /* same as r->n_bricks in each reaction */
 } sim_workspace;
 
+typedef struct sim_reaction_bricks {
+    const jibal_isotope *isotope; /* Reaction product */
+    double scale; /* Fluence times reaction yield. Solid angle of detector is not included. */
+    size_t last_brick;
+    int reflection; /* Incident ion and reaction product go in different directions (depth), detected energy decreases with depth */
+    brick *bricks; /* Array, last_brick + 1 elements */
+} sim_reaction_bricks;
+
+typedef struct sim_workspace_bricks { /* Copy of bricks of all reactions after a simulation. Spectra can be convoluted again from these, e.g. with a different calibration or resolution of the detector. */
+    size_t n_channels;
+    size_t n_reactions;
+    sim_reaction_bricks *reactions; /* Array, n_reactions elements */
+    size_t n_reactions_empty; /* Reactions that were not stopped, but produced no bricks (e.g. zero concentration). These are not included in reactions. */
+    double sigmas_cutoff;
+    double emin;
+    bricks_convolution method;
+} sim_workspace_bricks;
+
+typedef struct sim_workspace_pool_entry {
+    sim_workspace *ws;
+    size_t i_det; /* Workspace is only reused for the same detector */
+    int thread; /* and by the same thread */
+    int in_use;
+    sample *sample; /* Copy of the sample (and detector foil) stopping tables of ws were computed for. Tables are bound to these when ws is not in use. */
+    sample *foil; /* Copy of detector foil, NULL if detector has no foil. Foil tables of ws are valid for this foil. */
+    double E_incident_max; /* Stopping tables are valid up to this incident energy */
+    calibration **calibrations; /* Copies of calibrations of reaction products and the beam (last) that n_channels and n_bricks of ws were calculated with, n_calibrations elements. NULL if those must be recalculated. */
+    size_t n_calibrations;
+    double beam_E; /* Number of channels and bricks are also valid for this beam, detector and number of sample ranges */
+    double beam_E_broad;
+    double theta;
+    double length;
+    detector_type det_type;
+    size_t n_ranges;
+} sim_workspace_pool_entry;
+
+typedef struct sim_workspace_pool { /* Workspaces kept for the lifetime of a fit, reused by simulations of the same detector (in the same thread) instead of initializing new ones every time. */
+    sim_workspace_pool_entry **entries; /* Array of pointers, n elements */
+    size_t n;
+    size_t n_alloc;
+    size_t n_init; /* Statistics: workspaces initialized */
+    size_t n_reuse; /* Statistics: workspaces reused */
+} sim_workspace_pool;
 
 sim_workspace *sim_workspace_init(const jibal *jibal, const simulation *sim, const detector *det);
 void sim_workspace_init_reactions(sim_workspace *ws); /* used by sim_workspace_init(), ws->sim and ws->n_bricks should be set before calling */
 void sim_workspace_calculate_number_of_bricks(sim_workspace *ws);
 void sim_workspace_free(sim_workspace *ws);
+int sim_workspace_init_integration(sim_workspace *ws); /* Allocates integration workspaces (w_int_cs, w_int_cs_stragg) as needed by ws->params. Used by sim_workspace_init() and by threads that need their own. */
+void sim_workspace_free_integration(sim_workspace *ws);
+sim_workspace *sim_workspace_copy_for_thread(const sim_workspace *ws); /* Shallow copy of ws with its own reactions (bricks, histograms), integration workspaces and stopping table bindings, so that a thread can simulate() independently. Free with sim_workspace_free_thread_copy(). */
+void sim_workspace_free_thread_copy(sim_workspace *ws);
+void sim_workspace_histograms_accumulate(sim_workspace *ws, sim_workspace *ws_thread, int copy_bricks); /* Adds reaction histograms of ws_thread (a copy of ws) to ws and resets them. If copy_bricks is TRUE, bricks are copied too (e.g. for the last simulation, so that ws has its bricks). */
+int sim_workspace_init_stop_tables(sim_workspace *ws); /* used by sim_workspace_init(), ws->reactions should be set before calling */
 void sim_workspace_recalculate_n_channels(sim_workspace *ws, const simulation *sim);
 void sim_workspace_calculate_sum_spectra(sim_workspace *ws);
 
+sim_workspace_bricks *sim_workspace_bricks_copy(const sim_workspace *ws); /* Returns NULL if spectra of ws can not be reproduced from one set of bricks (dual scattering, roughness) */
+void sim_workspace_bricks_free(sim_workspace_bricks *wb);
+jabs_histogram *sim_workspace_bricks_convolute(const sim_workspace_bricks *wb, const detector *det); /* Sum spectrum of bricks convoluted using calibration and resolution of det. Bricks of wb are not modified. */
+size_t sim_workspace_bricks_channels_affected(const sim_workspace_bricks *wb, const detector *det, double depth); /* Spectrum of det in channels [0, n) can change if sample changes at depth or deeper than that, n is returned. SIZE_MAX if this can not be determined. */
+sim_workspace_pool *sim_workspace_pool_new(void);
+void sim_workspace_pool_free(sim_workspace_pool *pool);
+void sim_workspace_pool_flush(sim_workspace_pool *pool); /* Frees all workspaces that are not in use. Call this when calculation parameters change. */
+sim_workspace *sim_workspace_pool_get(sim_workspace_pool *pool, size_t i_det, const jibal *jibal, const simulation *sim, const detector *det); /* Same as sim_workspace_init(), but reuses a workspace of detector i_det used by the same thread if possible. Thread safe. Return the workspace with sim_workspace_pool_release(). pool can be NULL. */
+void sim_workspace_pool_release(sim_workspace_pool *pool, sim_workspace *ws); /* Workspace can be reused after this. Sample and detector of ws need not exist anymore after this call. If pool is NULL, ws is freed. */
+void sim_workspace_pool_print_stats(const sim_workspace_pool *pool, jabs_msg_level msg_level);
+
 void sim_workspace_histograms_reset(sim_workspace *ws);
 size_t sim_workspace_histograms_calculate(sim_workspace *ws);
 void sim_workspace_histograms_scale(sim_workspace *ws, double scale);
@@ -45,8 +45,131 @@ depth stop_next_crossing(const ion *incident, const sample *sample, const depth
 }
 
 
+depth stop_step_adaptive(const jabs_stop *stop, const jabs_stop *stragg, ion *incident, const sample *sample, depth depth_before, double step, stop_step_state *state) {
+    /* Dormand-Prince 5(4). The fifth order solution is propagated and the embedded fourth order solution is used for error estimate. The last stage is evaluated at the new energy and depth, which makes it the stopping needed for non-statistical broadening. */
+    static const double c[7] = {0.0, 1.0 / 5.0, 3.0 / 10.0, 4.0 / 5.0, 8.0 / 9.0, 1.0, 1.0};
+    static const double a[7][6] = {
+            {0.0},
+            {1.0 / 5.0},
+            {3.0 / 40.0, 9.0 / 40.0},
+            {44.0 / 45.0, -56.0 / 15.0, 32.0 / 9.0},
+            {19372.0 / 6561.0, -25360.0 / 2187.0, 64448.0 / 6561.0, -212.0 / 729.0},
+            {9017.0 / 3168.0, -355.0 / 33.0, 46732.0 / 5247.0, 49.0 / 176.0, -5103.0 / 18656.0},
+            {35.0 / 384.0, 0.0, 500.0 / 1113.0, 125.0 / 192.0, -2187.0 / 6784.0, 11.0 / 84.0} /* Fifth order weights */
+    };
+    static const double e[7] = {71.0 / 57600.0, 0.0, -71.0 / 16695.0, 71.0 / 1920.0, -17253.0 / 339200.0, 22.0 / 525.0, -1.0 / 40.0}; /* Difference of fifth and fourth order weights */
+    double k[7];
+    struct depth depth_next = stop_next_crossing(incident, sample, &depth_before);
+    double h_max_perp = depth_next.x - depth_before.x;
+    depth_before.i = depth_next.i; /* See stop_step() */
+    const double E = incident->E;
+    if(state && state->step_next > 0.0) {
+        step = GSL_MIN_DBL(step, state->step_next);
+    }
+    if(incident->Z == 0) {
+        k[0] = 0.0;
+    } else if(state && state->k_next > 0.0) { /* Last stage of previous step was evaluated at this energy and depth */
+        k[0] = state->k_next;
+    } else {
+        k[0] = stop_sample(stop, incident, sample, depth_before, E);
+    }
+    if(state) {
+        state->step_next = step;
+        state->k_next = 0.0;
+    }
+    double h_max = h_max_perp * incident->inverse_cosine_theta;
+    double h = (step / k[0]);
+    if(k[0] < STOP_STEP_MINIMUM_STOPPING) {
+        DEBUGVERBOSEMSG("adaptive step returns no progress, because k1 = %g eV/tfu (x = %.3lf tfu, E = %.3lg keV)", k[0]/C_EV_TFU, depth_before.x/C_TFU, E/C_KEV);
+        if(STOP_STEP_DEPTH_FALLBACK > h_max_perp) {
+            return depth_next;
+        }
+        depth_before.x += STOP_STEP_DEPTH_FALLBACK;
+        return depth_before;
+    }
+    assert(h_max >= 0.0);
+    h = GSL_MAX_DBL(h, STOP_STEP_ABSOLUTE_MINIMUM_STEP);
+    if(h >= h_max && h_max < 0.001 * C_TFU) {
+        return depth_next;
+    }
+    ion ion_stage = *incident; /* Nuclear stopping is evaluated at the energy of each stage (stop_sample() uses ion energy) */
+    depth d_stage = {.i = depth_before.i};
+    depth fulldepth;
+    double h_perp = 0.0, dE = 0.0, err = 0.0;
+    for(int n_retry = 0; ; n_retry++) {
+        if(h >= h_max) { /* Stop exactly on the boundary */
+            h = h_max;
+            h_perp = h_max_perp;
+            fulldepth = depth_next;
+        } else {
+            h_perp = h * incident->cosine_theta;
+            fulldepth.i = depth_before.i;
+            fulldepth.x = depth_before.x + h_perp;
+        }
+        err = 0.0;
+        dE = 0.0;
+        for(int s = 1; s < 7; s++) {
+            double sum = 0.0;
+            for(int j = 0; j < s; j++) {
+                sum += a[s][j] * k[j];
+            }
+            ion_stage.E = E - h * sum;
+            if(ion_stage.E <= 0.0) { /* Way too long step, reject */
+                err = 1.0 / pow(STOP_ADAPTIVE_SHRINK_MIN, 5.0);
+                break;
+            }
+            if(c[s] == 1.0) {
+                k[s] = stop_sample(stop, &ion_stage, sample, fulldepth, ion_stage.E);
+                continue;
+            }
+            d_stage.x = depth_before.x + c[s] * h_perp;
+            k[s] = stop_sample(stop, &ion_stage, sample, d_stage, ion_stage.E);
+        }
+        if(err == 0.0) {
+            double sum = 0.0;
+            for(int j = 0; j < 7; j++) {
+                sum += e[j] * k[j];
+            }
+            err = fabs(h * sum) / (stop->adaptive_tolerance * E);
+            dE = E - ion_stage.E; /* Positive, last stage was evaluated at fifth order solution */
+        }
+        if(err <= 1.0 || n_retry >= STOP_ADAPTIVE_RETRIES_MAX || h <= STOP_STEP_ABSOLUTE_MINIMUM_STEP) {
+            break;
+        }
+        h *= GSL_MAX_DBL(STOP_ADAPTIVE_SHRINK_MIN, 0.9 * pow(err, -0.2));
+        h = GSL_MAX_DBL(h, STOP_STEP_ABSOLUTE_MINIMUM_STEP);
+    }
+#ifdef DEBUG
+    if(err > 1.0) {
+        DEBUGVERBOSEMSG("Adaptive step accepted with error %g times tolerance, h = %g tfu, E = %g keV", err, h / C_TFU, E / C_KEV);
+    }
+#endif
+    int fsal = (h < h_max); /* Next step starts in the same range */
+    if(dE <= 0.0) { /* Can only happen if all retries ended up with negative energies, fall back to first order step */
+        dE = h * k[0];
+        k[6] = k[0];
+        fsal = FALSE;
+    }
+    if(state) {
+        state->step_next = dE * (err > 0.0 ? GSL_MIN_DBL(STOP_ADAPTIVE_GROWTH_MAX, 0.9 * pow(err, -0.2)) : STOP_ADAPTIVE_GROWTH_MAX);
+        state->k_next = fsal ? k[6] : 0.0;
+    }
+    depth halfdepth;
+    halfdepth.i = depth_before.i;
+    halfdepth.x = depth_before.x + h_perp / 2.0;
+#ifndef NO_STATISTICAL_STRAGGLING
+    incident->S *= pow2(k[6] / k[0]);
+#endif
+    incident->S += h * stop_sample(stragg, incident, sample, halfdepth, E - (0.5 * dE)); /* Straggling, calculate at mid-energy */
+    incident->E -= dE;
+    return fulldepth;
+}
+
 depth stop_step(const jabs_stop *stop, const jabs_stop *stragg, ion *incident, const sample *sample, depth depth_before, double step) {
     double k1, k2, k3, k4, stopping, dE, E;
+    if(stop->adaptive) {
+        return stop_step_adaptive(stop, stragg, incident, sample, depth_before, step, NULL);
+    }
     struct depth depth_next = stop_next_crossing(incident, sample, &depth_before);
     double h_max_perp = depth_next.x - depth_before.x;
 #ifdef DEBUG_STOP_STEP
@@ -138,6 +261,9 @@ double stop_sample(const jabs_stop *stop, const ion *incident, const sample *sam
     if(incident->Z == 0) {
         return 0.0;
     }
+    if(stop->tables && stop_tables_get(stop->tables, stop->type, incident, sample, depth, E, &out) == EXIT_SUCCESS) {
+        return out;
+    }
     for(size_t i_isotope = 0; i_isotope < sample->n_isotopes; i_isotope++) {
         double c;
         const jibal_isotope *target = sample->isotopes[i_isotope];
@@ -199,6 +325,34 @@ double stop_sample(const jabs_stop *stop, const ion *incident, const sample *sam
     }
 }
 
+double stop_ion_element(gsto_stopping_type type, const ion *incident, int Z2, double em) {
+    const gsto_file_t *file;
+    const double *data;
+    double unit_factor = 1.0;
+    assert(Z2 <= incident->ion_gsto->Z2_max);
+    if(type == GSTO_STO_STRAGG) {
+        file = incident->ion_gsto->gsto_data[Z2].straggfile;
+        data = incident->ion_gsto->gsto_data[Z2].straggdata;
+        if(file->straggunit == GSTO_STRAGG_UNIT_BOHR) {
+            unit_factor = jibal_stragg_bohr(incident->Z, Z2);
+        }
+    } else {
+        file = incident->ion_gsto->gsto_data[Z2].stopfile;
+        data = incident->ion_gsto->gsto_data[Z2].stopdata;
+        if(file->stounit == GSTO_STO_UNIT_EV15CM2) {
+            unit_factor = C_EV_TFU;
+        }
+    }
+    assert(file);
+    if(em < file->em[0]) {
+        return unit_factor * data[0];
+    } else if(em > file->em[file->xpoints - 1]) {
+        return unit_factor * data[file->xpoints - 1];
+    }
+    int lo = jibal_gsto_em_to_index(file, em);
+    return unit_factor * jibal_linear_interpolation(file->em[lo], file->em[lo + 1], data[lo], data[lo + 1], em);
+}
+
 double stop_sample_old(const jabs_stop *stop, const ion *incident, const sample *sample, const depth depth, double E) {
     const double em = E * incident->mass_inverse;
     double S1 = 0.0;
@@ -250,6 +404,7 @@ int stop_sample_exit(const jabs_stop *stop, const jabs_stop *stragg, const jabs_
     depth d = depth_start;
     int last = FALSE;
     double emin = GSL_MAX_DBL(stop->emin, p->ion_gsto->emin);
+    stop_step_state state = {.step_next = params_exiting->max, .k_next = 0.0};
     while(1) { /* Exit from sample (hopefully) */
         if(p->inverse_cosine_theta > 0.0 && d.x >= (sample->thickness - DEPTH_TOLERANCE)) { /* Exit through back (transmission) */
             return 0;
@@ -257,12 +412,17 @@ int stop_sample_exit(const jabs_stop *stop, const jabs_stop *stragg, const jabs_
         if(p->inverse_cosine_theta < 0.0 && d.x <= DEPTH_TOLERANCE) { /* Exit (surface, front of sample) */
             return 0;
         }
+        if(last && stop->adaptive && p->E > emin + params_exiting->min) { /* Error control shortened the last step, not there yet */
+            last = FALSE;
+        }
         if(last) {
             DEBUGMSG("Last step taken, E = %g keV, depth still %.3lf tfu, break break.", p->E / C_KEV, d.x / C_TFU);
             break;
         }
         double E_step = stop_step_calc(params_exiting, p);
-
+        if(stop->adaptive) {
+            E_step = GSL_MIN_DBL(state.step_next, params_exiting->max); /* Step chosen by error control, limited by maximum step */
+        }
         if(p->E - E_step <= emin) {
             if(p->E <= emin) {
                 DEBUGMSG("Energy %g keV is below %g keV. Assuming ion stops.\n", p->E / C_KEV, emin / C_KEV);
@@ -273,8 +433,286 @@ int stop_sample_exit(const jabs_stop *stop, const jabs_stop *stragg, const jabs_
                             p->E / C_KEV, emin / C_KEV, E_step / C_KEV, d.x / C_TFU);
             last = TRUE;
         }
-        depth d_after = stop_step(stop, stragg, p, sample, d, E_step);
+        depth d_after;
+        if(stop->adaptive) {
+            d_after = stop_step_adaptive(stop, stragg, p, sample, d, E_step, &state);
+        } else {
+            d_after = stop_step(stop, stragg, p, sample, d, E_step);
+        }
         d = d_after;
     }
     return -1; /* Stopped inside the sample */
 }
+
+static void stop_sample_batch_chunk(const jabs_stop *stop, const ion *incident, const sample *sample, const depth *d, const double *E, const double *E_nucl, double *out, size_t n) {
+    double em[STOP_BATCH_CHUNK], c[STOP_BATCH_CHUNK], S[STOP_BATCH_CHUNK];
+    int direct[STOP_BATCH_CHUNK];
+    int Z2_S[STOP_BATCH_CHUNK]; /* Element S[i] was computed for, zero if S[i] is not valid */
+    size_t n_direct = 0;
+    assert(n <= STOP_BATCH_CHUNK);
+    for(size_t i = 0; i < n; i++) {
+        out[i] = 0.0;
+    }
+    if(incident->Z == 0) {
+        return;
+    }
+    for(size_t i = 0; i < n; i++) {
+        direct[i] = TRUE;
+        if(stop->tables) {
+            ion ion_i = *incident; /* Tables use ion->E for nuclear stopping */
+            ion_i.E = E_nucl[i];
+            direct[i] = (stop_tables_get(stop->tables, stop->type, &ion_i, sample, d[i], E[i], &out[i]) != EXIT_SUCCESS);
+        }
+        n_direct += direct[i];
+    }
+    if(n_direct == 0) {
+        return;
+    }
+    for(size_t i = 0; i < n; i++) {
+        em[i] = E[i] * incident->mass_inverse;
+        Z2_S[i] = 0;
+    }
+    for(size_t i_isotope = 0; i_isotope < sample->n_isotopes; i_isotope++) {
+        const jibal_isotope *target = sample->isotopes[i_isotope];
+        int nonzero = FALSE;
+        for(size_t i = 0; i < n; i++) {
+            if(!direct[i]) {
+                c[i] = 0.0;
+            } else if(sample->no_conc_gradients) {
+                c[i] = *sample_conc_bin(sample, d[i].i, i_isotope);
+            } else {
+                c[i] = get_conc(sample, d[i], i_isotope);
+            }
+            if(c[i] < CONC_TOLERANCE) {
+                c[i] = 0.0;
+            } else {
+                nonzero = TRUE;
+            }
+        }
+        if(!nonzero) {
+            continue;
+        }
+        for(size_t i = 0; i < n; i++) { /* Electronic stopping (or straggling) is the same for all isotopes of an element, but S[i] is only valid if it was computed for this element at this point */
+            if(c[i] > 0.0 && Z2_S[i] != target->Z) {
+                S[i] = stop_ion_element(stop->type, incident, target->Z, em[i]);
+                Z2_S[i] = target->Z;
+            }
+        }
+        if(stop->type == GSTO_STO_TOT) {
+            for(size_t i = 0; i < n; i++) {
+                if(c[i] > 0.0) {
+                    out[i] += c[i] * (S[i] + ion_nuclear_stop_E(incident, target, E_nucl[i], stop->nuclear_stopping_accurate));
+                }
+            }
+        } else {
+            for(size_t i = 0; i < n; i++) {
+                if(c[i] > 0.0) {
+                    out[i] += c[i] * S[i];
+                }
+            }
+        }
+    }
+    for(size_t i = 0; i < n; i++) {
+        if(!direct[i]) {
+            continue;
+        }
+        const sample_range *r = &sample->ranges[d[i].i];
+        switch(stop->type) {
+            case GSTO_STO_ELE:
+            case GSTO_STO_TOT:
+                out[i] *= r->bragg;
+                break;
+            case GSTO_STO_STRAGG:
+                out[i] *= r->stragg;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void stop_sample_batch(const jabs_stop *stop, const ion *incident, const sample *sample, const depth *d, const double *E, const double *E_nucl, double *out, size_t n) {
+    for(size_t i_start = 0; i_start < n; i_start += STOP_BATCH_CHUNK) {
+        size_t m = GSL_MIN(n - i_start, STOP_BATCH_CHUNK);
+        stop_sample_batch_chunk(stop, incident, sample, d + i_start, E + i_start, (E_nucl ? E_nucl : E) + i_start, out + i_start, m);
+    }
+}
+
+static void stop_step_batch_chunk(const jabs_stop *stop, const jabs_stop *stragg, ion * const *ions, const sample *sample, depth *d, const double *step, size_t n) {
+    depth d_next[STOP_BATCH_CHUNK], halfdepth[STOP_BATCH_CHUNK], fulldepth[STOP_BATCH_CHUNK];
+    double E[STOP_BATCH_CHUNK], E_nucl[STOP_BATCH_CHUNK], E_stage[STOP_BATCH_CHUNK], h[STOP_BATCH_CHUNK];
+    double k1[STOP_BATCH_CHUNK], k2[STOP_BATCH_CHUNK], k3[STOP_BATCH_CHUNK], k4[STOP_BATCH_CHUNK], stopping[STOP_BATCH_CHUNK], s[STOP_BATCH_CHUNK];
+    size_t idx[STOP_BATCH_CHUNK]; /* Ions that take a proper step (after k1 has been calculated), m of them */
+    size_t m = 0;
+    const ion *incident = ions[0];
+    assert(n <= STOP_BATCH_CHUNK);
+    for(size_t i = 0; i < n; i++) {
+        assert(ions[i]->isotope == incident->isotope);
+        d_next[i] = stop_next_crossing(ions[i], sample, &d[i]);
+        d[i].i = d_next[i].i; /* See stop_step() */
+        E[i] = ions[i]->E;
+    }
+    stop_sample_batch(stop, incident, sample, d, E, E, k1, n);
+    for(size_t i = 0; i < n; i++) { /* Step size and the depths where the rest of the stages are evaluated, ion by ion, exactly as in stop_step() */
+        const double h_max_perp = d_next[i].x - d[i].x;
+        const double h_max = h_max_perp * ions[i]->inverse_cosine_theta;
+        double h_i = step[i] / k1[i];
+        if(k1[i] < STOP_STEP_MINIMUM_STOPPING) {
+            if(STOP_STEP_DEPTH_FALLBACK > h_max_perp) {
+                d[i] = d_next[i];
+            } else {
+                d[i].x += STOP_STEP_DEPTH_FALLBACK;
+            }
+            continue;
+        }
+        h_i = GSL_MAX_DBL(h_i, STOP_STEP_ABSOLUTE_MINIMUM_STEP);
+        halfdepth[m].i = d[i].i;
+        if(h_i >= h_max) {
+            h_i = h_max;
+            halfdepth[m].x = d[i].x + h_max_perp / 2.0;
+            fulldepth[m] = d_next[i];
+            if(h_i < 0.001 * C_TFU) {
+                d[i] = fulldepth[m];
+                continue;
+            }
+        } else {
+            const double h_perp = h_i * ions[i]->cosine_theta;
+            halfdepth[m].x = d[i].x + h_perp / 2.0;
+            fulldepth[m].i = d[i].i;
+            fulldepth[m].x = d[i].x + h_perp;
+        }
+        idx[m] = i;
+        h[m] = h_i;
+        k1[m] = k1[i]; /* Compacting, m <= i */
+        E[m] = E[i];
+        E_nucl[m] = E[i];
+        m++;
+    }
+    if(m == 0) {
+        return;
+    }
+    if(stop->rk4) {
+        for(size_t j = 0; j < m; j++) {
+            E_stage[j] = E[j] - (h[j] / 2.0) * k1[j];
+        }
+        stop_sample_batch(stop, incident, sample, halfdepth, E_stage, E_nucl, k2, m);
+        for(size_t j = 0; j < m; j++) {
+            E_stage[j] = E[j] - (h[j] / 2.0) * k2[j];
+        }
+        stop_sample_batch(stop, incident, sample, halfdepth, E_stage, E_nucl, k3, m);
+        for(size_t j = 0; j < m; j++) {
+            E_stage[j] = E[j] - h[j] * k3[j];
+        }
+        stop_sample_batch(stop, incident, sample, fulldepth, E_stage, E_nucl, k4, m);
+        for(size_t j = 0; j < m; j++) {
+            stopping[j] = (k1[j] + 2.0 * k2[j] + 2.0 * k3[j] + k4[j]) / 6.0;
+        }
+    } else {
+        for(size_t j = 0; j < m; j++) {
+            stopping[j] = k1[j];
+        }
+    }
+    for(size_t j = 0; j < m; j++) {
+        stopping[j] *= -1.0 * h[j]; /* Now this is dE, always negative */
+        E_stage[j] = E[j] + stopping[j];
+    }
+#ifndef NO_STATISTICAL_STRAGGLING
+    stop_sample_batch(stop, incident, sample, fulldepth, E_stage, E_nucl, s, m);
+    for(size_t j = 0; j < m; j++) {
+        ions[idx[j]]->S *= pow2(s[j] / k1[j]);
+    }
+#endif
+    for(size_t j = 0; j < m; j++) {
+        E_stage[j] = E[j] + 0.5 * stopping[j];
+    }
+    stop_sample_batch(stragg, incident, sample, halfdepth, E_stage, E_nucl, s, m);
+    for(size_t j = 0; j < m; j++) {
+        ion *ion_j = ions[idx[j]];
+        ion_j->S += h[j] * s[j];
+        ion_j->E += stopping[j];
+        d[idx[j]] = fulldepth[j];
+    }
+}
+
+void stop_step_batch(const jabs_stop *stop, const jabs_stop *stragg, ion * const *ions, const sample *sample, depth *d, const double *step, size_t n) {
+    if(stop->adaptive) { /* Step sizes are chosen ion by ion, no lockstep possible */
+        for(size_t i = 0; i < n; i++) {
+            d[i] = stop_step(stop, stragg, ions[i], sample, d[i], step[i]);
+        }
+        return;
+    }
+    for(size_t i_start = 0; i_start < n; i_start += STOP_BATCH_CHUNK) {
+        size_t m = GSL_MIN(n - i_start, STOP_BATCH_CHUNK);
+        stop_step_batch_chunk(stop, stragg, ions + i_start, sample, d + i_start, step + i_start, m);
+    }
+}
+
+int stop_sample_exit_batch(const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting, ion *p, size_t n, depth depth_start, const sample *sample) {
+    ion *active[STOP_BATCH_CHUNK];
+    depth d[STOP_BATCH_CHUNK], d_active[STOP_BATCH_CHUNK];
+    double E_step[STOP_BATCH_CHUNK];
+    int last[STOP_BATCH_CHUNK], status[STOP_BATCH_CHUNK], done[STOP_BATCH_CHUNK];
+    if(stop->adaptive) {
+        int status_all = 0;
+        for(size_t i = 0; i < n; i++) {
+            if(stop_sample_exit(stop, stragg, params_exiting, &p[i], depth_start, sample)) {
+                status_all = -1;
+            }
+        }
+        return status_all;
+    }
+    if(n > STOP_BATCH_CHUNK) {
+        int s1 = stop_sample_exit_batch(stop, stragg, params_exiting, p, STOP_BATCH_CHUNK, depth_start, sample);
+        int s2 = stop_sample_exit_batch(stop, stragg, params_exiting, p + STOP_BATCH_CHUNK, n - STOP_BATCH_CHUNK, depth_start, sample);
+        return (s1 || s2) ? -1 : 0;
+    }
+    for(size_t i = 0; i < n; i++) {
+        d[i] = depth_start;
+        last[i] = FALSE;
+        done[i] = FALSE;
+        status[i] = -1;
+    }
+    while(1) { /* Same logic as in stop_sample_exit(), but all ions step simultaneously */
+        size_t m = 0;
+        for(size_t i = 0; i < n; i++) {
+            if(done[i]) {
+                continue;
+            }
+            if((p[i].inverse_cosine_theta > 0.0 && d[i].x >= (sample->thickness - DEPTH_TOLERANCE)) || (p[i].inverse_cosine_theta < 0.0 && d[i].x <= DEPTH_TOLERANCE)) {
+                status[i] = 0;
+                done[i] = TRUE;
+                continue;
+            }
+            if(last[i]) {
+                done[i] = TRUE;
+                continue;
+            }
+            const double emin = GSL_MAX_DBL(stop->emin, p[i].ion_gsto->emin);
+            E_step[m] = stop_step_calc(params_exiting, &p[i]);
+            if(p[i].E - E_step[m] <= emin) {
+                if(p[i].E <= emin) {
+                    done[i] = TRUE;
+                    continue;
+                }
+                E_step[m] = p[i].E - emin;
+                last[i] = TRUE;
+            }
+            active[m] = &p[i];
+            d_active[m] = d[i];
+            m++;
+        }
+        if(m == 0) {
+            break;
+        }
+        stop_step_batch(stop, stragg, active, sample, d_active, E_step, m);
+        for(size_t j = 0; j < m; j++) {
+            d[active[j] - p] = d_active[j];
+        }
+    }
+    for(size_t i = 0; i < n; i++) {
+        if(status[i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
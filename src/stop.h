@@ -16,6 +16,7 @@
 #include "jibal_gsto.h"
 #include "ion.h"
 #include "sample.h"
+#include "stop_table.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -27,7 +28,10 @@ typedef struct jabs_stop {
     gsto_stopping_type type;
     int nuclear_stopping_accurate;
     int rk4;
+    int adaptive; /* Dormand-Prince 5(4) with local error control, step given to stop_step() is an upper limit. Overrides rk4. */
+    double adaptive_tolerance;
     double emin;
+    const stop_tables *tables; /* Precomputed stopping and straggling, can be NULL. stop_sample() falls back to direct calculation when tables don't cover the ion, sample or energy. */
 } jabs_stop;
 
 typedef struct jabs_stop_step_params {
@@ -37,11 +41,21 @@ typedef struct jabs_stop_step_params {
     double sigmas;
 } jabs_stop_step_params;
 
+typedef struct stop_step_state { /* Carried from one adaptive step of an ion to the next, see stop_step_adaptive(). Initialize with zeros. */
+    double step_next; /* Energy step suggested by error control, zero if none */
+    double k_next; /* Stopping at the end of the previous step, which is the first stage of the next one (FSAL). Zero if not valid. */
+} stop_step_state;
+
 depth stop_next_crossing(const ion *incident, const sample *sample, const depth *d_from);
 depth stop_step(const jabs_stop *stop, const jabs_stop *stragg, ion *incident, const sample *sample, depth depth_before, double step);
+depth stop_step_adaptive(const jabs_stop *stop, const jabs_stop *stragg, ion *incident, const sample *sample, depth depth_before, double step, stop_step_state *state); /* Same as stop_step() when stop->adaptive is set, step is an upper limit. Consecutive steps of an ion should share state (can be NULL), then the step is also limited by what error control suggested and one stopping evaluation per step is saved. */
 double stop_sample(const jabs_stop *stop, const ion *incident, const sample *sample, depth depth, double E);
+double stop_ion_element(gsto_stopping_type type, const ion *incident, int Z2, double em); /* Electronic stopping (type GSTO_STO_TOT or GSTO_STO_ELE) or straggling (GSTO_STO_STRAGG) of incident ion in element Z2 at energy per mass em, no corrections */
 double stop_step_calc(const jabs_stop_step_params *params, const ion *ion);
 int stop_sample_exit(const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting, ion *p, depth depth_start, const sample *sample);
+void stop_sample_batch(const jabs_stop *stop, const ion *incident, const sample *sample, const depth *d, const double *E, const double *E_nucl, double *out, size_t n); /* Same as stop_sample() for n energies and depths. Nuclear stopping is evaluated at E_nucl (ion->E in stop_sample()), if E_nucl is NULL then at E. */
+void stop_step_batch(const jabs_stop *stop, const jabs_stop *stragg, ion * const *ions, const sample *sample, depth *d, const double *step, size_t n); /* Same as stop_step() for n ions of the same isotope, d (depth before, array of n) is updated */
+int stop_sample_exit_batch(const jabs_stop *stop, const jabs_stop *stragg, const jabs_stop_step_params *params_exiting, ion *p, size_t n, depth depth_start, const sample *sample); /* Same as stop_sample_exit() for n ions of the same isotope starting from the same depth. Returns zero if all ions exit the sample. */
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,574 @@
+/*
+
+    Jaakko's Backscattering Simulator (JaBS)
+    Copyright (C) 2021 - 2024 Jaakko Julin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    See LICENSE.txt for the full license.
+
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <gsl/gsl_math.h>
+#include "jabs_debug.h"
+#include "defaults.h"
+#include "message.h"
+#include "stop.h"
+#include "stop_table.h"
+
+static void stop_table_direct(const sample *sample, int nuclear_stopping_accurate, const ion *incident, size_t i_row, double E, double *ele, double *nucl, double *stragg) { /* Reference values, computed the same way as stop_sample() does, but for one concentration bin */
+    const double em = E * incident->mass_inverse;
+    ion ion_E = *incident; /* ion_nuclear_stop() uses ion->E */
+    ion_E.E = E;
+    *ele = 0.0;
+    *nucl = 0.0;
+    *stragg = 0.0;
+    for(size_t i_isotope = 0; i_isotope < sample->n_isotopes; i_isotope++) {
+        const double c = *sample_conc_bin(sample, i_row, i_isotope);
+        if(c < CONC_TOLERANCE) {
+            continue;
+        }
+        const jibal_isotope *target = sample->isotopes[i_isotope];
+        *ele += c * stop_ion_element(GSTO_STO_TOT, incident, target->Z, em);
+        *nucl += c * ion_nuclear_stop(&ion_E, target, nuclear_stopping_accurate);
+        *stragg += c * stop_ion_element(GSTO_STO_STRAGG, incident, target->Z, em);
+    }
+}
+
+static void stop_table_free_data(stop_table *t) {
+    if(!t) {
+        return;
+    }
+    free(t->ele);
+    free(t->nucl);
+    free(t->stragg);
+    t->ele = NULL;
+    t->nucl = NULL;
+    t->stragg = NULL;
+}
+
+static int stop_table_compute(stop_table *t, const sample *sample, int nuclear_stopping_accurate, const ion *incident, size_t n) {
+    stop_table_free_data(t);
+    t->n = n;
+    t->n_rows = sample->n_ranges;
+    t->log_E_min = log(t->E_min);
+    t->log_step = (log(t->E_max) - t->log_E_min) / (1.0 * (n - 1));
+    t->log_step_inv = 1.0 / t->log_step;
+    t->ele = malloc(t->n_rows * n * sizeof(double));
+    t->nucl = malloc(t->n_rows * n * sizeof(double));
+    t->stragg = malloc(t->n_rows * n * sizeof(double));
+    if(!t->ele || !t->nucl || !t->stragg) {
+        stop_table_free_data(t);
+        return EXIT_FAILURE;
+    }
+    for(size_t i_row = 0; i_row < t->n_rows; i_row++) {
+        for(size_t i = 0; i < n; i++) {
+            size_t j = i_row * n + i;
+            stop_table_direct(sample, nuclear_stopping_accurate, incident, i_row, exp(t->log_E_min + i * t->log_step), &t->ele[j], &t->nucl[j], &t->stragg[j]);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+static double stop_table_relative_error(double interpolated, double direct) {
+    if(direct <= 0.0) {
+        return interpolated == 0.0 ? 0.0 : 1.0;
+    }
+    return fabs(interpolated - direct) / direct;
+}
+
+static double stop_table_max_error(const stop_table *t, const sample *sample, int nuclear_stopping_accurate, const ion *incident) { /* Compares interpolated values halfway between grid points to directly computed ones */
+    double err_max = 0.0;
+    for(size_t i_row = 0; i_row < t->n_rows; i_row++) {
+        for(size_t i = 0; i < t->n - 1; i++) {
+            size_t j = i_row * t->n + i;
+            double ele, nucl, stragg;
+            stop_table_direct(sample, nuclear_stopping_accurate, incident, i_row, exp(t->log_E_min + (i + 0.5) * t->log_step), &ele, &nucl, &stragg);
+            double err_stop = stop_table_relative_error((t->ele[j] + t->ele[j + 1] + t->nucl[j] + t->nucl[j + 1]) / 2.0, ele + nucl);
+            double err_stragg = stop_table_relative_error((t->stragg[j] + t->stragg[j + 1]) / 2.0, stragg);
+            err_max = GSL_MAX_DBL(err_max, GSL_MAX_DBL(err_stop, err_stragg));
+        }
+    }
+    return err_max;
+}
+
+static int stop_table_init(stop_table *t, const sample *sample, int nuclear_stopping_accurate, const ion *incident, double E_max, double tolerance) {
+    memset(t, 0, sizeof(stop_table));
+    t->incident = incident->isotope;
+    t->E_min = GSL_MAX_DBL(incident->ion_gsto->emin, STOP_TABLE_E_MIN);
+    t->E_max = GSL_MIN_DBL(incident->ion_gsto->emax, E_max);
+    if(incident->Z == 0 || t->E_max <= t->E_min) {
+        DEBUGMSG("No stopping table for %s, energy range from %g keV to %g keV.", incident->isotope->name, t->E_min / C_KEV, t->E_max / C_KEV);
+        return EXIT_SUCCESS; /* Table is empty (n == 0), direct calculation will be used */
+    }
+    size_t n = (size_t) ceil(log10(t->E_max / t->E_min) * STOP_TABLE_POINTS_PER_DECADE) + 1;
+    n = GSL_MAX(n, 2);
+    double err;
+    while(1) {
+        if(stop_table_compute(t, sample, nuclear_stopping_accurate, incident, n)) {
+            return EXIT_FAILURE;
+        }
+        err = stop_table_max_error(t, sample, nuclear_stopping_accurate, incident);
+        DEBUGMSG("Stopping table for %s, %zu points from %g keV to %g keV, %zu rows. Maximum relative error %g.", incident->isotope->name, n, t->E_min / C_KEV, t->E_max / C_KEV, t->n_rows, err);
+        if(err <= tolerance) {
+            break;
+        }
+        if(2 * n - 1 > STOP_TABLE_POINTS_MAX) {
+            jabs_message(MSG_WARNING, "Stopping table for %s does not reach tolerance %g (relative error is %g with %zu points).\n", incident->isotope->name, tolerance, err, n);
+            break;
+        }
+        n = 2 * n - 1; /* Halves the grid spacing */
+    }
+    return EXIT_SUCCESS;
+}
+
+#define STOP_TABLE_CACHE_KEY_ADD(key, size, value) do { if(key) {memcpy((key) + (size), &(value), sizeof(value));} (size) += sizeof(value); } while(0)
+
+static size_t stop_table_cache_key(unsigned char *key, double tolerance, const sample *sample, int nuclear_stopping_accurate, const ion * const *ions, const double *E_max, size_t n_ions) { /* Writes key to key (if not NULL), returns size of key. Range thicknesses, Bragg and straggling corrections are not part of the tables. */
+    size_t size = 0;
+    STOP_TABLE_CACHE_KEY_ADD(key, size, tolerance);
+    STOP_TABLE_CACHE_KEY_ADD(key, size, nuclear_stopping_accurate);
+    STOP_TABLE_CACHE_KEY_ADD(key, size, sample->n_isotopes);
+    STOP_TABLE_CACHE_KEY_ADD(key, size, sample->n_ranges);
+    for(size_t i = 0; i < sample->n_isotopes; i++) {
+        STOP_TABLE_CACHE_KEY_ADD(key, size, sample->isotopes[i]);
+    }
+    for(size_t i = 0; i < sample->n_isotopes * sample->n_ranges; i++) {
+        STOP_TABLE_CACHE_KEY_ADD(key, size, sample->cbins[i]);
+    }
+    STOP_TABLE_CACHE_KEY_ADD(key, size, n_ions);
+    for(size_t i = 0; i < n_ions; i++) {
+        STOP_TABLE_CACHE_KEY_ADD(key, size, ions[i]->isotope);
+        STOP_TABLE_CACHE_KEY_ADD(key, size, ions[i]->ion_gsto);
+        STOP_TABLE_CACHE_KEY_ADD(key, size, ions[i]->nucl_stop);
+        STOP_TABLE_CACHE_KEY_ADD(key, size, E_max[i]);
+    }
+    return size;
+}
+
+static uint64_t stop_table_cache_hash(const unsigned char *key, size_t key_size) { /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < key_size; i++) {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void stop_table_sample_free_data(stop_table_sample *ts) {
+    for(size_t i = 0; i < ts->n_tables; i++) {
+        stop_table_free_data(&ts->t[i]);
+    }
+    free(ts->t);
+    ts->t = NULL;
+    ts->n_tables = 0;
+}
+
+static int stop_table_sample_compute(stop_table_sample *ts, double tolerance, const sample *sample, int nuclear_stopping_accurate, const ion * const *ions, const double *E_max, size_t n_ions) {
+    ts->n_tables = 0;
+    ts->t = calloc(n_ions, sizeof(stop_table));
+    if(!ts->t) {
+        return EXIT_FAILURE;
+    }
+    for(size_t i_ion = 0; i_ion < n_ions; i_ion++) {
+        const ion *incident = ions[i_ion];
+        if(stop_table_init(&ts->t[ts->n_tables], sample, nuclear_stopping_accurate, incident, E_max[i_ion], tolerance)) {
+            jabs_message(MSG_ERROR, "Could not compute stopping table for %s.\n", incident->isotope->name);
+            return EXIT_FAILURE;
+        }
+        ts->n_tables++;
+    }
+    return EXIT_SUCCESS;
+}
+
+static stop_table_cache_entry *stop_table_cache_find(stop_table_cache *c, uint64_t hash, const unsigned char *key, size_t key_size) {
+    for(size_t i = 0; i < c->n; i++) {
+        stop_table_cache_entry *e = &c->entries[i];
+        if(e->hash == hash && e->key_size == key_size && memcmp(e->key, key, key_size) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void stop_table_cache_remove(stop_table_cache *c, size_t i) {
+    stop_table_cache_entry *e = &c->entries[i];
+    stop_table_sample ts = {.sample = NULL, .n_tables = e->n_tables, .t = e->t};
+    c->size -= e->size;
+    stop_table_sample_free_data(&ts);
+    free(e->key);
+    c->n--;
+    if(i != c->n) {
+        *e = c->entries[c->n];
+    }
+}
+
+static void stop_table_cache_evict(stop_table_cache *c) { /* Removes least recently used tables (that are not in use) until memory use is below the limit */
+    while(c->size > c->size_max) {
+        size_t i_lru = c->n;
+        for(size_t i = 0; i < c->n; i++) {
+            const stop_table_cache_entry *e = &c->entries[i];
+            if(e->refcount == 0 && (i_lru == c->n || e->last_used < c->entries[i_lru].last_used)) {
+                i_lru = i;
+            }
+        }
+        if(i_lru == c->n) { /* Everything is in use */
+            break;
+        }
+        DEBUGMSG("Stopping table cache evicts tables %p (%zu bytes), cache size %zu bytes.", (void *) c->entries[i_lru].t, c->entries[i_lru].size, c->size);
+        stop_table_cache_remove(c, i_lru);
+    }
+}
+
+static int stop_table_cache_insert(stop_table_cache *c, uint64_t hash, unsigned char *key, size_t key_size, const stop_table_sample *ts) { /* Cache takes ownership of key and tables of ts on success */
+    if(c->n == c->n_alloc) {
+        size_t n_alloc = c->n_alloc ? c->n_alloc * 2 : 8;
+        stop_table_cache_entry *entries = realloc(c->entries, n_alloc * sizeof(stop_table_cache_entry));
+        if(!entries) {
+            return EXIT_FAILURE;
+        }
+        c->entries = entries;
+        c->n_alloc = n_alloc;
+    }
+    stop_table_cache_entry *e = &c->entries[c->n];
+    e->hash = hash;
+    e->key = key;
+    e->key_size = key_size;
+    e->n_tables = ts->n_tables;
+    e->t = ts->t;
+    e->size = sizeof(stop_table_cache_entry) + key_size + ts->n_tables * sizeof(stop_table);
+    for(size_t i = 0; i < ts->n_tables; i++) {
+        e->size += 3 * ts->t[i].n * ts->t[i].n_rows * sizeof(double);
+    }
+    e->refcount = 1;
+    e->last_used = ++c->clock;
+    c->size += e->size;
+    c->n++;
+    return EXIT_SUCCESS;
+}
+
+static int stop_table_cache_get(stop_table_cache *c, stop_table_sample *ts, double tolerance, const sample *sample, int nuclear_stopping_accurate, const ion * const *ions, const double *E_max, size_t n_ions) { /* Sets tables of ts, computes them if they are not in cache. Tables must be returned with stop_table_cache_release(). */
+    size_t key_size = stop_table_cache_key(NULL, tolerance, sample, nuclear_stopping_accurate, ions, E_max, n_ions);
+    unsigned char *key = malloc(key_size);
+    if(!key) {
+        return stop_table_sample_compute(ts, tolerance, sample, nuclear_stopping_accurate, ions, E_max, n_ions);
+    }
+    stop_table_cache_key(key, tolerance, sample, nuclear_stopping_accurate, ions, E_max, n_ions);
+    uint64_t hash = stop_table_cache_hash(key, key_size);
+    int found = FALSE;
+#pragma omp critical(stop_table_cache)
+    {
+        stop_table_cache_entry *e = stop_table_cache_find(c, hash, key, key_size);
+        if(e) {
+            e->refcount++;
+            e->last_used = ++c->clock;
+            c->hits++;
+            ts->n_tables = e->n_tables;
+            ts->t = e->t;
+            found = TRUE;
+        } else {
+            c->misses++;
+        }
+    }
+    if(found) {
+        free(key);
+        return EXIT_SUCCESS;
+    }
+    stop_table_sample ts_new = {.sample = sample, .n_tables = 0, .t = NULL};
+    if(stop_table_sample_compute(&ts_new, tolerance, sample, nuclear_stopping_accurate, ions, E_max, n_ions)) { /* Not in critical section, other threads can use the cache meanwhile */
+        stop_table_sample_free_data(&ts_new);
+        free(key);
+        return EXIT_FAILURE;
+    }
+    int inserted = FALSE;
+#pragma omp critical(stop_table_cache)
+    {
+        stop_table_cache_entry *e = stop_table_cache_find(c, hash, key, key_size); /* Another thread may have computed the same tables */
+        if(e) {
+            e->refcount++;
+            e->last_used = ++c->clock;
+            ts->n_tables = e->n_tables;
+            ts->t = e->t;
+            found = TRUE;
+        } else if(stop_table_cache_insert(c, hash, key, key_size, &ts_new) == EXIT_SUCCESS) {
+            inserted = TRUE;
+            stop_table_cache_evict(c);
+        }
+    }
+    if(!inserted) {
+        free(key);
+    }
+    if(found) {
+        stop_table_sample_free_data(&ts_new);
+    } else { /* Inserted, or could not be cached (stop_table_cache_release() will free this) */
+        ts->n_tables = ts_new.n_tables;
+        ts->t = ts_new.t;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void stop_table_cache_release(stop_table_cache *c, stop_table_sample *ts) {
+    int found = FALSE;
+    if(!ts->t) {
+        return;
+    }
+#pragma omp critical(stop_table_cache)
+    {
+        for(size_t i = 0; i < c->n; i++) {
+            stop_table_cache_entry *e = &c->entries[i];
+            if(e->t == ts->t) {
+                e->refcount--;
+                found = TRUE;
+                break;
+            }
+        }
+        if(found) {
+            stop_table_cache_evict(c);
+        }
+    }
+    if(!found) { /* Tables were not cached */
+        stop_table_sample_free_data(ts);
+    }
+    ts->t = NULL;
+    ts->n_tables = 0;
+}
+
+stop_table_cache *stop_table_cache_new(size_t size_max) {
+    stop_table_cache *c = calloc(1, sizeof(stop_table_cache));
+    if(!c) {
+        return NULL;
+    }
+    c->size_max = size_max;
+    return c;
+}
+
+void stop_table_cache_free(stop_table_cache *c) {
+    if(!c) {
+        return;
+    }
+    while(c->n) {
+        stop_table_cache_remove(c, c->n - 1);
+    }
+    free(c->entries);
+    free(c);
+}
+
+void stop_table_cache_flush(stop_table_cache *c) {
+    if(!c) {
+        return;
+    }
+#pragma omp critical(stop_table_cache)
+    {
+        size_t i = 0;
+        while(i < c->n) {
+            if(c->entries[i].refcount == 0) {
+                stop_table_cache_remove(c, i); /* Last entry is moved to i */
+            } else {
+                i++;
+            }
+        }
+        c->hits = 0;
+        c->misses = 0;
+    }
+}
+
+void stop_table_cache_print_stats(const stop_table_cache *c, jabs_msg_level msg_level) {
+    if(!c || c->hits + c->misses == 0) {
+        return;
+    }
+    jabs_message(msg_level, "Stopping table cache: %zu hits, %zu misses, %zu table sets (%.1lf kB).\n", c->hits, c->misses, c->n, c->size / 1024.0);
+}
+
+stop_tables *stop_tables_new(double tolerance, stop_table_cache *cache) {
+    stop_tables *st = malloc(sizeof(stop_tables));
+    if(!st) {
+        return NULL;
+    }
+    st->n_samples = 0;
+    st->samples = NULL;
+    st->tolerance = tolerance;
+    st->cache = cache;
+    return st;
+}
+
+void stop_tables_free(stop_tables *st) {
+    if(!st) {
+        return;
+    }
+    for(size_t i_sample = 0; i_sample < st->n_samples; i_sample++) {
+        stop_table_sample *ts = &st->samples[i_sample];
+        if(st->cache) {
+            stop_table_cache_release(st->cache, ts);
+        } else {
+            stop_table_sample_free_data(ts);
+        }
+    }
+    free(st->samples);
+    free(st);
+}
+
+stop_tables *stop_tables_view(const stop_tables *st) {
+    if(!st) {
+        return NULL;
+    }
+    stop_tables *view = malloc(sizeof(stop_tables));
+    if(!view) {
+        return NULL;
+    }
+    *view = *st;
+    view->samples = malloc(st->n_samples * sizeof(stop_table_sample));
+    if(!view->samples && st->n_samples) {
+        free(view);
+        return NULL;
+    }
+    if(st->n_samples) {
+        memcpy(view->samples, st->samples, st->n_samples * sizeof(stop_table_sample));
+    }
+    return view;
+}
+
+void stop_tables_view_free(stop_tables *view) {
+    if(!view) {
+        return;
+    }
+    free(view->samples);
+    free(view);
+}
+
+int stop_tables_add_sample(stop_tables *st, const sample *sample, int nuclear_stopping_accurate, const ion * const *ions, const double *E_max, size_t n_ions) {
+    if(!st || !sample || sample->n_ranges == 0) {
+        return EXIT_FAILURE;
+    }
+    stop_table_sample *samples_new = realloc(st->samples, (st->n_samples + 1) * sizeof(stop_table_sample));
+    if(!samples_new) {
+        return EXIT_FAILURE;
+    }
+    st->samples = samples_new;
+    stop_table_sample *ts = &st->samples[st->n_samples];
+    ts->sample = sample;
+    ts->n_tables = 0;
+    ts->t = NULL;
+    st->n_samples++;
+    if(st->cache) {
+        return stop_table_cache_get(st->cache, ts, st->tolerance, sample, nuclear_stopping_accurate, ions, E_max, n_ions);
+    }
+    return stop_table_sample_compute(ts, st->tolerance, sample, nuclear_stopping_accurate, ions, E_max, n_ions);
+}
+
+int stop_tables_bind(stop_tables *st, const sample *sample_old, const sample *sample_new) {
+    if(!st || !sample_old || !sample_new) {
+        return EXIT_FAILURE;
+    }
+    if(sample_old == sample_new) {
+        return EXIT_SUCCESS;
+    }
+    for(size_t i_sample = 0; i_sample < st->n_samples; i_sample++) {
+        stop_table_sample *ts = &st->samples[i_sample];
+        if(ts->sample != sample_old) {
+            continue;
+        }
+        if(sample_old->n_ranges != sample_new->n_ranges || sample_old->n_isotopes != sample_new->n_isotopes || sample_old->no_conc_gradients != sample_new->no_conc_gradients) {
+            return EXIT_FAILURE;
+        }
+        if(memcmp(sample_old->isotopes, sample_new->isotopes, sample_old->n_isotopes * sizeof(jibal_isotope *)) != 0) {
+            return EXIT_FAILURE;
+        }
+        if(memcmp(sample_old->cbins, sample_new->cbins, sample_old->n_ranges * sample_old->n_isotopes * sizeof(double)) != 0) {
+            return EXIT_FAILURE;
+        }
+        ts->sample = sample_new;
+        return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
+
+static inline int stop_table_interpolate(const stop_table *t, const double *data, size_t i_row, double E, double *out) {
+    if(E < t->E_min || E > t->E_max) {
+        return EXIT_FAILURE;
+    }
+    double u = (log(E) - t->log_E_min) * t->log_step_inv;
+    size_t i = (size_t) u;
+    if(i >= t->n - 1) {
+        i = t->n - 2; /* Only when E == E_max (or very close to it) */
+    }
+    const double *row = data + i_row * t->n;
+    double frac = u - i;
+    *out = row[i] + frac * (row[i + 1] - row[i]);
+    return EXIT_SUCCESS;
+}
+
+static int stop_table_row_value(const stop_table *t, const double *data, const sample *sample, depth d, double E, double *out) { /* Handles concentration gradients the same way get_conc() does */
+    if(stop_table_interpolate(t, data, d.i, E, out)) {
+        return EXIT_FAILURE;
+    }
+    if(sample->no_conc_gradients || d.i + 1 >= sample->n_ranges) {
+        return EXIT_SUCCESS;
+    }
+    double width = sample->ranges[d.i + 1].x - sample->ranges[d.i].x;
+    if(width == 0.0) {
+        return EXIT_SUCCESS;
+    }
+    double next;
+    if(stop_table_interpolate(t, data, d.i + 1, E, &next)) {
+        return EXIT_FAILURE;
+    }
+    *out += (next - *out) * (d.x - sample->ranges[d.i].x) / width;
+    return EXIT_SUCCESS;
+}
+
+int stop_tables_get(const stop_tables *st, gsto_stopping_type type, const ion *incident, const sample *sample, depth d, double E, double *out) {
+    const stop_table *t = NULL;
+    for(size_t i_sample = 0; i_sample < st->n_samples; i_sample++) {
+        const stop_table_sample *ts = &st->samples[i_sample];
+        if(ts->sample != sample) {
+            continue;
+        }
+        for(size_t i = 0; i < ts->n_tables; i++) {
+            if(ts->t[i].incident == incident->isotope) {
+                t = &ts->t[i];
+                break;
+            }
+        }
+        break;
+    }
+    if(!t || t->n == 0 || d.i >= t->n_rows) {
+        return EXIT_FAILURE;
+    }
+    double S, S_nucl;
+    switch(type) {
+        case GSTO_STO_TOT:
+            if(stop_table_row_value(t, t->ele, sample, d, E, &S) || stop_table_row_value(t, t->nucl, sample, d, incident->E, &S_nucl)) {
+                return EXIT_FAILURE;
+            }
+            *out = (S + S_nucl) * sample->ranges[d.i].bragg;
+            return EXIT_SUCCESS;
+        case GSTO_STO_STRAGG:
+            if(stop_table_row_value(t, t->stragg, sample, d, E, &S)) {
+                return EXIT_FAILURE;
+            }
+            *out = S * sample->ranges[d.i].stragg;
+            return EXIT_SUCCESS;
+        default:
+            return EXIT_FAILURE;
+    }
+}
+
+size_t stop_tables_size(const stop_tables *st) {
+    size_t n = 0;
+    if(!st) {
+        return 0;
+    }
+    for(size_t i_sample = 0; i_sample < st->n_samples; i_sample++) {
+        const stop_table_sample *ts = &st->samples[i_sample];
+        for(size_t i = 0; i < ts->n_tables; i++) {
+            n += ts->t[i].n * ts->t[i].n_rows;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,90 @@
+/*
+
+    Jaakko's Backscattering Simulator (JaBS)
+    Copyright (C) 2021 - 2024 Jaakko Julin
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    See LICENSE.txt for the full license.
+
+ */
+#ifndef JABS_STOP_TABLE_H
+#define JABS_STOP_TABLE_H
+#include <stdint.h>
+#include <jibal_gsto.h>
+#include "ion.h"
+#include "sample.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct stop_table { /* Stopping and straggling of one ion in one sample, tabulated on a logarithmic energy grid. One row per concentration bin (sample range) */
+    const jibal_isotope *incident;
+    size_t n; /* Number of energy points in each row */
+    size_t n_rows; /* Same as sample->n_ranges */
+    double E_min;
+    double E_max;
+    double log_E_min;
+    double log_step; /* Grid spacing, log(E[i+1]/E[i]) */
+    double log_step_inv;
+    double *ele; /* 2D-table, size n_rows * n. Concentration weighted sum of electronic stopping. Bragg correction is not included. */
+    double *nucl; /* Same as above, but nuclear stopping. Looked up using incident->E, like ion_nuclear_stop() does. */
+    double *stragg; /* Same as above, but straggling. Straggling correction is not included. */
+} stop_table;
+
+typedef struct stop_table_sample {
+    const sample *sample; /* Tables are valid for this sample (or any sample with identical isotopes and concentrations, see stop_tables_bind()) */
+    size_t n_tables;
+    stop_table *t; /* Array, n_tables elements, one for each ion */
+} stop_table_sample;
+
+typedef struct stop_table_cache_entry {
+    uint64_t hash;
+    unsigned char *key; /* Everything the tables depend on (composition of sample, ions, energy ranges), see stop_table_cache_key() */
+    size_t key_size;
+    size_t n_tables;
+    stop_table *t; /* Array, n_tables elements */
+    size_t size; /* Memory used by this entry (bytes), approximately */
+    int refcount; /* Number of stop_tables using this entry, entry is not evicted while this is non-zero */
+    size_t last_used; /* Value of stop_table_cache->clock when this entry was last used */
+} stop_table_cache_entry;
+
+typedef struct stop_table_cache { /* Stopping tables of sample compositions, shared by workspaces. Least recently used tables are evicted when memory use exceeds size_max. */
+    stop_table_cache_entry *entries; /* Array, n elements */
+    size_t n;
+    size_t n_alloc;
+    size_t size; /* Total memory used by entries (bytes) */
+    size_t size_max;
+    size_t clock;
+    size_t hits;
+    size_t misses;
+} stop_table_cache;
+
+typedef struct stop_tables {
+    size_t n_samples;
+    stop_table_sample *samples; /* Array, n_samples elements */
+    double tolerance; /* Maximum relative error of interpolated values, checked between grid points when tables are computed */
+    stop_table_cache *cache; /* Tables are owned by this cache, NULL if they are owned by st */
+} stop_tables;
+
+stop_table_cache *stop_table_cache_new(size_t size_max);
+void stop_table_cache_free(stop_table_cache *c);
+void stop_table_cache_flush(stop_table_cache *c); /* Frees all tables that are not in use */
+void stop_table_cache_print_stats(const stop_table_cache *c, jabs_msg_level msg_level);
+stop_tables *stop_tables_new(double tolerance, stop_table_cache *cache); /* Tables of samples are taken from cache (if not NULL) when a sample with the same composition has been added earlier */
+void stop_tables_free(stop_tables *st);
+stop_tables *stop_tables_view(const stop_tables *st); /* Shares the tables of st, but can be bound (see stop_tables_bind()) independently, e.g. by another thread. Do not add samples to a view. */
+void stop_tables_view_free(stop_tables *view);
+int stop_tables_add_sample(stop_tables *st, const sample *sample, int nuclear_stopping_accurate, const ion * const *ions, const double *E_max, size_t n_ions); /* Computes tables for all ions (E_max is an array of maximum energies, one for each ion), or gets them from the cache of st */
+int stop_tables_bind(stop_tables *st, const sample *sample_old, const sample *sample_new); /* Makes tables computed for sample_old usable with sample_new, if concentrations and isotopes are identical. Returns EXIT_FAILURE if this is not possible. */
+int stop_tables_get(const stop_tables *st, gsto_stopping_type type, const ion *incident, const sample *sample, depth d, double E, double *out); /* Sets *out and returns EXIT_SUCCESS if a table covers the given ion, sample and energy. */
+size_t stop_tables_size(const stop_tables *st); /* Total number of energy points in all tables (summed over rows) */
+#ifdef __cplusplus
+}
+#endif
+#endif // JABS_STOP_TABLE_H
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <jibal.h>
+#include "ion.h"
+#include "jabs.h"
+#include "stop.h"
+#include "generic.h"
+
+#define STOP_TEST_N_POINTS 10000
+#define STOP_TEST_REPEATS 100
+#define STOP_TEST_E_MIN (100.0 * C_KEV)
+#define STOP_TEST_E_MAX (3000.0 * C_KEV)
+#define STOP_TEST_X_MAX (5000.0 * C_TFU) /* Points are spread over several layers, so that a batch contains different compositions */
+
+static double stop_test_scalar(const jabs_stop *stop, const ion *incident, const sample *sample, const depth *d, const double *E, double *out) { /* Time per evaluation, in seconds */
+    double start = jabs_clock();
+    for(int i_repeat = 0; i_repeat < STOP_TEST_REPEATS; i_repeat++) {
+        for(int i = 0; i < STOP_TEST_N_POINTS; i++) {
+            ion ion_i = *incident;
+            ion_i.E = E[i];
+            out[i] = stop_sample(stop, &ion_i, sample, d[i], E[i]);
+        }
+    }
+    return (jabs_clock() - start) / (1.0 * STOP_TEST_REPEATS * STOP_TEST_N_POINTS);
+}
+
+static double stop_test_batch(const jabs_stop *stop, const ion *incident, const sample *sample, const depth *d, const double *E, double *out) {
+    double start = jabs_clock();
+    for(int i_repeat = 0; i_repeat < STOP_TEST_REPEATS; i_repeat++) {
+        stop_sample_batch(stop, incident, sample, d, E, NULL, out, STOP_TEST_N_POINTS);
+    }
+    return (jabs_clock() - start) / (1.0 * STOP_TEST_REPEATS * STOP_TEST_N_POINTS);
+}
+
+static double stop_test_max_error(const double *out, const double *ref) { /* Maximum relative difference */
+    double error_max = 0.0;
+    for(int i = 0; i < STOP_TEST_N_POINTS; i++) {
+        if(ref[i] != 0.0) {
+            error_max = GSL_MAX_DBL(error_max, fabs(out[i] - ref[i]) / fabs(ref[i]));
+        } else if(out[i] != 0.0) {
+            return INFINITY;
+        }
+    }
+    return error_max;
+}
+
+static void stop_test_run(const char *name, const jabs_stop *stop, const ion *incident, const sample *sample, const depth *d, const double *E, double *ref, double *out) {
+    double t_scalar = stop_test_scalar(stop, incident, sample, d, E, ref);
+    double t_batch = stop_test_batch(stop, incident, sample, d, E, out);
+    fprintf(stderr, "%-30s stop_sample() %8.3lf ns, stop_sample_batch() %8.3lf ns, max rel difference %9.3e\n", name, t_scalar * 1.0e9, t_batch * 1.0e9, stop_test_max_error(out, ref));
+}
+
+int main(int argc, char **argv) {
+    (void) argc;
+    (void) argv;
+    jibal *jibal = jibal_init(NULL);
+    if(jibal->error) {
+        fprintf(stderr, "Initializing JIBAL failed with error code %i (%s)\n", jibal->error, jibal_error_string(jibal->error));
+        return EXIT_FAILURE;
+    }
+    ion testion;
+    ion_reset(&testion);
+    ion_set_isotope(&testion, jibal_isotope_find(jibal->isotopes, "4He", 0, 0));
+    testion.E = STOP_TEST_E_MAX;
+    testion.nucl_stop = nuclear_stopping_new(testion.isotope, jibal->isotopes);
+    sample_model *sm = sample_model_from_string(jibal, "Au 100tfu SiO2 1000tfu TiN 1000tfu Si 300000tfu");
+    sample *sample = sample_from_sample_model(sm);
+    simulation *sim = sim_init(jibal);
+    sim->sample = sample;
+    assign_stopping(jibal->gsto, sim);
+    jibal_gsto_load_all(jibal->gsto);
+    sim_workspace *ws = sim_workspace_init(jibal, sim, sim->det[0]);
+    depth *d = malloc(STOP_TEST_N_POINTS * sizeof(depth));
+    double *E = malloc(STOP_TEST_N_POINTS * sizeof(double));
+    double *ref = malloc(STOP_TEST_N_POINTS * sizeof(double));
+    double *out = malloc(STOP_TEST_N_POINTS * sizeof(double));
+    for(int i = 0; i < STOP_TEST_N_POINTS; i++) { /* Depth and energy change from point to point, like the ions of stop_step_batch() */
+        d[i] = depth_seek(sample, STOP_TEST_X_MAX * (0.5 + 0.5 * sin(1.0 * i)));
+        E[i] = STOP_TEST_E_MIN + (STOP_TEST_E_MAX - STOP_TEST_E_MIN) * (0.5 + 0.5 * cos(0.7 * i));
+    }
+    fprintf(stderr, "Stopping of %s, %i points, %i repeats:\n", testion.isotope->name, STOP_TEST_N_POINTS, STOP_TEST_REPEATS);
+    jabs_stop stop = ws->stop;
+    jabs_stop stragg = ws->stragg;
+    stop.tables = NULL;
+    stragg.tables = NULL;
+    stop_test_run("stopping, direct", &stop, &testion, sample, d, E, ref, out);
+    stop_test_run("straggling, direct", &stragg, &testion, sample, d, E, ref, out);
+    if(ws->stop.tables) {
+        stop_test_run("stopping, tables", &ws->stop, &testion, sample, d, E, ref, out);
+        stop_test_run("straggling, tables", &ws->stragg, &testion, sample, d, E, ref, out);
+    }
+    sample->no_conc_gradients = TRUE; /* Concentrations from the bins, like a sample without gradients */
+    stop_test_run("stopping, no gradients", &stop, &testion, sample, d, E, ref, out);
+    free(d);
+    free(E);
+    free(ref);
+    free(out);
+    sim_workspace_free(ws);
+    return EXIT_SUCCESS;
+}